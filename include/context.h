@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2022 Roelof Bart Toonen
+ * License: MIT license (spdx.org MIT)
+ *
+ * Run context: the settings of an analysis. The init and set functions of the set, fn, bundle and traverse
+ * functions store their parameters in the context of the calling thread, and traverse_all and the functions
+ * the init functions return use it. That is the default context, unless set_context selected another one.
+ * So analyses in different threads, each in its own context, do not share settings.
+ * What an analysis keeps while it runs is per thread: a thread runs one analysis at a time.
+ */
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdbool.h>
+#include "sets.h"
+#include "fn.h"
+#include "fn_exp.h"
+#include "fn_tls.h"
+
+typedef struct
+{
+    bool            view;            /*coordinates as a view on the time series data, see set_embed_view*/
+} Tmkembed_context;
+
+typedef struct
+{
+    long            lib_size_min, lib_size_max, lib_inc_start, lib_shift;
+    float           lib_inc_inc_factor;
+    Tlib_shift_meth lib_shift_meth;
+    long            n_bootstrap;     /*convergent library and bootstrap*/
+    int             boot_n_thread;
+    int             k_fold, n_repetition;
+    long            boot_lib_size;
+    bool            pre_set_is_lib, lib_size_is_emb_size, per_addit_group;
+    Trng_kind       rng_kind;
+    unsigned long   rng_seed;
+} Tsets_context;
+
+typedef struct
+{
+    int             n_thread;
+    double          nn_eps;
+    long            nn_max_leaf;
+    bool            nn_calibrate;
+    long            nn_cache_max;
+    Tfn_weight_mode weight_mode;
+} Tfn_context;
+
+typedef struct
+{
+    int       nnn_add;   /*number of nearest neighbours to add to the embedding dimension*/
+    Texcl     excl;      /*how to exclude vectors from the library, based upon the predictee vector*/
+    int       var_win;
+    Tfn_denom fn_denom;
+    double    exp_k;
+    bool      object_only_once;
+} Tfn_exp_context;
+
+typedef struct
+{
+    int           nnn;   /*when greater than 0, tls only on the nnn nearest neighbours (for large datasets)*/
+    Texcl         excl;
+    int           var_win;
+    double        theta_min, theta_max, delta_theta;
+    bool          center;
+    double        restrict_prediction;
+    Ttls_solver   solver;
+    Ttls_ref_meth ref_meth;
+    int           ref_xnn;
+    bool          warn_is_error;
+    bool          object_only_once;
+} Tfn_tls_context;
+
+typedef struct
+{
+    double *filter_val;
+    int    n_filter_val;
+} Tbundle_context;
+
+typedef struct
+{
+    int    n_thread;
+    double *boot_percentile;     /*percentiles of the bootstrap statistics, see set_traverse_boot_percentile*/
+    int    n_boot_percentile;
+} Ttraverse_context;
+
+typedef struct
+{
+    Tmkembed_context mkembed;
+    Tsets_context   sets;
+    Tfn_context     fn;
+    Tfn_exp_context fn_exp;
+    Tfn_tls_context fn_tls;
+    Tbundle_context bundle;
+    Ttraverse_context traverse;
+} Tcontext;
+
+/* The context of the calling thread. The threads of the parallel regions get it with copyin.*/
+extern Tcontext *g_context;
+#pragma omp threadprivate(g_context)
+
+Tcontext *
+new_context (void);
+
+void
+free_context (Tcontext *ctx);
+
+Tcontext *
+set_context (Tcontext *ctx);
+
+#endif
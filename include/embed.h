@@ -40,6 +40,21 @@ typedef struct
     int     lag;
 } Taddit_val_meta;
 
+/* View on the time series data, for an embedding without co_val and t_co matrices (see set_embed_view).
+ * Coordinate j of the vector of source row r (the row of lag 0 in the time series data) is
+ * dat[r * n_col + co_off[j]], with t value t[r + t_off[j]].
+ */
+typedef struct
+{
+    const double *dat;
+    const long   *t;
+    long         n_col;      /*number of columns of dat*/
+    int          e;
+    long         *co_off;    /*size = e*/
+    long         *t_off;     /*size = e*/
+    long         *row;       /*source row of each row of the embedding, size = n_row*/
+} Temb_view;
+
 typedef struct
 {
     int             emb_num;
@@ -54,8 +69,9 @@ typedef struct
     char            **id_arr;              /*array of pointers to id's  size = n_row*/
     long            *id_start_row;         /*array of indexes that specify where an id block starts, size=n_id*/
     long            *vec_num;              /*vector number, unique. Equal to row number in the matrices*/
-    long            *t_co_mat;             /*t matrix for co_val's  size = n_row*e */
-    double          *co_val_mat;           /*co_value matrix   size = n_row*e */
+    long            *t_co_mat;             /*t matrix for co_val's  size = n_row*e, NULL with a view*/
+    double          *co_val_mat;           /*co_value matrix   size = n_row*e, NULL with a view*/
+    Temb_view       *view;                 /*NULL, or the view that replaces co_val_mat and t_co_mat*/
     double          *pre_val_mat;          /*pre_val matrix    size = n_row*n_pre_val*/
     double          *bundle_mat;           /*bundle val matrix size = n_row*n_bundle_val*/
     long            *t_pre_mat;            /*t matrix for pre_val's, size = n_row*n_pre_val*/
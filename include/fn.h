@@ -7,20 +7,80 @@
 #ifndef FN_H
 #define FN_H
 
+#include <stdint.h>
 #include "point.h"
 
 typedef enum { FN_EXP, FN_TLS } Tfn_type;
 
+/* Weights exp(-theta * distance / reference distance) of the fn functions*/
+typedef enum { FN_WEIGHT_EXACT,   /*exp of the math library*/
+               FN_WEIGHT_FAST     /*vectorised approximation, relative error below FN_WEIGHT_FAST_MAX_ERR*/
+             } Tfn_weight_mode;
+
+#define FN_WEIGHT_FAST_MAX_ERR 1.0e-12
+
+#define FN_NN_BATCH 4096  /*number of targets of which the neighbours are searched in one batch*/
+#define FN_NN_CACHE_MAX (1024L * 1024 * 1024)  /*default maximum size in bytes of the neighbour cache*/
+
 typedef int (*Tfn) (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted);
 typedef int (*Tnew_fn_params) (int e, void **fn_params);
 typedef int (*Tnext_fn_params) (void **fn_params);
 
+int
+set_fn_n_thread (int n_thread);
+
+int
+get_fn_n_thread (void);
+
+Tkdt_forest *
+fn_kdt_forest (Tpoint_set *set);
+
+int
+set_fn_nn_approx (double eps, long max_leaf);
+
+int
+set_fn_nn_calibrate (bool calibrate);
+
+Tkdt_search *
+new_fn_kdt_search (int e);
+
+int
+set_fn_nn_cache_max (long max);
+
+void
+fn_nn_cache_clear (void);
+
+void
+fn_nn_cache_rewind (void);
+
+uint64_t
+fn_set_fingerprint (Tpoint_set *lib_set, Tpoint_set *pre_set);
+
+int
+fn_nn_begin (Tpoint_set *lib_set, Tpoint_set *pre_set, int nnn, bool object_only_once, bool store);
+
+int
+fn_nn_batch (Tpoint_set *lib_set, Tpoint_set *pre_set, long i_first, long n_batch, int nnn,
+             bool object_only_once, Tpoint **rs, double *sqdst, int *n_found, int n_thread);
+
+int
+set_fn_weight_mode (Tfn_weight_mode mode);
+
+double
+fn_exp_weights (const double *dist, int n, bool squared, double fact, double *u);
+
+void
+fn_weighted_sum (const double *u, double scale, Tpoint **pt, int n, int n_val, double *out);
+
 int
 log_fn (Tfn_type fn_type);
 
 int
 log_nn (Tpoint *target, Tpoint **rs, double *sqdst, int n);
 
+int
+log_nn_calibrate (double eps, long max_leaf, double recall, double dst_ratio);
+
 int
 log_predicted (Tpoint **pt, int n, int n_val, double *pre_val, int *status);
 
@@ -17,7 +17,7 @@ init_fn_exponential (Tnew_fn_params *new_fn_params,
                      Tfn *fn,
                      int nnn_add, Texcl excl, int var_win,
                      Tfn_denom fn_denom, double exp_k,
-                     bool object_only_once);
+                     bool object_only_once, double nn_eps, long nn_max_leaf);
 
 typedef struct
 {
@@ -47,6 +47,23 @@ static Trec_meta _m = { LOG_NN, "NN", 3, &_s, \
     } \
 }
 
+struct s_log_nncal {
+    double eps;
+    long max_leaf;
+    double recall;
+    double dst_ratio;
+};
+
+#define ATTACH_META_NNCAL(_m, _s) \
+static Trec_meta _m = { LOG_NNCAL, "NNCAL", 4, &_s, \
+    { \
+        { "nncal_eps", FT_DOUBLE, -1, &_s.eps }, \
+        { "nncal_max_leaf", FT_LONG, -1, &_s.max_leaf }, \
+        { "nncal_recall", FT_DOUBLE, -1, &_s.recall }, \
+        { "nncal_dst_ratio", FT_DOUBLE, -1, &_s.dst_ratio } \
+    } \
+}
+
 struct s_log_tg2 {
     long target_num;
 };
@@ -12,13 +12,27 @@
 
 typedef enum { KTLS_REFMETH_MEAN, KTLS_REFMETH_XNN_GT_ZERO } Ttls_ref_meth;
 
+/* Solver of the total least squares problems.
+ * KTLS_SOLVER_DTLS:  dtls (LINPACK based), the reference.
+ * KTLS_SOLVER_SVD:   LAPACK dgesvd of the augmented matrix.
+ * KTLS_SOLVER_GRAM:  LAPACK dsyev of the gram matrix of the augmented matrix, the fastest for many points.
+ *                    When the gram matrix is too ill-conditioned for that, dgesvd of the augmented matrix.
+ * KTLS_SOLVER_CHECK: dtls, and the largest differences of the other solvers with it, which are logged
+ *                    (TLSCHK records, log level LOG_DTLS_STATUS) and given by get_tls_check_diff.
+ */
+typedef enum { KTLS_SOLVER_DTLS, KTLS_SOLVER_SVD, KTLS_SOLVER_GRAM, KTLS_SOLVER_CHECK } Ttls_solver;
+
 int
 init_fn_tls (Tnew_fn_params *new_fn_params,
              Tnext_fn_params *next_fn_params,
              Tfn *fn,
              double theta_min, double theta_max, double delta_theta,
              int nnn, Texcl excl, int var_win, bool center, double restrict_prediction,
-             bool warn_is_error, Ttls_ref_meth ref_meth, int ref_xnn, bool object_only_once);
+             bool warn_is_error, Ttls_ref_meth ref_meth, int ref_xnn, bool object_only_once,
+             Ttls_solver solver, double nn_eps, long nn_max_leaf);
+
+int
+get_tls_check_diff (double *svd_diff, double *gram_diff);
 
 typedef struct
 {
@@ -91,6 +91,19 @@ static Trec_meta _m = { LOG_DTLSO, "DTLSO", 10, &_s, \
     } \
 }
 
+struct s_log_tlschk {
+    double  svd_diff;
+    double  gram_diff;
+};
+
+#define ATTACH_META_TLSCHK(_m, _s) \
+static Trec_meta _m = { LOG_TLSCHK, "TLSCHK", 2, &_s, \
+    { \
+        { "tlschk_svd_diff", FT_DOUBLE, -1, &_s.svd_diff }, \
+        { "tlschk_gram_diff", FT_DOUBLE, -1, &_s.gram_diff } \
+    } \
+}
+
 struct s_log_dtlsan {    /*Name of array*/
     char    name;  /*C, S, X*/
     long    nrow;
@@ -8,24 +8,150 @@
 #ifndef KDT_H
 #define KDT_H
 #include <stdbool.h>
+#include <stdint.h>
 
 
-typedef struct kdtNode
+#define KDT_DEFAULT_BUCKET_SIZE 8
+#define KDT_MAX_BUCKET_SIZE     4096
+#define KDT_MAX_KEY             2
+
+#define KDT_FOREST_BASE         256  /*maximum number of points in the smallest tree of a forest*/
+#define KDT_FOREST_MAX_TREE     24   /*tree i of a forest has at most KDT_FOREST_BASE << i points*/
+
+/* Flags per point*/
+#define KDT_FLAG_DELETED        1    /*the point has been deleted from a forest, searches skip it*/
+#define KDT_FLAG_MASKED         2    /*the point is masked (e.g. a held-out fold), searches skip it*/
+
+/* A node of a k-d tree. A node with children holds the median point of its subtree.
+ * A leaf holds a bucket of at most bucket_size points.
+ * The cnt points of a node start at point pt. Their coordinates are stored dimension by dimension
+ * (coordinate d of point j at vec[pt * k + d * cnt + j]), their objects at obj[pt + j].
+ */
+typedef struct
 {
-    struct kdtNode *l, *r;
-    double *vec;
-    void   *obj;
-    int    dm;
-    double val;
+    double  val;     /*split value*/
+    int32_t l, r;    /*indices of the child nodes, -1 if none*/
+    int32_t pt;      /*index of the first point*/
+    int16_t dm;      /*split dimension*/
+    int16_t cnt;     /*number of points*/
 } TkdtNode;
 
-TkdtNode *kdtree (void **, long, int, double * (*)(void *));
-void free_kdt (TkdtNode *);
-int kdt_nn (void *, TkdtNode *, int, int, void **, double *,
+typedef struct
+{
+    int    bucket_size;  /*maximum number of points in a leaf, 1 gives one point per node*/
+    bool   simd;         /*compute distances in leaves with vector instructions, when the cpu has them*/
+    int    n_thread;     /*number of threads to build the tree, smaller than 1: all processors*/
+    int    n_key;        /*number of keys per object (e.g. time), for exclusion windows, at most KDT_MAX_KEY*/
+    void   (*getkey)(void *, long *);  /*fills the n_key keys of an object*/
+} Tkdt_opt;
+
+/* A k-d tree: the header, the nodes, the coordinates and the objects are in one allocation.
+ * Nodes are stored in depth-first order, so a subtree is contiguous in memory.
+ */
+typedef struct
+{
+    int      k;        /*dimension*/
+    int      bucket_size;
+    bool     simd;
+    int32_t  root;     /*index of the root node, -1 if the tree is empty*/
+    long     n_node;   /*number of nodes in use*/
+    long     n_point;  /*number of points in use*/
+    long     n_alloc;  /*number of nodes and of points for which there is memory*/
+    TkdtNode *node;
+    double   *vec;     /*copied coordinates, k per point*/
+    void     **obj;    /*every object occurs once in a tree*/
+    int32_t  *mult;    /*per point: the number of times the object was given (e.g. in a bootstrap sample)*/
+    uint8_t  *flag;    /*per point: KDT_FLAG_... bits*/
+    int      n_key;
+    void     (*getkey)(void *, long *);
+    long     *key;     /*n_key keys per point*/
+    long     *key_lo;  /*per node, n_key lowest keys of the points in its subtree*/
+    long     *key_hi;  /*per node, n_key highest keys of the points in its subtree*/
+} Tkdt;
+
+/* A forest of static k-d trees, for a set of points that changes (the logarithmic method).
+ * Inserted points are merged with the smallest trees into one new, balanced tree; an object that is
+ * already in the forest gets a higher multiplicity.
+ * Deleted points are flagged, and the forest is rebuilt when more than half of its points are deleted.
+ * Masked points stay in the forest, but are skipped by searches until they are unmasked.
+ */
+typedef struct
+{
+    int      k;
+    double   * (*getvec)(void *);
+    Tkdt_opt opt;
+    Tkdt     *tree[KDT_FOREST_MAX_TREE];  /*NULL or a tree with at most KDT_FOREST_BASE << i points*/
+    long     n_point;    /*number of points, without the deleted ones*/
+    long     n_deleted;  /*number of deleted points still in the trees*/
+} Tkdt_forest;
+
+/* Search context: everything that is written during a nearest neighbour search.
+ * A tree is only read by a search, so several threads can query the same tree,
+ * as long as each thread uses its own context.
+ */
+typedef struct
+{
+    int    k_alloc;        /*dimension for which hr_l and hr_h are allocated*/
+    double *hr_l, *hr_h;   /*hyperrectangle boundaries*/
+    /* State of the current query, set by kdt_nn_r */
+    const Tkdt *tree;
+    void   *tgob;
+    double *tg;
+    int    k;
+    int    n;
+    void   **rs;       /*during the search a max-heap of n_found objects, sorted afterwards*/
+    double *sqdst;
+    int    n_found;
+    double radius;         /*square distance of the farthest neighbour, DBL_MAX while less than n found*/
+    bool   (*exclude)(void *, void *);
+    bool   (*exclude_r)(void *, void *, void *);  /*NULL, or used instead of exclude, set by kdt_search_exclude*/
+    void   *exclude_arg;   /*third argument of exclude_r*/
+    bool   object_only_once;
+    bool   bwb;            /*ball within bounds*/
+    void   (*sqdst_block)(const double *, long, int, int, const double *, double *);
+    /* Exclusion windows, set by kdt_search_excl_win. An object is excluded when, for some key,
+     * |key - key of the target| < excl_win.
+     */
+    long   excl_win[KDT_MAX_KEY];
+    bool   excl_win_only;  /*the windows are the complete exclusion, exclude is not called*/
+    long   tg_key[KDT_MAX_KEY];
+    bool   use_win;
+    /* Approximate search, set by kdt_search_approx*/
+    double approx_eps;
+    double approx_fact;    /*1 / (1 + approx_eps)^2*/
+    long   max_leaf;       /*0, or the maximum number of nodes of which the points are checked, once n are found*/
+    long   n_leaf;         /*number of nodes of which the points are checked in the current query*/
+} Tkdt_search;
+
+Tkdt *kdtree (void **, long, int, double * (*)(void *));
+Tkdt *kdtree_opt (void **, long, int, double * (*)(void *), const Tkdt_opt *);
+void kdt_get_default_opt (Tkdt_opt *);
+int kdt_set_default_opt (const Tkdt_opt *);
+void free_kdt (Tkdt *);
+int kdt_nn (void *, const Tkdt *, int, int, void **, double *,
             double * (*)(void *), bool (*)(void *, void *), bool);
-int kdt_insert (void *obj, TkdtNode *nd, int k, double * (*getvec)(void *));
+Tkdt_search *new_kdt_search (int k);
+void free_kdt_search (Tkdt_search *);
+int kdt_search_excl_win (Tkdt_search *, int n_key, const long *win, bool win_only);
+int kdt_search_approx (Tkdt_search *, double eps, long max_leaf);
+void kdt_search_exclude (Tkdt_search *, bool (*)(void *, void *, void *), void *arg);
+int kdt_nn_r (Tkdt_search *, void *, const Tkdt *, int, int, void **, double *,
+              double * (*)(void *), bool (*)(void *, void *), bool);
+int kdt_nn_batch (const Tkdt_search *, void **, long, const Tkdt *, int, int, void **, double *, int *,
+                  double * (*)(void *), bool (*)(void *, void *), bool, int);
+int kdt_insert (void *obj, Tkdt **tree, double * (*getvec)(void *));
+
+Tkdt_forest *new_kdt_forest (int k, double * (*)(void *), const Tkdt_opt *);
+void free_kdt_forest (Tkdt_forest *);
+int kdt_forest_insert (Tkdt_forest *, void **, long);
+int kdt_forest_delete (Tkdt_forest *, void **, long);
+int kdt_forest_mask (Tkdt_forest *, void **, long, bool);
+int kdt_forest_nn_r (Tkdt_search *, void *, const Tkdt_forest *, int, int, void **, double *,
+                     double * (*)(void *), bool (*)(void *, void *), bool);
+int kdt_forest_nn_batch (const Tkdt_search *, void **, long, const Tkdt_forest *, int, int, void **, double *, int *,
+                         double * (*)(void *), bool (*)(void *, void *), bool, int);
 
 /*for debugging*/
-int kdt_print (TkdtNode *, int, int);
+int kdt_print (const Tkdt *, int32_t, int);
 
 #endif
@@ -33,7 +33,7 @@ typedef enum { LOG_STATISTICS   = 0x0001, /*STAT, ADHD, ADDT            */
                LOG_EMB_PAR      = 0x0002, /*EMBPAR1, EMBPAR2, EMBPAR3   */
                LOG_EMB_VEC      = 0x0004, /*VID, VAL                    */
                LOG_FN_PAR       = 0x0008, /*KPEXP, KPTLS                */
-               LOG_NEAR_NEIGH   = 0x0010, /*TG1, NN                     */
+               LOG_NEAR_NEIGH   = 0x0010, /*TG1, NN, NNCAL              */
                LOG_SET_PAR      = 0x0020, /*SPCL, SPKF, SPLO, SPBT, SPUV*/
                LOG_LIB_SET      = 0x0040, /*SH, SD                      */
                LOG_PRE_SET      = 0x0080, /*SH, SD                      */
@@ -41,7 +41,7 @@ typedef enum { LOG_STATISTICS   = 0x0001, /*STAT, ADHD, ADDT            */
                LOG_MSGS         = 0x0200, /*MSG                         */
                LOG_VAR_PAR      = 0x0400, /*VPM, VPT                    */
                LOG_BUNDLE_PAR   = 0x0800, /*BP                          */
-               LOG_DTLS_STATUS  = 0x1000, /*DTLSO                       */
+               LOG_DTLS_STATUS  = 0x1000, /*DTLSO, TLSCHK                */
                LOG_DTLS_ARRAYS  = 0x2000, /*DTLSO,DTLSAN,DTLSAV         */
 } Tlog_levels;
 
@@ -9,7 +9,7 @@
 
 typedef enum { FT_CHAR, FT_STRING, FT_INT, FT_SHORT, FT_LONG, FT_DOUBLE } Tfield_type;
 
-#define N_LOG_REC 30
+#define N_LOG_REC 32
 
 typedef enum {
     LOG_BP           = 0,
@@ -41,7 +41,9 @@ typedef enum {
     LOG_ADDT         = 26,
     LOG_DTLSO        = 27,
     LOG_DTLSAN       = 28,
-    LOG_DTLSAV       = 29
+    LOG_DTLSAV       = 29,
+    LOG_NNCAL        = 30,
+    LOG_TLSCHK       = 31
 } Tlog_rec_type;
 
 #define MAX_COLNAME_LOG 30
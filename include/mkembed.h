@@ -16,6 +16,9 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num);
 int
 free_embed (Tembed *emb);
 
+int
+set_embed_view (bool view);
+
 int
 log_embed_init (char *_sep, char *fnam, int _logLvl);
 
@@ -10,6 +10,7 @@
 #include <stdbool.h>
 
 #include "kdt.h"
+#include "embed.h"
 
 
 typedef struct
@@ -18,15 +19,31 @@ typedef struct
     bool        use_in_pre;
     char        *id;         /*pointer into id's array of embedding*/
     long        vec_num;     /*unique number for referencing. Equal to emb->vec_num[row]*/
-    long        *t;          /*pointer into corresponding row in t matrix of embedding*/
+    long        *t;          /*pointer into corresponding row in t matrix of embedding, NULL with a view*/
     long        *t_pre;      /*pointer into corresponding row in t_pre matrix of embedding*/
-    double      *co_val;     /*pointer into corresponding row in co_val matrix (coordinate values) of embedding*/
+    double      *co_val;     /*pointer into corresponding row in co_val matrix (coordinate values) of embedding,
+                               NULL with a view*/
+    const Temb_view *view;   /*NULL, or the view of the embedding on the time series data*/
+    long        row;         /*with a view: source row of the point in the time series data*/
     short       *co_var_num; /*numbers representing the variable used. For exclusion function.*/
     double      *pre_val;    /*pointer into corresponding row in pre_val matrix (prediction values) of embedding*/
     double      *bundle_val; /*pointer into corresponding row in bundle matrix of embedding*/
     double      *addit_val;  /*pointer into corresponding row in additional value matrix of embedding*/
 } Tpoint;
 
+#define EXCL_N_KEY 2  /*keys of a point for exclusion windows: t[0] and vec_num*/
+
+/* Packed copy of the points of a set, in set order: the values of point i of the set are at
+ * co_val[i * e], pre_val[i * n_pre_val] and key[i * EXCL_N_KEY] (see exclude_get_key).
+ */
+typedef struct
+{
+    long   n_point;
+    double *co_val;
+    double *pre_val;
+    long   *key;
+} Tpoint_pack;
+
 typedef struct
 {
     int    set_num;
@@ -36,7 +53,8 @@ typedef struct
     int    n_bundle_val; /*dimension of bundle_val*/
     int    n_addit_val;  /*dimension of addit_val*/
     Tpoint **point;
-    TkdtNode *tx;        /*in case vectors are included in a kd tree*/
+    Tkdt_forest *tx;     /*in case vectors are included in a kd tree, kept up to date by the set functions*/
+    Tpoint_pack *pack;   /*NULL or packed copy of the points, made by point_set_pack, freed by the set functions*/
 } Tpoint_set;
 
 typedef enum { T_EXCL_NONE             = 0,    /*none*/
@@ -48,17 +66,46 @@ typedef enum { T_EXCL_NONE             = 0,    /*none*/
 double *
 get_co_vec (Tpoint *point);
 
+double *
+point_co_val (Tpoint *point, double *buf);
+
+long
+point_t (const Tpoint *point, int j);
+
 long *
 get_t_vec (Tpoint *point);
 
 double *
 get_pre_vec (Tpoint *point);
 
+/* Exclusion setting, made by exclude_init*/
+typedef struct
+{
+    Texcl excl;
+    int   var_win;
+    int   e;
+} Texcl_setting;
+
 int 
 exclude_init (Texcl excl, int var_win, int e);
 
+const Texcl_setting *
+exclude_setting (void);
+
 bool 
-exclude (Tpoint *tg, Tpoint *cd);  /*exclude candidate from prediction set for target?*/
+exclude (Tpoint *tg, Tpoint *cd, const Texcl_setting *excl);  /*exclude candidate from prediction set for target?*/
+
+void
+exclude_get_key (Tpoint *pt, long *key);
+
+bool
+exclude_get_win (const Texcl_setting *excl, long *win);
+
+Tpoint_pack *
+point_set_pack (Tpoint_set *set);
+
+void
+point_set_unpack (Tpoint_set *set);
 
 int compare_point_vec_num (const void *a, const void *b);
 
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2022 Roelof Bart Toonen
+ * License: MIT license (spdx.org MIT)
+ *
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Random number generators.
+ * RNG_COUNTER: counter based: number i of a stream is a hash of the key of the stream and i. A stream
+ *              is chosen by the seed and a few id's (see rng_stream), so it can be started anywhere, in
+ *              any thread, without drawing the numbers before it.
+ * RNG_LIBC:    the additive feedback generator of rand () in the GNU C library, with its own state. It
+ *              has one stream per seed, rng_stream does not change it. Gives the same numbers as
+ *              srand (seed) and rand () with glibc, on every system.
+ */
+typedef enum { RNG_COUNTER, RNG_LIBC } Trng_kind;
+
+#define RNG_LIBC_DEG 31  /*degree and separation of the feedback of RNG_LIBC*/
+#define RNG_LIBC_SEP 3
+
+typedef struct
+{
+    Trng_kind          kind;
+    uint64_t           seed;
+    uint64_t           key;            /*RNG_COUNTER: key of the stream*/
+    uint64_t           ctr;            /*RNG_COUNTER: number of the next value in the stream*/
+    uint32_t           libc_r[RNG_LIBC_DEG];  /*RNG_LIBC: state*/
+    int                libc_f, libc_b;        /*RNG_LIBC: positions of the front and back taps*/
+} Trng;
+
+void
+rng_init (Trng *rng, Trng_kind kind, uint64_t seed);
+
+void
+rng_stream (Trng *rng, int n_id, const long *id);
+
+long
+rng_uniform (Trng *rng, long n);
+
+#endif
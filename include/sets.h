@@ -11,6 +11,7 @@
 #include "embed.h"
 #include "bundle.h"
 #include "point.h"
+#include "rng.h"
 
 typedef enum { LIB_SHIFT_SHIFT, LIB_SHIFT_RANDOM, LIB_SHIFT_BOOTSTRAP, LIB_SHIFT_BOOT_PERMUT } Tlib_shift_meth;
 
@@ -18,6 +19,9 @@ typedef int (*Tnew_sets) (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib
 typedef int (*Tnext_set) (void);
 typedef int (*Tfree_set) (void);
 
+int
+set_sets_rng (Trng_kind kind, unsigned long seed);
+
 int
 init_set_convergent_lib (int lib_size_min, int lib_size_max, int lib_inc, float lib_inc_inc_factor,
                          Tlib_shift_meth lib_shift_meth, int lib_shift, int n_bootstrap,
@@ -33,6 +37,15 @@ int
 init_set_bootstrap (int lib_size, int n_bootstrap, bool pre_set_is_lib, bool lib_size_is_emb_size, bool per_addit_group,
                     Tnew_sets *new_sets, Tnext_set *next_set, Tfree_set *free_set);
 
+int
+set_bootstrap_n_thread (int n_thread);
+
+int
+get_sets_n_part (Tnew_sets new_sets);
+
+int
+set_sets_part (int i_part, int n_part);
+
 int
 init_set_user_val (Tnew_sets *new_sets, Tnext_set *next_set, Tfree_set *free_set);
 
@@ -28,4 +28,25 @@ prediction_stat (Tpoint_set *points_observed, double *predicted);
 int
 free_stat (Tstat *stat);
 
+/* Online estimate of a percentile of a stream of values, without keeping the values (the P-square
+ * algorithm of Jain and Chlamtac). Exact for fewer than 5 values, and for the minimum and maximum.
+ */
+typedef struct
+{
+    double p;         /*fraction 0 .. 1*/
+    long   n;         /*number of values added*/
+    double q[5];      /*marker heights; q[2] is the estimate*/
+    double pos[5];    /*marker positions*/
+    double des[5];    /*desired marker positions*/
+} Tstat_quantile;
+
+void
+init_stat_quantile (Tstat_quantile *sq, double p);
+
+void
+add_stat_quantile (Tstat_quantile *sq, double x);
+
+double
+get_stat_quantile (const Tstat_quantile *sq);
+
 #endif
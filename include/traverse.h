@@ -26,6 +26,17 @@ traverse_all (Tfdat *fdat, int n_emb_lag_def, Temb_lag_def emb_lag_def[],
 #endif
                  );
 
+int
+set_traverse_n_thread (int n_thread);
+
+int
+set_traverse_boot_percentile (int n_percentile, const double *percentile);
+
+#ifdef NLPRESTATOUT
+int
+get_traverse_boot_stat (Tnlpre_boot_stat **boot_stat, int *n_boot_stat);
+#endif
+
 int
 free_traverse ();
 #endif
@@ -31,4 +31,19 @@ typedef struct
     Tstat        *stat;
 } Tnlpre_stat;
 
+/* Percentiles over the bootstrap replicates of the statistics of one embedding, bundle and set of fn
+ * parameters (see set_traverse_boot_percentile). Value i of pre_val j is at [j * n_percentile + i].
+ */
+typedef struct
+{
+    void         *fn_params;   /*those of the statistics of the replicates, freed with them*/
+    int          emb_num;
+    int          bundle_num;
+    long         n_replicate;
+    int          n_pre_val;
+    int          n_percentile;
+    double       *percentile;  /*0 .. 100*/
+    double       *rho_pre_obs, *rmse_pre_obs, *mae_pre_obs;
+} Tnlpre_boot_stat;
+
 #endif
@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include "bundle.h"
+#include "context.h"
 #include "bundle_log.h"
 #include "log.h"
 
@@ -26,6 +27,7 @@ static int  l_n_bundle_val = 0;
 static long *l_bundle_idx = NULL;
 
 static Tbundle_set *l_bundle_set;
+#pragma omp threadprivate(l_bundle_sorted, l_n_row, l_n_bundle_vec, l_n_bundle_val, l_bundle_idx, l_bundle_set)
 
 void
 free_bundle (void);
@@ -54,12 +56,10 @@ compare (const void *a, const void *b)
     return bs_a->idx - bs_b->idx;
 }
 
-static double *l_filter_val = NULL;
-static int    l_n_filter_val = 0;
-
 int
 init_bundle_filter (char *s_filter_val)
 {
+    Tbundle_context *ctx = &g_context->bundle;
     char *s, *p, *ep;
     double d;
 
@@ -77,8 +77,8 @@ init_bundle_filter (char *s_filter_val)
             free_bundle_filter ();
             return -1;
         }
-        l_filter_val = (double *) realloc (l_filter_val, ++l_n_filter_val * sizeof (double));
-        l_filter_val[l_n_filter_val - 1] = d;
+        ctx->filter_val = (double *) realloc (ctx->filter_val, ++ctx->n_filter_val * sizeof (double));
+        ctx->filter_val[ctx->n_filter_val - 1] = d;
     }
 
     return 0;
@@ -87,9 +87,9 @@ init_bundle_filter (char *s_filter_val)
 int
 free_bundle_filter ()
 {
-    if (l_filter_val) free (l_filter_val);
-    l_filter_val = NULL;
-    l_n_filter_val = 0;
+    if (g_context->bundle.filter_val) free (g_context->bundle.filter_val);
+    g_context->bundle.filter_val = NULL;
+    g_context->bundle.n_filter_val = 0;
 
     return 0;
 }
@@ -98,13 +98,13 @@ static bool
 skip_filter (double *p_bundle)
 {
     /* Currently only a filter on the first scalar value of p_bundle is available.*/
-    if (l_n_filter_val == 0)
+    if (g_context->bundle.n_filter_val == 0)
         return false;  /*do not skip*/
 
     int i;
-    for (i = 0; i < l_n_filter_val; i++)
+    for (i = 0; i < g_context->bundle.n_filter_val; i++)
     {
-        if (*p_bundle == l_filter_val[i])
+        if (*p_bundle == g_context->bundle.filter_val[i])
             return (false);
     }
 
@@ -112,6 +112,7 @@ skip_filter (double *p_bundle)
 }
 
 static int l_offset_sorted;
+#pragma omp threadprivate(l_offset_sorted)
 
 int
 new_bundles (Tembed *emb, Tbundle_set **bundle_set)
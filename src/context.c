@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Roelof Bart Toonen
+ * License: MIT license (spdx.org MIT)
+ *
+ * Run contexts, see context.h.
+ */
+
+#include <stdlib.h>
+
+#include "context.h"
+
+#define CONTEXT_INIT {                                                                   \
+    .sets   = { .lib_size_is_emb_size = true, .boot_n_thread = 1, .rng_kind = RNG_LIBC, .rng_seed = 1 }, \
+    .fn     = { .n_thread = 1, .nn_cache_max = FN_NN_CACHE_MAX, .weight_mode = FN_WEIGHT_EXACT }, \
+    .fn_exp = { .object_only_once = true },                                              \
+    .traverse = { .n_thread = 1 } }
+
+static Tcontext l_default_context = CONTEXT_INIT;
+
+Tcontext *g_context = &l_default_context;
+
+/* new_context: A context with the default settings, as the default context has before any init function.
+ * Returns: NULL when out of memory.
+ */
+Tcontext *
+new_context (void)
+{
+    static const Tcontext init = CONTEXT_INIT;
+    Tcontext *ctx;
+
+    if ((ctx = (Tcontext *) malloc (sizeof (Tcontext))) == NULL)
+        return NULL;
+
+    *ctx = init;
+    return ctx;
+}
+
+/* free_context: Free a context of new_context. A thread that still uses it goes back to the default one.
+ *               The default context itself is not freed.
+ */
+void
+free_context (Tcontext *ctx)
+{
+    if (!ctx || ctx == &l_default_context)
+        return;
+
+    if (g_context == ctx)
+        g_context = &l_default_context;
+
+    if (ctx->bundle.filter_val)
+        free (ctx->bundle.filter_val);
+    if (ctx->traverse.boot_percentile)
+        free (ctx->traverse.boot_percentile);
+    free (ctx);
+}
+
+/* set_context: Make ctx the context of the calling thread, NULL for the default context.
+ * Returns: the previous context of the thread.
+ */
+Tcontext *
+set_context (Tcontext *ctx)
+{
+    Tcontext *prev;
+
+    prev      = g_context;
+    g_context = ctx? ctx: &l_default_context;
+    return prev;
+}
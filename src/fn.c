@@ -9,12 +9,651 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FN_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #include "point.h"
 #include "log.h"
 #include "fn.h"
+#include "context.h"
 #include "fn_log.h"
 
+/* set_fn_n_thread: Number of threads the fn functions use to predict the targets of a prediction set.
+ *                  Also used to build the k-d trees of the libraries.
+ *                  A value smaller than 1 means: use all available processors.
+ *                  Without OpenMP support, predictions are always done in one thread.
+ */
+int
+set_fn_n_thread (int n_thread)
+{
+    g_context->fn.n_thread = n_thread;
+    return 0;
+}
+
+int
+get_fn_n_thread (void)
+{
+#ifdef _OPENMP
+    if (omp_in_parallel ())
+        return 1;  /*traverse_all traverses the embeddings in several threads*/
+    if (g_context->fn.n_thread < 1)
+        return omp_get_max_threads ();
+    return g_context->fn.n_thread;
+#else
+    return 1;
+#endif
+}
+
+/* fn_kdt_forest: Build the k-d tree (a forest with one tree) of the points of a set, with the keys for
+ *                exclusion windows. The set functions can then insert and delete points.
+ */
+Tkdt_forest *
+fn_kdt_forest (Tpoint_set *set)
+{
+    Tkdt_opt    kdt_opt;
+    Tkdt_forest *forest;
+
+    kdt_get_default_opt (&kdt_opt);
+    kdt_opt.n_thread = get_fn_n_thread ();
+    kdt_opt.n_key    = EXCL_N_KEY;
+    kdt_opt.getkey   = (void (*)(void *, long *)) exclude_get_key;
+
+    if ((forest = new_kdt_forest (set->e, (double * (*)(void *))get_co_vec, &kdt_opt)) == NULL)
+        return NULL;
+
+    if (kdt_forest_insert (forest, (void **) set->point, set->n_point) < 0)
+    {
+        free_kdt_forest (forest);
+        return NULL;
+    }
+
+    return forest;
+}
+
+/* set_fn_nn_approx: Approximate neighbour searches, see kdt_search_approx. eps 0 and max_leaf 0 (the
+ *                   default) give exact searches. Set by the init functions of the fn functions.
+ * Returns: -1 when eps or max_leaf is negative, otherwise 0.
+ */
+int
+set_fn_nn_approx (double eps, long max_leaf)
+{
+    if (eps < 0.0 || max_leaf < 0)
+        return -1;
+
+    g_context->fn.nn_eps      = eps;
+    g_context->fn.nn_max_leaf = max_leaf;
+    return 0;
+}
+
+/* set_fn_nn_calibrate: With approximate searches, also search the exact neighbours, and log per set the
+ *                      recall of the approximate search (the fraction of the exact neighbours it found)
+ *                      and the mean ratio of the distances of the farthest neighbours (NNCAL records,
+ *                      log level LOG_NEAR_NEIGH).
+ */
+int
+set_fn_nn_calibrate (bool calibrate)
+{
+    g_context->fn.nn_calibrate = calibrate;
+    return 0;
+}
+
+/* new_fn_kdt_search: Search context for trees of fn_kdt_forest, which skips the parts of the tree
+ *                    that are excluded by the exclusion setting of the calling thread (see exclude_init), and is
+ *                    approximate as set_fn_nn_approx has set.
+ */
+Tkdt_search *
+new_fn_kdt_search (int e)
+{
+    Tkdt_search *srch;
+    long        win[EXCL_N_KEY];
+    bool        win_only;
+
+    if ((srch = new_kdt_search (e)) == NULL)
+        return NULL;
+
+    win_only = exclude_get_win (exclude_setting (), win);
+    kdt_search_excl_win (srch, EXCL_N_KEY, win, win_only);
+    kdt_search_exclude (srch, (bool (*)(void *, void *, void *))exclude, (void *) exclude_setting ());
+    kdt_search_approx (srch, g_context->fn.nn_eps, g_context->fn.nn_max_leaf);
+
+    return srch;
+}
+
+/* neighbour cache ****************************************************/
+
+/* The neighbours of the targets do not depend on the fn parameters that are traversed (e.g. theta),
+ * and the set functions give the same sequence of sets for every fn parameter set. So the neighbours
+ * found with the first fn parameters are kept per set, and replayed for the later ones.
+ * A neighbour is kept as its offset from the first library point: all points of the sets are in one
+ * array, which is made again (in the same way) for every fn parameter set.
+ * The neighbours also depend on the exclusion and on the approximate search settings. These are kept
+ * with the set, so a set is only replayed when they are the same.
+ */
+typedef struct
+{
+    uint64_t fp;               /*fingerprint of the library and prediction set*/
+    long     n_target;
+    int      nnn;
+    bool     object_only_once;
+    Texcl_setting excl;
+    double   nn_eps;
+    long     nn_max_leaf;
+    bool     complete;         /*the neighbours of all targets are stored*/
+    long     *nb;              /*n_target x nnn neighbours, offsets from the first library point*/
+    double   *sqdst;           /*n_target x nnn square distances*/
+    int      *n_found;         /*per target*/
+} Tnn_cache_set;
+
+#define NB_NULL LONG_MIN       /*no neighbour*/
+
+static Tnn_cache_set *l_nn_cache      = NULL;
+static long          l_n_nn_cache     = 0;   /*number of sets in the cache*/
+static long          l_i_nn_cache     = -1;  /*set of the current fn call*/
+static long          l_nn_cache_size  = 0;   /*bytes in use*/
+static Tnn_cache_set *l_nn_cur        = NULL;  /*the set to replay or to fill*/
+static bool          l_nn_replay      = false;
+#pragma omp threadprivate(l_nn_cache, l_n_nn_cache, l_i_nn_cache, l_nn_cache_size, l_nn_cur, l_nn_replay)
+
+/* set_fn_nn_cache_max: Maximum number of bytes for the neighbour cache, 0 switches it off.*/
+int
+set_fn_nn_cache_max (long max)
+{
+    g_context->fn.nn_cache_max = max;
+    return 0;
+}
+
+static long
+nn_cache_set_size (long n_target, int nnn)
+{
+    return n_target * (nnn * (long) (sizeof (long) + sizeof (double)) + (long) sizeof (int));
+}
+
+static void
+free_nn_cache_set (Tnn_cache_set *c)
+{
+    if (c->nb)
+    {
+        free (c->nb);
+        free (c->sqdst);
+        free (c->n_found);
+        l_nn_cache_size -= nn_cache_set_size (c->n_target, c->nnn);
+    }
+    c->nb       = NULL;
+    c->sqdst    = NULL;
+    c->n_found  = NULL;
+    c->complete = false;
+}
+
+/* fn_nn_cache_clear: Forget all neighbours, for a new embedding or fn.*/
+void
+fn_nn_cache_clear (void)
+{
+    long i;
+
+    for (i = 0; i < l_n_nn_cache; i++)
+        free_nn_cache_set (l_nn_cache + i);
+
+    if (l_nn_cache)
+        free (l_nn_cache);
+
+    l_nn_cache   = NULL;
+    l_n_nn_cache = 0;
+    l_i_nn_cache = -1;
+    l_nn_cur     = NULL;
+}
+
+/* fn_nn_cache_rewind: The sets start again, for the next fn parameters.*/
+void
+fn_nn_cache_rewind (void)
+{
+    l_i_nn_cache = -1;
+    l_nn_cur     = NULL;
+}
+
+/* fn_set_fingerprint: A hash of the points (vec_num) of a library and prediction set.*/
+uint64_t
+fn_set_fingerprint (Tpoint_set *lib_set, Tpoint_set *pre_set)
+{
+    uint64_t h = 14695981039346656037ULL;  /*FNV-1a*/
+    long     i;
+
+    for (i = 0; i < lib_set->n_point; i++)
+        h = (h ^ (uint64_t) lib_set->point[i]->vec_num) * 1099511628211ULL;
+    h = (h ^ (uint64_t) lib_set->n_point) * 1099511628211ULL;
+    for (i = 0; i < pre_set->n_point; i++)
+        h = (h ^ (uint64_t) pre_set->point[i]->vec_num) * 1099511628211ULL;
+    h = (h ^ (uint64_t) pre_set->n_point) * 1099511628211ULL;
+
+    return h;
+}
+
+/* fn_nn_begin: Start the neighbour searches of an fn call, for the next set.
+ *              When the neighbours of this set are in the cache, fn_nn_batch replays them.
+ *              Otherwise, with store, fn_nn_batch keeps them for the next fn parameters, as long as
+ *              the cache is not full.
+ *              A set is replayed when its points, nnn, object_only_once, the exclusion setting of the
+ *              thread and the approximate search settings are the same. Anything else that changes the
+ *              neighbours, such as the embedding, needs fn_nn_cache_clear (the new_fn_params functions).
+ */
+int
+fn_nn_begin (Tpoint_set *lib_set, Tpoint_set *pre_set, int nnn, bool object_only_once, bool store)
+{
+    Tnn_cache_set *c;
+    const Texcl_setting *excl;
+    uint64_t      fp;
+    long          size;
+
+    l_i_nn_cache++;
+    l_nn_cur    = NULL;
+    l_nn_replay = false;
+
+    if (l_i_nn_cache > l_n_nn_cache || (l_i_nn_cache == l_n_nn_cache && !store) || lib_set->n_point == 0)
+        return 0;
+
+    fp   = fn_set_fingerprint (lib_set, pre_set);
+    excl = exclude_setting ();
+
+    if (l_i_nn_cache == l_n_nn_cache)
+    {
+        c = (Tnn_cache_set *) realloc (l_nn_cache, (l_n_nn_cache + 1) * sizeof (Tnn_cache_set));
+        if (!c)
+            return -1;
+        l_nn_cache = c;
+        c = l_nn_cache + l_n_nn_cache++;
+        c->nb = NULL;
+        free_nn_cache_set (c);
+    }
+
+    c = l_nn_cache + l_i_nn_cache;
+    if (c->complete && c->fp == fp && c->n_target == pre_set->n_point && c->nnn == nnn &&
+            c->object_only_once == object_only_once && c->excl.excl == excl->excl &&
+            c->excl.var_win == excl->var_win && c->excl.e == excl->e &&
+            c->nn_eps == g_context->fn.nn_eps && c->nn_max_leaf == g_context->fn.nn_max_leaf)
+    {
+        l_nn_cur    = c;
+        l_nn_replay = true;
+        return 0;
+    }
+
+    free_nn_cache_set (c);
+
+    size = nn_cache_set_size (pre_set->n_point, nnn);
+    if (!store || l_nn_cache_size + size > g_context->fn.nn_cache_max)
+        return 0;
+
+    c->nb      = (long *) malloc (pre_set->n_point * nnn * sizeof (long));
+    c->sqdst   = (double *) malloc (pre_set->n_point * nnn * sizeof (double));
+    c->n_found = (int *) malloc (pre_set->n_point * sizeof (int));
+    c->fp               = fp;
+    c->n_target         = pre_set->n_point;
+    c->nnn              = nnn;
+    c->object_only_once = object_only_once;
+    c->excl             = *excl;
+    c->nn_eps           = g_context->fn.nn_eps;
+    c->nn_max_leaf      = g_context->fn.nn_max_leaf;
+    l_nn_cache_size += size;
+
+    if (!c->nb || !c->sqdst || !c->n_found)
+    {
+        free (c->sqdst);
+        free (c->n_found);
+        free_nn_cache_set (c);
+        return 0;
+    }
+
+    l_nn_cur = c;
+    return 0;
+}
+
+static long   l_cal_n_exact = 0;  /*calibration: number of exact neighbours*/
+static long   l_cal_n_match = 0;  /*and how many of them the approximate search found*/
+static long   l_cal_n_ratio = 0;
+static double l_cal_sum_ratio = 0.0;
+#pragma omp threadprivate(l_cal_n_exact, l_cal_n_match, l_cal_n_ratio, l_cal_sum_ratio)
+
+/* nn_calibrate: Compare the approximate neighbours rs (nnn per target) of the targets i_first ..
+ *               i_first + n_batch - 1 with the exact ones, and log the result at the end of the prediction set.
+ */
+static int
+nn_calibrate (Tpoint_set *lib_set, Tpoint_set *pre_set, long i_first, long n_batch, int nnn,
+              bool object_only_once, Tpoint **rs, double *sqdst, int n_thread)
+{
+    Tkdt_search *srch;
+    Tpoint      **rs_x;
+    double      *sqdst_x;
+    bool        *used;
+    long        i;
+    int         j, h, res;
+
+    rs_x    = (Tpoint **) malloc (n_batch * nnn * sizeof (Tpoint *));
+    sqdst_x = (double *) malloc (n_batch * nnn * sizeof (double));
+    used    = (bool *) malloc (nnn * sizeof (bool));
+    srch    = new_fn_kdt_search (lib_set->e);
+
+    res = -1;
+    if (rs_x && sqdst_x && used && srch)
+    {
+        kdt_search_approx (srch, 0.0, 0);
+        res = kdt_forest_nn_batch (srch, (void **) pre_set->point + i_first, n_batch, lib_set->tx, lib_set->e,
+                                   nnn, (void **) rs_x, sqdst_x, NULL, (double * (*)(void *))get_co_vec,
+                                   NULL, object_only_once, n_thread);
+    }
+
+    /* Rows are filled from the end; the farthest neighbour is the first one that is not NULL.*/
+    for (i = 0; res == 0 && i < n_batch; i++)
+    {
+        for (h = 0; h < nnn; h++)
+            used[h] = false;
+
+        for (j = 0; j < nnn; j++)
+        {
+            if (!rs_x[i * nnn + j])
+                continue;
+            l_cal_n_exact++;
+            for (h = 0; h < nnn; h++)
+                if (!used[h] && rs[i * nnn + h] == rs_x[i * nnn + j])
+                {
+                    used[h] = true;
+                    l_cal_n_match++;
+                    break;
+                }
+        }
+
+        if (rs[i * nnn] && rs_x[i * nnn] && sqdst_x[i * nnn] > 0.0)
+        {
+            l_cal_sum_ratio += sqrt (sqdst[i * nnn] / sqdst_x[i * nnn]);
+            l_cal_n_ratio++;
+        }
+    }
+
+    if (res == 0 && i_first + n_batch == pre_set->n_point)
+    {
+        log_nn_calibrate (g_context->fn.nn_eps, g_context->fn.nn_max_leaf,
+                          l_cal_n_exact? (double) l_cal_n_match / l_cal_n_exact: 1.0,
+                          l_cal_n_ratio? l_cal_sum_ratio / l_cal_n_ratio: 1.0);
+        l_cal_n_exact = l_cal_n_match = l_cal_n_ratio = 0;
+        l_cal_sum_ratio = 0.0;
+    }
+
+    free (rs_x);
+    free (sqdst_x);
+    free (used);
+    free_kdt_search (srch);
+
+    return res;
+}
+
+/* fn_nn_batch: The nnn nearest neighbours in the library of the targets i_first .. i_first + n_batch - 1
+ *              of the prediction set, as kdt_nn_batch gives them. They are replayed from the cache,
+ *              or searched in the tree of the library, which is built when there is none.
+ *              n_found may be NULL.
+ *              With set_fn_nn_calibrate, searched neighbours are compared with the exact ones.
+ * Returns: 0, or -1 when out of memory.
+ */
+int
+fn_nn_batch (Tpoint_set *lib_set, Tpoint_set *pre_set, long i_first, long n_batch, int nnn,
+             bool object_only_once, Tpoint **rs, double *sqdst, int *n_found, int n_thread)
+{
+    Tnn_cache_set *c = l_nn_cur;
+    Tkdt_search   *srch;
+    Tpoint        *base;
+    long          i, j;
+    int           res;
+
+    /* An empty library has no neighbours, and no first point. fn_nn_begin does not cache it.*/
+    if (lib_set->n_point == 0)
+    {
+        for (i = 0; i < n_batch * nnn; i++)
+        {
+            rs[i]    = NULL;
+            sqdst[i] = DBL_MAX;
+        }
+        if (n_found)
+            for (i = 0; i < n_batch; i++)
+                n_found[i] = 0;
+
+        return 0;
+    }
+
+    base = lib_set->point[0];
+
+    if (c && l_nn_replay)
+    {
+        for (i = 0; i < n_batch * nnn; i++)
+        {
+            j     = c->nb[i_first * nnn + i];
+            rs[i] = (j == NB_NULL)? NULL: base + j;
+        }
+        memcpy (sqdst, c->sqdst + i_first * nnn, n_batch * nnn * sizeof (double));
+        if (n_found)
+            memcpy (n_found, c->n_found + i_first, n_batch * sizeof (int));
+
+        return 0;
+    }
+
+    if (!lib_set->tx)
+        lib_set->tx = fn_kdt_forest (lib_set);
+
+    if ((srch = new_fn_kdt_search (lib_set->e)) == NULL)
+        return -1;
+
+    res = kdt_forest_nn_batch (srch, (void **) pre_set->point + i_first, n_batch, lib_set->tx, lib_set->e, nnn,
+                               (void **) rs, sqdst, n_found, (double * (*)(void *))get_co_vec,
+                               NULL, object_only_once, n_thread);
+    free_kdt_search (srch);
+
+    if (res == 0 && g_context->fn.nn_calibrate && (g_context->fn.nn_eps > 0.0 || g_context->fn.nn_max_leaf > 0))
+        res = nn_calibrate (lib_set, pre_set, i_first, n_batch, nnn, object_only_once, rs, sqdst, n_thread);
+
+    if (res == 0 && c)
+    {
+        for (i = 0; i < n_batch; i++)
+        {
+            c->n_found[i_first + i] = 0;
+            for (j = 0; j < nnn; j++)
+            {
+                if (rs[i * nnn + j])
+                {
+                    c->nb[(i_first + i) * nnn + j] = (long) (rs[i * nnn + j] - base);
+                    c->n_found[i_first + i]++;
+                }
+                else
+                    c->nb[(i_first + i) * nnn + j] = NB_NULL;
+            }
+        }
+        memcpy (c->sqdst + i_first * nnn, sqdst, n_batch * nnn * sizeof (double));
+
+        if (i_first + n_batch == c->n_target)
+            c->complete = true;
+    }
+
+    return res;
+}
+
+/* set_fn_weight_mode: How fn_exp_weights computes the weights: with exp of the math library
+ *                     (FN_WEIGHT_EXACT, the default), or with the approximation of FN_WEIGHT_FAST.
+ */
+int
+set_fn_weight_mode (Tfn_weight_mode mode)
+{
+    g_context->fn.weight_mode = mode;
+    return 0;
+}
+
+/* Fast exp: x = k ln2 + r with |r| <= ln2 / 2, exp(r) by its Taylor polynomial of degree 10 (evaluated
+ * in Estrin's scheme, which has shorter dependency chains than Horner's), and 2^k made in the exponent bits.
+ * The relative error is below FN_WEIGHT_FAST_MAX_ERR.
+ * Below FN_EXP_MIN (where exp gives denormals) and above FN_EXP_MAX exp itself is used.
+ * The scalar and the vector versions do the same operations, so they give the same result.
+ */
+#define FN_EXP_MIN    (-708.0)
+#define FN_EXP_MAX    709.0
+#define FN_LOG2E      1.4426950408889634
+#define FN_LN2_HI     6.93145751953125e-1    /*ln 2 in two parts, k * FN_LN2_HI is exact*/
+#define FN_LN2_LO     1.42860682030941723212e-6
+
+#define FN_EXP_C2     (1.0 / 2)
+#define FN_EXP_C3     (1.0 / 6)
+#define FN_EXP_C4     (1.0 / 24)
+#define FN_EXP_C5     (1.0 / 120)
+#define FN_EXP_C6     (1.0 / 720)
+#define FN_EXP_C7     (1.0 / 5040)
+#define FN_EXP_C8     (1.0 / 40320)
+#define FN_EXP_C9     (1.0 / 362880)
+#define FN_EXP_C10    (1.0 / 3628800)
+
+static double
+fast_exp (double x)
+{
+    double k, r, r2, r4;
+
+    if (isnan (x))
+        return x;
+    if (x < FN_EXP_MIN || x > FN_EXP_MAX)
+        return exp (x);
+
+    k = nearbyint (x * FN_LOG2E);
+    r = (x - k * FN_LN2_HI) - k * FN_LN2_LO;
+
+    r2 = r * r;
+    r4 = r2 * r2;
+
+    return ldexp (((1.0 + r) + (FN_EXP_C2 + FN_EXP_C3 * r) * r2) +
+                  ((FN_EXP_C4 + FN_EXP_C5 * r) + (FN_EXP_C6 + FN_EXP_C7 * r) * r2) * r4 +
+                  ((FN_EXP_C8 + FN_EXP_C9 * r) + FN_EXP_C10 * r2) * (r4 * r4), (int) k);
+}
+
+static void
+exp_weights_scalar (const double *dist, int n, bool squared, double fact, double *u)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        u[i] = fast_exp (fact * (squared? sqrt (dist[i]): dist[i]));
+}
+
+#ifdef FN_X86_SIMD
+__attribute__ ((target ("avx2")))
+static void
+exp_weights_avx2 (const double *dist, int n, bool squared, double fact, double *u)
+{
+    __m256d x, k, r, r2, r4, p, q, nan, out;
+    __m256i e;
+    int     i, j, m;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        x = _mm256_loadu_pd (dist + j);
+        if (squared)
+            x = _mm256_sqrt_pd (x);
+        x     = _mm256_mul_pd (_mm256_set1_pd (fact), x);
+        nan   = _mm256_cmp_pd (x, x, _CMP_UNORD_Q);
+        out   = _mm256_or_pd (_mm256_cmp_pd (x, _mm256_set1_pd (FN_EXP_MIN), _CMP_LT_OQ),
+                              _mm256_cmp_pd (x, _mm256_set1_pd (FN_EXP_MAX), _CMP_GT_OQ));
+        x     = _mm256_blendv_pd (x, _mm256_setzero_pd (), _mm256_or_pd (nan, out));
+
+        k = _mm256_round_pd (_mm256_mul_pd (x, _mm256_set1_pd (FN_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm256_sub_pd (_mm256_sub_pd (x, _mm256_mul_pd (k, _mm256_set1_pd (FN_LN2_HI))),
+                           _mm256_mul_pd (k, _mm256_set1_pd (FN_LN2_LO)));
+
+        r2 = _mm256_mul_pd (r, r);
+        r4 = _mm256_mul_pd (r2, r2);
+        p  = _mm256_add_pd (_mm256_add_pd (_mm256_set1_pd (1.0), r),
+                            _mm256_mul_pd (_mm256_add_pd (_mm256_set1_pd (FN_EXP_C2),
+                                                          _mm256_mul_pd (_mm256_set1_pd (FN_EXP_C3), r)), r2));
+        q  = _mm256_add_pd (_mm256_add_pd (_mm256_set1_pd (FN_EXP_C4), _mm256_mul_pd (_mm256_set1_pd (FN_EXP_C5), r)),
+                            _mm256_mul_pd (_mm256_add_pd (_mm256_set1_pd (FN_EXP_C6),
+                                                          _mm256_mul_pd (_mm256_set1_pd (FN_EXP_C7), r)), r2));
+        p  = _mm256_add_pd (p, _mm256_mul_pd (q, r4));
+        q  = _mm256_add_pd (_mm256_add_pd (_mm256_set1_pd (FN_EXP_C8), _mm256_mul_pd (_mm256_set1_pd (FN_EXP_C9), r)),
+                            _mm256_mul_pd (_mm256_set1_pd (FN_EXP_C10), r2));
+        p  = _mm256_add_pd (p, _mm256_mul_pd (q, _mm256_mul_pd (r4, r4)));
+
+        /* 2^k, k in [-1022, 1023]*/
+        e = _mm256_cvtepi32_epi64 (_mm256_cvtpd_epi32 (k));
+        e = _mm256_slli_epi64 (_mm256_add_epi64 (e, _mm256_set1_epi64x (1023)), 52);
+        p = _mm256_mul_pd (p, _mm256_castsi256_pd (e));
+
+        p = _mm256_blendv_pd (p, _mm256_loadu_pd (dist + j), nan);  /*NaN stays NaN*/
+        _mm256_storeu_pd (u + j, p);
+
+        if ((m = _mm256_movemask_pd (out)) != 0)
+            for (i = 0; i < 4; i++)
+                if (m & (1 << i))
+                    u[j + i] = exp (fact * (squared? sqrt (dist[j + i]): dist[j + i]));
+    }
+
+    if (j < n)
+        exp_weights_scalar (dist + j, n - j, squared, fact, u + j);
+}
+#endif
+
+/* fn_exp_weights: The n weights u[i] = exp(fact * dist[i]), or exp(fact * sqrt(dist[i])) when the
+ *                 distances are squared, as set_fn_weight_mode has chosen.
+ * Returns: the sum of the weights.
+ */
+double
+fn_exp_weights (const double *dist, int n, bool squared, double fact, double *u)
+{
+    double sum_u = 0.0;
+    int    i;
+
+    if (g_context->fn.weight_mode == FN_WEIGHT_FAST)
+    {
+#ifdef FN_X86_SIMD
+        if (__builtin_cpu_supports ("avx2"))
+            exp_weights_avx2 (dist, n, squared, fact, u);
+        else
+#endif
+            exp_weights_scalar (dist, n, squared, fact, u);
+
+        for (i = 0; i < n; i++)
+            sum_u += u[i];
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            u[i] = exp (fact * (squared? sqrt (dist[i]): dist[i]));
+            sum_u += u[i];
+        }
+    }
+
+    return sum_u;
+}
+
+/* fn_weighted_sum: The weighted sums out[j] = sum over i of scale * u[i] * pt[i]->pre_val[j], of all n_val
+ *                  prediction values at once, in one pass over the n points.
+ */
+void
+fn_weighted_sum (const double *u, double scale, Tpoint **pt, int n, int n_val, double *out)
+{
+    const double *val;
+    double       ui;
+    int          i, j;
+
+    for (j = 0; j < n_val; j++)
+        out[j] = 0.0;
+
+    for (i = 0; i < n; i++)
+    {
+        ui  = u[i] * scale;
+        val = pt[i]->pre_val;
+        for (j = 0; j < n_val; j++)
+            out[j] += ui * val[j];
+    }
+}
+
 int
 log_fn (Tfn_type fn_type)
 {
@@ -78,6 +717,33 @@ log_nn (Tpoint *target, Tpoint **rs, double *sqdst, int n)
     return 0;
 }
 
+/* log_nn_calibrate: Log the result of the calibration of the approximate neighbour search of a set
+ *                   (see set_fn_nn_calibrate).
+ */
+int
+log_nn_calibrate (double eps, long max_leaf, double recall, double dst_ratio)
+{
+    static struct s_log_nncal log_nncal;
+#ifdef LOG_HUMAN
+    ATTACH_META_NNCAL(meta_log_nncal, log_nncal);
+#endif
+
+    if (!g_log_file)
+        return 1;
+
+    if (!(g_log_level & LOG_NEAR_NEIGH))
+        return 2;
+
+    log_nncal.eps       = eps;
+    log_nncal.max_leaf  = max_leaf;
+    log_nncal.recall    = recall;
+    log_nncal.dst_ratio = dst_ratio;
+
+    LOGREC(LOG_NNCAL, &log_nncal, sizeof (log_nncal), &meta_log_nncal);
+
+    return 0;
+}
+
 int
 log_predicted (Tpoint **pt, int n, int n_val, double *pre_val, int *status)
 {
@@ -15,6 +15,7 @@
 #include "point.h"
 #include "fn.h"
 #include "fn_exp.h"
+#include "context.h"
 #include "log.h"
 #include "fn_exp_log.h"
 
@@ -31,28 +32,30 @@ int
 log_fn_params_exponential (void);
 
 int
-est_pre_val (Tpoint **rs, double *sqdst, int n, int n_pre_val, double *pre_val, double rms_dist);
+est_pre_val (Tpoint **rs, double *sqdst, int n, int n_pre_val, double *pre_val, double rms_dist, double *u);
 
-static int   l_nnn_add;    /* Number of nearest neighbours to add to embedding dimension.*/
-static Texcl l_excl;       /* How to exclude vectors from library, based upon predictor vector.*/
-static int   l_var_win;
-static Tfn_denom l_fn_denom;
-static double l_exp_k;
-static bool  l_object_only_once = true;
 
-
-/* Exponential fn: neighbour values are exponentially weighted to make a prediction for target value*/
+/* Exponential fn: neighbour values are exponentially weighted to make a prediction for target value.
+ * nn_eps, nn_max_leaf: approximate neighbour search (see set_fn_nn_approx), 0 and 0 for the exact one.
+ */
 int
 init_fn_exponential (Tnew_fn_params *new_fn_params, Tnext_fn_params *next_fn_params, Tfn *fn,
                          int nnn_add, Texcl excl, int var_win,
-                         Tfn_denom fn_denom, double exp_k, bool object_only_once)
+                         Tfn_denom fn_denom, double exp_k, bool object_only_once,
+                         double nn_eps, long nn_max_leaf)
 {
-    l_nnn_add = nnn_add;
-    l_excl    = excl;
-    l_var_win = var_win;
-    l_exp_k   = exp_k;
-    l_fn_denom = fn_denom;
-    l_object_only_once = object_only_once;
+    if (set_fn_nn_approx (nn_eps, nn_max_leaf) < 0)
+    {
+        fprintf (stderr, "Incorrect approximation of the neighbour search <%g> <%ld>\n", nn_eps, nn_max_leaf);
+        return -1;
+    }
+
+    g_context->fn_exp.nnn_add = nnn_add;
+    g_context->fn_exp.excl    = excl;
+    g_context->fn_exp.var_win = var_win;
+    g_context->fn_exp.exp_k   = exp_k;
+    g_context->fn_exp.fn_denom = fn_denom;
+    g_context->fn_exp.object_only_once = object_only_once;
 
     *new_fn_params  = &new_fn_params_exponential;
     *next_fn_params = &next_fn_params_exponential;
@@ -64,18 +67,19 @@ init_fn_exponential (Tnew_fn_params *new_fn_params, Tnext_fn_params *next_fn_par
 }
 
 static bool new_fn_params_first;
+#pragma omp threadprivate(new_fn_params_first)
 
 int
 new_fn_params_exponential (int e, void **fn_params)
 {
-    exclude_init (l_excl, l_var_win, e);
+    exclude_init (g_context->fn_exp.excl, g_context->fn_exp.var_win, e);
+    fn_nn_cache_clear ();
     new_fn_params_first = true;
     return next_fn_params_exponential (fn_params);
 }
 
 static double *l_pre_val = NULL;
-static int    l_n_set = 0;
-static double *l_u = NULL;
+#pragma omp threadprivate(l_pre_val)
 
 int
 next_fn_params_exponential (void **fn_params)
@@ -89,9 +93,9 @@ next_fn_params_exponential (void **fn_params)
     if (new_fn_params_first)
     {
         _fn_params = (Tfn_params_exponential *) malloc (sizeof(Tfn_params_exponential));
-        _fn_params->nnn_add = l_nnn_add;
-        _fn_params->excl    = l_excl;
-        _fn_params->var_win = l_var_win;
+        _fn_params->nnn_add = g_context->fn_exp.nnn_add;
+        _fn_params->excl    = g_context->fn_exp.excl;
+        _fn_params->var_win = g_context->fn_exp.var_win;
 
         *fn_params = (void *) _fn_params;
 
@@ -106,36 +110,41 @@ next_fn_params_exponential (void **fn_params)
             free (l_pre_val);
         l_pre_val = NULL;
 
-        if (l_u)
-            free (l_u);
-        l_u = 0;
-        l_n_set = 0;
-
         return 1; /* stop, no new fn parameters to traverse*/
     }
 }
 
+/* get_rms_dist: Root mean square distance between the n_point points of co_val, e coordinates per point,
+ *               over all pairs of points. The mean square distance over all pairs is 2 * sum of the sample
+ *               variances of the coordinates, so it takes two passes through the points, not one per pair.
+ */
 double
-get_rms_dist (Tpoint **p, int n_point, int e)
+get_rms_dist (const double *co_val, long n_point, int e)
 {
-    Tpoint **p1, **p2;
-    long   n = 0;
+    const double *p;
+    double dist, mean, ssq, ssq_dist = 0.0;
     int    i;
-    double dist, sqdist, mean_ssq_dist = 0.0;
 
-    for (p1 = p; p1 < p + n_point - 1; p1++)
-        for (p2 = p1 + 1; p2 < p + n_point; p2++)
+    if (n_point < 2)
+        return 0.0;
+
+    for (i = 0; i < e; i++)
+    {
+        mean = 0.0;
+        for (p = co_val + i; p < co_val + n_point * e; p += e)
+            mean += *p;
+        mean /= n_point;
+
+        ssq = 0.0;
+        for (p = co_val + i; p < co_val + n_point * e; p += e)
         {
-            sqdist = 0.0;
-            for (i = 0; i < e; i++)
-            {
-                dist = (*p1)->co_val[i] - (*p2)->co_val[i];
-                sqdist += dist * dist; 
-            }
-            mean_ssq_dist += (sqdist - mean_ssq_dist) / (n + 1);
-            n++;
+            dist = *p - mean;
+            ssq += dist * dist;
         }
-    return sqrt (mean_ssq_dist);
+        ssq_dist += ssq;
+    }
+
+    return sqrt (2.0 * ssq_dist / (n_point - 1));
 }
 
 bool
@@ -156,86 +165,120 @@ set_prediction_to_invalid (double *pre_val, int n_pre_val)
         pre_val[i] = NAN;
 }
 
-int
-fn_exponential (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted)
+/* predict_exponential: Predict one target from its nnn nearest neighbours in rs and sqdst.*/
+static int
+predict_exponential (Tpoint *target, int nnn, Tpoint **rs, double *sqdst, double *u, double lib_rms_dist,
+                     int n_pre_val, double *pre_val)
 {
-    TkdtNode *tx;
-    double   *sqdst;
-    Tpoint   **rs;       /*result set*/
-    Tpoint   **target;
-    double   *p_pre_val;
-    double   rms_dist, dist, lib_rms_dist, mean_dist;
-    int      nnn;        /*N nearest neighbours*/
+    double   rms_dist, dist, mean_dist;
     int      res, i;
 
-    nnn = lib_set->e + l_nnn_add; 
+    log_nn (target, rs, sqdst, nnn);
 
-    rs    = (Tpoint **) malloc (nnn * sizeof(Tpoint *));
-    sqdst = (double *) malloc (nnn * sizeof(double));
+    if (!full_set (rs, nnn))
+    {
+        set_prediction_to_invalid (pre_val, n_pre_val);
+        return 0;
+    }
 
-    lib_rms_dist = get_rms_dist (lib_set->point, lib_set->n_point, lib_set->e);
+    rms_dist = lib_rms_dist;
+    if (g_context->fn_exp.fn_denom == FN_WEIGHT_DENOM_AVG_NN)
+    {
+        /* Calculate mean distance between target and neighbors*/
+        mean_dist = 0.0;
+        for (i = 0; i < nnn; i++)
+            mean_dist += (sqrt(sqdst[i]) - mean_dist) / (i + 1);
 
-    rms_dist = 0.0;
-    if (l_fn_denom == FN_WEIGHT_DENOM_AVG_LIB)
-        rms_dist = lib_rms_dist;
+        rms_dist = mean_dist;
+    }
+    else if (g_context->fn_exp.fn_denom == FN_WEIGHT_DENOM_MINIMUM)
+    {
+        /*find first non-zero distance, results ordered large to small*/
+        for (i = nnn - 1; i > -1; i--)
+            if ((dist = sqrt(sqdst[i])) > 0)
+                break;
+
+        rms_dist = dist;
+    }
+    else if (g_context->fn_exp.fn_denom == FN_WEIGHT_DENOM_MAXIMUM)
+    {
+        rms_dist = sqrt(sqdst[nnn-1]);
+    }
+    else if (g_context->fn_exp.fn_denom != FN_WEIGHT_DENOM_AVG_LIB)
+        return -1;   /*Incorrect value for fn_denom. Should not be possible*/
+
+    /* Note: rms_dist is not always a root mean square distance. Can also be just one value or an average.*/
+
+    if ((res = est_pre_val (rs, sqdst, nnn, n_pre_val, pre_val, rms_dist, u)) != 0)
+        set_prediction_to_invalid (pre_val, n_pre_val);
+
+    return 0;
+}
+
+int
+fn_exponential (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted)
+{
+    Tpoint      **rs;       /*result sets of a batch of targets*/
+    Tpoint_pack *lib;
+    double      *sqdst, *u, *pre_val;
+    double      lib_rms_dist;
+    int         nnn;        /*N nearest neighbours*/
+    int         n_thread, res = 0;
+    long        i_first, n_batch, i;
+
+    nnn = lib_set->e + g_context->fn_exp.nnn_add; 
+
+    lib_rms_dist = 0.0;
+    if (g_context->fn_exp.fn_denom == FN_WEIGHT_DENOM_AVG_LIB)
+    {
+        if ((lib = point_set_pack (lib_set)) == NULL)
+            return -1;
+        lib_rms_dist = get_rms_dist (lib->co_val, lib->n_point, lib_set->e);
+    }
 
     if (l_pre_val)
         free (l_pre_val);
     l_pre_val = (double *) malloc (pre_set->n_point * pre_set->n_pre_val * sizeof(double));
+    pre_val   = l_pre_val;  /*l_pre_val is per thread (see traverse_all), the fn threads share pre_val*/
+
+    /* Neighbours are logged per target, which has to be done in target order.*/
+    n_thread = (g_log_file && (g_log_level & LOG_NEAR_NEIGH))? 1: get_fn_n_thread ();
+
+    /* The neighbours of a batch of targets are searched at once, into nnn columns per target.
+     * Then the targets are predicted, each from its own rows, directly into its part of l_pre_val.
+     * So the result does not depend on n_thread.
+     */
+    n_batch = pre_set->n_point < FN_NN_BATCH? pre_set->n_point: FN_NN_BATCH;
+    rs      = (Tpoint **) malloc (n_batch * nnn * sizeof(Tpoint *));
+    sqdst   = (double *) malloc (n_batch * nnn * sizeof(double));
+    u       = (double *) malloc (n_batch * nnn * sizeof(double));
 
-    tx = kdtree ((void **) lib_set->point, lib_set->n_point, lib_set->e, (double * (*)(void *))get_co_vec);
+    /* There are no traversed fn parameters, so there is nothing to replay the neighbours for.*/
+    fn_nn_begin (lib_set, pre_set, nnn, g_context->fn_exp.object_only_once, false);
 
-    p_pre_val = l_pre_val;
-    for (target = pre_set->point; target < pre_set->point + pre_set->n_point; target++)
+    for (i_first = 0; i_first < pre_set->n_point && res == 0; i_first += n_batch)
     {
-        /*find nearest neighbours*/
-        kdt_nn ((void *)(*target), tx, lib_set->e, nnn, 
-               (void **) rs, sqdst, (double * (*)(void *))get_co_vec, (bool (*)(void *, void *))exclude, l_object_only_once); 
-        log_nn (*target, rs, sqdst, nnn);
+        if (n_batch > pre_set->n_point - i_first)
+            n_batch = pre_set->n_point - i_first;
 
-        if (full_set (rs, nnn))
+        if (fn_nn_batch (lib_set, pre_set, i_first, n_batch, nnn, g_context->fn_exp.object_only_once, rs, sqdst, NULL, n_thread) < 0)
         {
-            if (!(l_fn_denom == FN_WEIGHT_DENOM_AVG_LIB)) /*Otherwise, rms_dist has been initialized above.*/
-            {
-                if (l_fn_denom == FN_WEIGHT_DENOM_AVG_NN)
-                {
-                    /* Calculate mean distance between target and neighbors*/
-                    mean_dist = 0.0;
-                    for (i = 0; i < nnn; i++)
-                        mean_dist += (sqrt(sqdst[i]) - mean_dist) / (i + 1);
-
-                    rms_dist = mean_dist;
-                }
-                else if (l_fn_denom == FN_WEIGHT_DENOM_MINIMUM)
-                {
-                    /*find first non-zero distance, results ordered large to small*/
-                    for (i = nnn - 1; i > -1; i--)
-                        if ((dist = sqrt(sqdst[i])) > 0)
-                            break;
-
-                    rms_dist = dist;
-                }
-                else if (l_fn_denom == FN_WEIGHT_DENOM_MAXIMUM)
-                {
-                    rms_dist = sqrt(sqdst[nnn-1]);
-                }
-                else return -1;   /*Incorrect value for l_fn_denom. Should not be possible*/
-            }
-
-            /* Note: rms_dist is not always a root mean square distance. Can also be just one value or an average.*/
-
-            if ((res = est_pre_val (rs, sqdst, nnn, pre_set->n_pre_val, p_pre_val, rms_dist)) != 0)
-                set_prediction_to_invalid (p_pre_val, pre_set->n_pre_val);
+            res = -1;
+            break;
         }
-        else
-            set_prediction_to_invalid (p_pre_val, pre_set->n_pre_val);
 
-        p_pre_val += pre_set->n_pre_val;
+#pragma omp parallel for num_threads(n_thread) if(n_thread > 1) copyin(g_context) schedule(static) reduction(min:res)
+        for (i = 0; i < n_batch; i++)
+            if (predict_exponential (pre_set->point[i_first + i], nnn, rs + i * nnn, sqdst + i * nnn, u + i * nnn,
+                                     lib_rms_dist,
+                                     pre_set->n_pre_val, pre_val + (i_first + i) * pre_set->n_pre_val) < 0)
+                res = -1;
     }
 
-    free_kdt (tx);
+    free (rs); free (sqdst); free (u);
 
-    free (rs); free (sqdst);
+    if (res < 0)
+        return res;
 
     log_predicted (pre_set->point, pre_set->n_point, pre_set->n_pre_val, l_pre_val, NULL);
 
@@ -247,18 +290,12 @@ fn_exponential (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted)
 
 #define SMALLEST_DISTANCE 1.0e-200
 
+/* est_pre_val: u is scratch memory for the n weights.*/
 int
-est_pre_val (Tpoint **rs, double *sqdst, int n, int n_pre_val, double *pre_val, double rms_dist)
+est_pre_val (Tpoint **rs, double *sqdst, int n, int n_pre_val, double *pre_val, double rms_dist, double *u)
 {
-    double dist;
-    double sum_u, sum_u_inv, val_est, mp;
-    int    i_pre_val, i;
-
-    if (l_n_set != n)
-    {
-        l_u     = (double *) realloc (l_u, n * sizeof(double));
-        l_n_set = n;
-    }
+    double sum_u;
+    int    i;
 
     sum_u = 0.0;
 
@@ -267,35 +304,17 @@ est_pre_val (Tpoint **rs, double *sqdst, int n, int n_pre_val, double *pre_val,
         /* Nearest neighbors are all on almost exact same location*/
         for (i = 0; i < n; i++)
         {
-            l_u[i] = 1.0;
-            sum_u += l_u[i];
+            u[i] = 1.0;
+            sum_u += u[i];
         }
     }
     else
-    {
-        mp = -l_exp_k / rms_dist;
-
-        for (i = 0; i < n; i++)
-        {
-            dist = sqrt (sqdst[i]);
-            l_u[i] = exp (mp * dist);
-            sum_u += l_u[i];
-        }
-    }
+        sum_u = fn_exp_weights (sqdst, n, true, -g_context->fn_exp.exp_k / rms_dist, u);
 
     if (sum_u == 0.0)
         return -1; /*weights are too small, very unlikely, but still...*/
 
-    sum_u_inv = 1.0 / sum_u;
-
-    for (i_pre_val = 0; i_pre_val < n_pre_val; i_pre_val++)
-    {
-        val_est = 0.0;
-        for (i = 0; i < n; i++)
-            val_est += l_u[i] * sum_u_inv * rs[i]->pre_val[i_pre_val];
-
-        pre_val[i_pre_val] = val_est;
-    }
+    fn_weighted_sum (u, 1.0 / sum_u, rs, n, n_pre_val, pre_val);
 
     return 0;
 }
@@ -314,12 +333,12 @@ log_fn_params_exponential (void)
     if (!(g_log_level & LOG_FN_PAR))
         return 2;
 
-    log_kpexp.nnn_add = l_nnn_add;
-    log_kpexp.excl = (int) l_excl;
-    log_kpexp.var_win = l_var_win;
-    log_kpexp.denom_type = (int) l_fn_denom;
-    log_kpexp.exp_k = l_exp_k;
-    log_kpexp.object_only_once = (short) l_object_only_once;
+    log_kpexp.nnn_add = g_context->fn_exp.nnn_add;
+    log_kpexp.excl = (int) g_context->fn_exp.excl;
+    log_kpexp.var_win = g_context->fn_exp.var_win;
+    log_kpexp.denom_type = (int) g_context->fn_exp.fn_denom;
+    log_kpexp.exp_k = g_context->fn_exp.exp_k;
+    log_kpexp.object_only_once = (short) g_context->fn_exp.object_only_once;
 
     LOGREC(LOG_KPEXP, &log_kpexp, sizeof (log_kpexp), &meta_log_kpexp);
 
@@ -14,6 +14,7 @@
 #include "point.h"
 #include "fn.h"
 #include "fn_tls.h"
+#include "context.h"
 #include "log.h"
 #include "fn_tls_log.h"
 /*#define TIMEMSGPRINT 1*/
@@ -22,19 +23,42 @@
 #define XNN_MINIMAL_DISTANCE 1.0E-15
 #define XNN_SORT_CUTOFF 20
 
-static int    l_nnn = 0;    /* When greater than 0, TLS / SVD only done on l_nnn nearest neighbours (for large datasets) */
-static Texcl  l_excl;       /* How to exclude vectors from library, based upon predictor vector.*/
-static int    l_var_win;
-static double l_theta_min, l_theta_max, l_delta_theta;
 static void   *l_fn_params = NULL;
-static bool   l_center = false;
-static double l_restrict_prediction;
-static Ttls_ref_meth l_ref_meth;
-static int    l_ref_xnn;
-static double *l_shortest_dist = NULL;
-static long   l_n_shortest_dist_alloc = 0;
-static bool   l_warn_is_error;
-static bool   l_object_only_once;
+
+/* Ttls_work: Everything that is written while predicting one target.
+ * Each thread in fn_tls has its own.
+ */
+typedef struct
+{
+    double      *aug_mat;            /*augmented matrix, column first order*/
+    double      *aug_theta;          /*weighted copy of aug_mat, when several thetas are predicted at once*/
+    double      *dist;               /*distances of the points in aug_mat to the target*/
+    double      *weight;
+    double      *means;
+    double      *tg_co_val;          /*coordinates of the target (see point_co_val), in tg_buf with a view*/
+    double      *tg_buf, *rs_buf;    /*coordinates of the target and of a neighbour, for points with a view*/
+    double      *s, *x, *wrk;        /*dtls workspace*/
+    double      *v;                  /*right singular vectors, for the lapack solvers*/
+    double      *vt;                 /*dgesvd: transposed right singular vectors, dsyev: gram matrix*/
+    double      *f, *y;              /*l x l and l x n matrices to solve x from v*/
+    double      *lwrk;               /*lapack workspace*/
+    int         n_lwrk;
+    const Tpoint_pack *lib;          /*packed library, when the whole library is used (nnn 0)*/
+    bool        gram_lib;            /*KTLS_SOLVER_GRAM with the whole library: accumulate the gram matrix*/
+    bool        gram_ill;            /*gram_lib: the gram matrix of the target is ill-conditioned, solve
+                                       the augmented matrix instead (see fill_lib_aug_mat)*/
+    int         ldc, n_theta;        /*gram_lib: for the augmented matrix, when it is needed after all*/
+    const Texcl_setting *excl;       /*exclusion setting of the thread that called fn_tls*/
+    long        excl_win[EXCL_N_KEY];
+    bool        excl_win_only;       /*the windows are the complete exclusion, exclude is not called*/
+    long        *lib_ix;             /*the library points in the gram matrix*/
+    double      *blk;                /*block of rows of the augmented matrix*/
+    double      *aug_check, *x_check;  /*KTLS_SOLVER_CHECK: copy of the augmented matrix, lapack solution*/
+    double      check_diff[2];       /*KTLS_SOLVER_CHECK: largest difference with dtls of the svd and gram solutions*/
+    double      *shortest_dist;      /*distances for reference method KTLS_REFMETH_XNN_GT_ZERO*/
+    long        n_shortest_dist_alloc;
+    long        n_shortest_dist_added;
+} Ttls_work;
 
 int
 new_fn_params_tls (int e, void **fn_params);
@@ -59,45 +83,75 @@ log_dtls (double tol1, double tol2, int ldx, int rank, int ierr,
           int iwarn, int ldc, int m, int n, int l,
           double *c, double *x, double *s);
 
+int
+log_tls_check (double svd_diff, double gram_diff);
+
 static void
-init_xnn (long);
+init_xnn (Ttls_work *w, long);
 
 extern void
 dtls_ (double * aug_mat, int * ldc, int * n_points, int * n_a, int * n_b, 
        double * l_s, double * l_x, int * _ldx, double * l_wrk, int * rank, 
        double * tol1, double * tol2, char * comprt, int * ierr, int * iwarn);
 
+/* LAPACK and BLAS */
+extern void
+dgesvd_ (char *jobu, char *jobvt, int *m, int *n, double *a, int *lda, double *s, double *u, int *ldu,
+         double *vt, int *ldvt, double *work, int *lwork, int *info);
+
+extern void
+dsyev_ (char *jobz, char *uplo, int *n, double *a, int *lda, double *w, double *work, int *lwork, int *info);
+
+extern void
+dsyrk_ (char *uplo, char *trans, int *n, int *k, double *alpha, double *a, int *lda,
+        double *beta, double *c, int *ldc);
+
+extern void
+dpotrf_ (char *uplo, int *n, double *a, int *lda, int *info);
+
+extern void
+dpotrs_ (char *uplo, int *n, int *nrhs, double *a, int *lda, double *b, int *ldb, int *info);
+
 int
 init_fn_tls (Tnew_fn_params *new_fn_params,
              Tnext_fn_params *next_fn_params,
              Tfn *fn,
              double theta_min, double theta_max, double delta_theta,
              int nnn, Texcl excl, int var_win, bool center, double restrict_prediction,
-             bool warn_is_error, Ttls_ref_meth ref_meth, int ref_xnn, bool object_only_once)
+             bool warn_is_error, Ttls_ref_meth ref_meth, int ref_xnn, bool object_only_once,
+             Ttls_solver solver, double nn_eps, long nn_max_leaf)
 {
-    l_nnn     = nnn;
-    l_excl    = excl;
-    l_var_win = var_win;
+    g_context->fn_tls.nnn     = nnn;
+    g_context->fn_tls.excl    = excl;
+    g_context->fn_tls.var_win = var_win;
 
-    l_theta_min   = theta_min;
-    l_theta_max   = theta_max;
-    l_delta_theta = delta_theta;
+    g_context->fn_tls.theta_min   = theta_min;
+    g_context->fn_tls.theta_max   = theta_max;
+    g_context->fn_tls.delta_theta = delta_theta;
 
-    l_center      = center;
+    g_context->fn_tls.center      = center;
 
-    l_ref_meth    = ref_meth;
-    l_ref_xnn     = ref_xnn;
+    g_context->fn_tls.ref_meth    = ref_meth;
+    g_context->fn_tls.ref_xnn     = ref_xnn;
     
-    l_warn_is_error = warn_is_error;
-    l_object_only_once = object_only_once;
+    g_context->fn_tls.warn_is_error = warn_is_error;
+    g_context->fn_tls.object_only_once = object_only_once;
+    g_context->fn_tls.solver = solver;
 
-    if (l_ref_meth == KTLS_REFMETH_XNN_GT_ZERO && l_ref_xnn < 1)
+    if (g_context->fn_tls.ref_meth == KTLS_REFMETH_XNN_GT_ZERO && g_context->fn_tls.ref_xnn < 1)
     {
         fprintf (stderr, "Number of values for reference distance too small <%d>\n", ref_xnn);
         return -1;
     }
 
-    l_restrict_prediction = restrict_prediction;
+    /* The nearest neighbours (nnn > 0) may be searched approximately, see set_fn_nn_approx.*/
+    if (set_fn_nn_approx (nn_eps, nn_max_leaf) < 0)
+    {
+        fprintf (stderr, "Incorrect approximation of the neighbour search <%g> <%ld>\n", nn_eps, nn_max_leaf);
+        return -1;
+    }
+
+    g_context->fn_tls.restrict_prediction = restrict_prediction;
 
     *new_fn_params  = &new_fn_params_tls;
     *next_fn_params = &next_fn_params_tls;
@@ -109,36 +163,74 @@ init_fn_tls (Tnew_fn_params *new_fn_params,
 }
 
 static double l_theta;
+static double *l_thetas = NULL;  /*the theta grid theta_min .. theta_max, step delta_theta*/
+static int    l_n_theta = 0;
+static int    l_i_theta = -1;    /*index of l_theta in l_thetas*/
+#pragma omp threadprivate(l_theta, l_thetas, l_n_theta, l_i_theta)
+
+/* Theta sweep: for the first theta, the targets of a set are predicted for every theta of the grid,
+ * each from one unweighted augmented matrix and one set of distances. The predictions for the other
+ * thetas are kept per set, in the order in which the set functions give the sets, and are handed out
+ * by the fn calls for those thetas.
+ */
+typedef struct
+{
+    uint64_t fp;        /*fingerprint of the library and prediction set*/
+    long     n_point;
+    long     n_val;     /*n_point x n_pre_val*/
+    double   *pre_val;  /*(l_n_theta - 1) x n_val predictions, for l_thetas[1] ..*/
+    int      *status;
+} Ttls_sweep_set;
+
+#define TLS_SWEEP_MAX (1024L * 1024 * 1024)  /*maximum size in bytes of the kept predictions*/
+
+static Ttls_sweep_set *l_sweep     = NULL;
+static long           l_n_sweep    = 0;
+static long           l_i_sweep    = -1;  /*set of the current fn call*/
+static long           l_sweep_size = 0;
+
+static double *l_pre_val = NULL;
+static int    *l_status = NULL;
+static double l_check_diff[2] = { -1.0, -1.0 };  /*KTLS_SOLVER_CHECK: svd and gram, of the last fn_tls call*/
+#pragma omp threadprivate(l_sweep, l_n_sweep, l_i_sweep, l_sweep_size, l_pre_val, l_status, l_check_diff)
+#define THETA_MARGIN 1E-10
+
+static void
+free_tls_sweep (void);
 
 int
 new_fn_params_tls (int e, void **fn_params)
 {
-    exclude_init (l_excl, l_var_win, e);
-    l_theta = l_theta_min - 1.0;
+    double theta;
+
+    exclude_init (g_context->fn_tls.excl, g_context->fn_tls.var_win, e);
+    fn_nn_cache_clear ();
+    free_tls_sweep ();
+
+    if (l_thetas)
+        free (l_thetas);
+    l_thetas  = NULL;
+    l_n_theta = 0;
+    for (theta = g_context->fn_tls.theta_min; theta <= g_context->fn_tls.theta_max + THETA_MARGIN; theta += g_context->fn_tls.delta_theta)
+    {
+        l_thetas = (double *) realloc (l_thetas, (l_n_theta + 1) * sizeof (double));
+        l_thetas[l_n_theta++] = theta;
+        if (g_context->fn_tls.delta_theta <= 0.0)
+            break;
+    }
+
+    l_i_theta = -1;
     return next_fn_params_tls (fn_params);
 }
 
-static double *l_pre_val = NULL;
-static int    *l_status = NULL;
-#define THETA_MARGIN 1E-10
-
 int
 next_fn_params_tls (void **fn_params)
 {
     Tfn_params_tls *_fn_params;
 
-    if (l_theta < l_theta_min)
-        l_theta = l_theta_min;
-    else
-        l_theta += l_delta_theta;
-
-
-    if (l_theta > l_theta_max + THETA_MARGIN)
+    if (++l_i_theta >= l_n_theta)
     {
-
-        if (*fn_params)
-            free (*fn_params);
-        *fn_params = NULL;
+        *fn_params = NULL;  /*the statistics of the sets refer to it, free_traverse frees it*/
 
         if (l_pre_val)
             free (l_pre_val);
@@ -149,21 +241,29 @@ next_fn_params_tls (void **fn_params)
         l_status = NULL;
 
         free_tls ();
+        fn_nn_cache_clear ();
+        free_tls_sweep ();
 
         return 1; /* stop, no new fn parameters to traverse*/
     }
 
+    l_theta = l_thetas[l_i_theta];
+
     _fn_params = (Tfn_params_tls *) malloc (sizeof(Tfn_params_tls));
-    _fn_params->nnn     = l_nnn;
-    _fn_params->excl    = l_excl;
-    _fn_params->var_win = l_var_win;
+    _fn_params->nnn     = g_context->fn_tls.nnn;
+    _fn_params->excl    = g_context->fn_tls.excl;
+    _fn_params->var_win = g_context->fn_tls.var_win;
     _fn_params->theta   = l_theta;
-    _fn_params->center  = l_center;
+    _fn_params->center  = g_context->fn_tls.center;
 
     *fn_params = (void *) _fn_params;
 
     log_fn_params_tls ();
 
+    /* The same sets again, with the same neighbours and possibly already predicted.*/
+    fn_nn_cache_rewind ();
+    l_i_sweep = -1;
+
     return 0;
 }
 
@@ -182,55 +282,53 @@ getdist (double *vec1, double *vec2, int e)
     return (sqrt (sqdist));
 }
 
-static long l_n_shortest_dist_added = 0;
-
 static void
-init_xnn (long n_alloc)
+init_xnn (Ttls_work *w, long n_alloc)
 {
     long determined_n_alloc;
 
-    if (l_ref_xnn > XNN_SORT_CUTOFF)
+    if (g_context->fn_tls.ref_xnn > XNN_SORT_CUTOFF)
         determined_n_alloc = n_alloc;
     else
-        determined_n_alloc = l_ref_xnn; /* Just keep the array sorted and do no sorting afterwards.*/
+        determined_n_alloc = g_context->fn_tls.ref_xnn; /* Just keep the array sorted and do no sorting afterwards.*/
 
-    if (l_n_shortest_dist_alloc < determined_n_alloc)
+    if (w->n_shortest_dist_alloc < determined_n_alloc)
     {
-        if (l_shortest_dist)
+        if (w->shortest_dist)
         {
-            free (l_shortest_dist);
-            l_shortest_dist = NULL;
+            free (w->shortest_dist);
+            w->shortest_dist = NULL;
         }
 
         if (determined_n_alloc > 0)
-            l_shortest_dist = (double *) malloc (determined_n_alloc * sizeof (double));
+            w->shortest_dist = (double *) malloc (determined_n_alloc * sizeof (double));
 
-        l_n_shortest_dist_alloc = determined_n_alloc;
+        w->n_shortest_dist_alloc = determined_n_alloc;
     }
 
-    l_n_shortest_dist_added = 0;
+    w->n_shortest_dist_added = 0;
 }
 
 static inline void
-add_xnn (double d)  /*d >= 0.0*/
+add_xnn (Ttls_work *w, double d)  /*d >= 0.0*/
 {
     if (d < XNN_MINIMAL_DISTANCE)
         return;
 
-    if (l_ref_xnn > XNN_SORT_CUTOFF)
-        l_shortest_dist[l_n_shortest_dist_added++] = d; /* Sort when the value is needed.*/
+    if (g_context->fn_tls.ref_xnn > XNN_SORT_CUTOFF)
+        w->shortest_dist[w->n_shortest_dist_added++] = d; /* Sort when the value is needed.*/
     else
     {
         /* Keep the list sorted.*/
         long high, low = 0, mid, i;
 
-        high = l_n_shortest_dist_added;
+        high = w->n_shortest_dist_added;
 
         /* Find index of value */
         while (low < high)
         {
             mid = (low + high) >> 1;
-            if (l_shortest_dist[mid] < d)
+            if (w->shortest_dist[mid] < d)
                 low = mid + 1;
             else
                 high = mid;
@@ -238,19 +336,19 @@ add_xnn (double d)  /*d >= 0.0*/
 
         /* low now contains the position where d should be inserted.*/
 
-        if (low < l_n_shortest_dist_alloc)
+        if (low < w->n_shortest_dist_alloc)
         {
-            if (l_n_shortest_dist_added > 0)
+            if (w->n_shortest_dist_added > 0)
             {
                 /* Shift the the greater values in the array to the right */
-                for (i = ((l_n_shortest_dist_added < l_n_shortest_dist_alloc)? l_n_shortest_dist_added: l_n_shortest_dist_alloc - 1); i > low; i--)
-                    l_shortest_dist[i] = l_shortest_dist[i-1];
+                for (i = ((w->n_shortest_dist_added < w->n_shortest_dist_alloc)? w->n_shortest_dist_added: w->n_shortest_dist_alloc - 1); i > low; i--)
+                    w->shortest_dist[i] = w->shortest_dist[i-1];
             }
 
-            l_shortest_dist[low] = d;
+            w->shortest_dist[low] = d;
 
-            if (l_n_shortest_dist_added < l_n_shortest_dist_alloc)
-                l_n_shortest_dist_added++;
+            if (w->n_shortest_dist_added < w->n_shortest_dist_alloc)
+                w->n_shortest_dist_added++;
         }
 
     }
@@ -259,36 +357,72 @@ add_xnn (double d)  /*d >= 0.0*/
 }
 
 static double
-get_xnn_ref_dst ()
+get_xnn_ref_dst (Ttls_work *w)
 {
     int i;
     double val = 0.0;
     int n = 0;
 
-    if (!l_n_shortest_dist_added)
+    if (!w->n_shortest_dist_added)
         return 0.0;
 
-    if (l_ref_xnn > XNN_SORT_CUTOFF)
-        qsort(l_shortest_dist, l_n_shortest_dist_added, sizeof (double), compare_double);
+    if (g_context->fn_tls.ref_xnn > XNN_SORT_CUTOFF)
+        qsort(w->shortest_dist, w->n_shortest_dist_added, sizeof (double), compare_double);
 
-    for (i = 0; i < ((l_n_shortest_dist_added < l_ref_xnn)? l_n_shortest_dist_added: l_ref_xnn); i++)
-        val = (l_shortest_dist[i] - val) / ++n;
+    for (i = 0; i < ((w->n_shortest_dist_added < g_context->fn_tls.ref_xnn)? w->n_shortest_dist_added: g_context->fn_tls.ref_xnn); i++)
+        val = (w->shortest_dist[i] - val) / ++n;
 
     return val;
 }
 
+/* reference_distance: The distance by which the distances are divided in the weights.*/
+static double
+reference_distance (Ttls_work *w, double avg_dst, double *sqdst, int n_rs, Ttls_ref_meth ref_meth)
+{
+    double ref_dst;
+    int    i;
+
+    ref_dst = avg_dst;
+    if (ref_meth == KTLS_REFMETH_XNN_GT_ZERO)
+    {
+        if (sqdst)  /* List of sorted square distances already available */
+        {
+            int counter = 0;
+
+            ref_dst = 0.0;
+            /* In sqdst, distances are ordered from large to small.
+             */
+            for (i = ((n_rs < g_context->fn_tls.ref_xnn)? 0: n_rs - g_context->fn_tls.ref_xnn); i < n_rs; i++)
+                ref_dst = (sqrt(sqdst[i]) - ref_dst) / ++counter;
+        }
+        else
+            ref_dst = get_xnn_ref_dst (w);
+
+        if (ref_dst == 0.0)
+        {
+            fprintf (stdout, "Warning: reference distance is 0.0, switching to overall mean distance.\n");
+            ref_dst = avg_dst;
+        }
+    }
+
+    return ref_dst;
+}
+
+/* fill_aug_mat: Fill the unweighted (and possibly centered) augmented matrix, with the distances of the
+ *               points in dist and the reference distance in *_ref_dst.
+ * Returns: the number of points in the augmented matrix.
+ */
 static int
-fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sqdst, double *weight,
+fill_aug_mat (Ttls_work *w, double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sqdst, double *dist,
               int ldc, int e, int n_pre_val, double *means, bool center,
-              Ttls_ref_meth ref_meth)
+              Ttls_ref_meth ref_meth, double *_ref_dst)
 {
     double   *p1_aug_mat, *p2_aug_mat;
-    double   *p_sqdst, *p_weight;
-    double   avg_dst, dval, *p_vec, *vec, fact;
-    int      aug_n_col, i, n;
+    double   *p_sqdst, *p_dist;
+    double   avg_dst, dval, *p_vec, *vec, *co_val, *pre_val;
+    int      aug_n_col, n;
     Tpoint   **p_pt;
     double   *p_mean;
-    double   ref_dst;
     double   invnp1;
 
     TMMSG("fill_aug_mat: begin");
@@ -300,7 +434,7 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
     n          = 0;
     avg_dst    = 0.0;
     p1_aug_mat = aug_mat;
-    p_weight   = weight;
+    p_dist     = dist;
     p_sqdst    = sqdst;
 
     if (center)
@@ -329,8 +463,8 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
     }
 #endif
 
-    if (l_ref_meth == KTLS_REFMETH_XNN_GT_ZERO && !sqdst)
-        init_xnn (n_rs);
+    if (g_context->fn_tls.ref_meth == KTLS_REFMETH_XNN_GT_ZERO && !sqdst)
+        init_xnn (w, n_rs);
 
 
     TMMSG("fill_aug_mat: before first loop");
@@ -342,21 +476,26 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
         {
             if (! *p_pt)
                 break;
-            *p_weight++ = dval = sqrt (*p_sqdst++);
+            co_val  = point_co_val (*p_pt, w->rs_buf);
+            pre_val = (*p_pt)->pre_val;
+            *p_dist++ = dval = sqrt (*p_sqdst++);
         }
         else
         {
             /*if (target == *p_pt || exclude (target, *p_pt))*/
-            if (exclude (target, *p_pt))
+            if (exclude (target, *p_pt, w->excl))
                 continue;
-            *p_weight++ = dval =  getdist (target->co_val, (*p_pt)->co_val, e);
+            /* The whole library, in order: read it from the packed copy.*/
+            co_val  = w->lib->co_val + (p_pt - rs) * e;
+            pre_val = w->lib->pre_val + (p_pt - rs) * n_pre_val;
+            *p_dist++ = dval =  getdist (w->tg_co_val, co_val, e);
         }
 
         invnp1 = 1.0 / (n + 1);
         avg_dst += (dval - avg_dst) * invnp1;
 
         if (ref_meth == KTLS_REFMETH_XNN_GT_ZERO && !sqdst)
-            add_xnn (dval);
+            add_xnn (w, dval);
 
         /* copy vector and prediction values into augmented matrix */
 
@@ -368,7 +507,7 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
 
         TMMSG("fill_aug_mat: before mean calculation A");
 
-        for (p_vec = vec = (*p_pt)->co_val; p_vec < vec + e; p_vec++)
+        for (p_vec = vec = co_val; p_vec < vec + e; p_vec++)
         {
             *p2_aug_mat = *p_vec;
             p2_aug_mat += ldc;
@@ -381,7 +520,7 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
 
         TMMSG("fill_aug_mat: mean calculation B");
 
-        for (p_vec = vec = (*p_pt)->pre_val; p_vec < vec + n_pre_val; p_vec++)
+        for (p_vec = vec = pre_val; p_vec < vec + n_pre_val; p_vec++)
         {
             *p2_aug_mat = *p_vec;
             p2_aug_mat += ldc;
@@ -415,350 +554,1096 @@ fill_aug_mat (double *aug_mat, Tpoint *target, Tpoint **rs, int n_rs, double *sq
 
     TMMSG("fill_aug_mat: after subtract means");
 
-    /* Compute weights and apply to augmented matrix */
-    ref_dst = avg_dst;
-    if (ref_meth == KTLS_REFMETH_XNN_GT_ZERO)
-    {
-        if (sqdst)  /* List of sorted square distances already available */
-        {
-            int counter = 0;
+    /* The weights are applied by weight_aug_mat */
+    *_ref_dst = reference_distance (w, avg_dst, sqdst, n_rs, ref_meth);
 
-            ref_dst = 0.0;
-            /* In sqdst, distances are ordered from large to small.
-             */
-            for (i = ((n_rs < l_ref_xnn)? 0: n_rs - l_ref_xnn); i < n_rs; i++)
-                ref_dst = (sqrt(sqdst[i]) - ref_dst) / ++counter;
-        }
-        else
-            ref_dst = get_xnn_ref_dst ();
+    TMMSG("fill_aug_mat: end");
 
-        if (ref_dst == 0.0)
-        {
-            fprintf (stdout, "Warning: reference distance is 0.0, switching to overall mean distance.\n");
-            ref_dst = avg_dst;
-        }
-    }
+    return n;
+}
+
+/* weight_aug_mat: Weigh the n points of the augmented matrix aug_mat with exp(-theta * dist / ref_dst),
+ *                 into w_aug_mat, which may be aug_mat itself.
+ */
+static void
+weight_aug_mat (const double *aug_mat, double *w_aug_mat, const double *dist, double *weight, int n,
+                int ldc, int aug_n_col, double theta, double ref_dst)
+{
+    const double *p1_aug_mat, *p2_aug_mat;
+    double       *p1_w_aug_mat, *p2_w_aug_mat;
+    double       *p_weight;
+    int          i;
 
-    TMMSG("fill_aug_mat: before weight calculations");
+    TMMSG("weight_aug_mat: before weight calculations");
 
-    fact = -1.0 * l_theta / ref_dst;
-    for (p_weight = weight; p_weight < weight + n; p_weight++)
-        *p_weight = exp (fact * (*p_weight));
+    fn_exp_weights (dist, n, false, -1.0 * theta / ref_dst, weight);
 
     /* This looks a bit messy, due to the fact that the augmented matrix is in column first order */
-    p1_aug_mat = aug_mat;
+    p1_aug_mat   = aug_mat;
+    p1_w_aug_mat = w_aug_mat;
     for (i = 0; i < aug_n_col; i++)
     {
-        p2_aug_mat = p1_aug_mat;
+        p2_aug_mat   = p1_aug_mat;
+        p2_w_aug_mat = p1_w_aug_mat;
         for (p_weight = weight; p_weight < weight + n; p_weight++)
-            *p2_aug_mat++ *= *p_weight;
+            *p2_w_aug_mat++ = *p2_aug_mat++ * *p_weight;
 
-        p1_aug_mat += ldc;
+        p1_aug_mat   += ldc;
+        p1_w_aug_mat += ldc;
     }
-    TMMSG("fill_aug_mat: after weight calculations");
-
-    TMMSG("fill_aug_mat: end");
-
-    return n;
+    TMMSG("weight_aug_mat: after weight calculations");
 }
 
-
-static double *l_s   = NULL;
-static double *l_x   = NULL;
-static double *l_wrk = NULL;
-
-int
-tls (double *aug_mat, int ldc, int n_points, int n_a, int n_b, double **_x, int *_ldx, int *err, int *warn)
+/* scan_library: With the whole library and KTLS_SOLVER_GRAM, the augmented matrix is not filled.
+ *               Find the library points that are not excluded, with their distances to the target,
+ *               the means of the columns and the reference distance (in *_ref_dst), as fill_aug_mat.
+ * Returns: the number of points.
+ */
+static int
+scan_library (Ttls_work *w, Tpoint *target, Tpoint **lib, long n_lib, int e, int n_pre_val, double *_ref_dst)
 {
-    int rank =  -1, ierr, iwarn;
-    double tol1 = 0.0000000000000001, tol2 = 0.00001;
-    char comprt = 'X'; /*compute both rank and tol1*/
+    const double *a, *b;
+    const long   *key;
+    double       sum_dst = 0.0, dval;
+    long         i, tg_key[EXCL_N_KEY];
+    int          j, k, n = 0, n_col;
 
-    static int _n_a = 0, _n_b = 0, _n_points = 0;
+    n_col = e + n_pre_val;
+    exclude_get_key (target, tg_key);
 
-    /* Lazy resizing of memory.*/
-    if (_n_a + _n_b < n_a + n_b || !l_s)
-    {
-        if (l_s)
-            free (l_s);
-        l_s = (double *) malloc ((n_a + n_b) * sizeof (double));
-    }
+    if (g_context->fn_tls.center)
+        for (j = 0; j < n_col; j++)
+            w->means[j] = 0.0;
 
-    if (_n_a * _n_b < n_a * n_b || !l_x)
-    {
-        if (l_x)
-            free (l_x);
-        l_x = (double *) malloc ((n_a * n_b) * sizeof (double));
-    }
+    if (g_context->fn_tls.ref_meth == KTLS_REFMETH_XNN_GT_ZERO)
+        init_xnn (w, n_lib);
 
-    if (_n_a + _n_b + _n_points < n_a + n_b + n_points || !l_wrk)
+    for (i = 0; i < n_lib; i++)
     {
-        if (l_wrk)
-            free (l_wrk);
-        l_wrk = (double *) malloc ((n_a + n_b + n_points) * sizeof(double));
-    }
+        if (w->excl_win_only)
+        {
+            key = w->lib->key + i * EXCL_N_KEY;
+            for (k = 0; k < EXCL_N_KEY; k++)
+                if (labs (key[k] - tg_key[k]) < w->excl_win[k])
+                    break;
+            if (k < EXCL_N_KEY)
+                continue;
+        }
+        else if (exclude (target, lib[i], w->excl))
+            continue;
 
-    *_ldx  = n_a;
-    _n_a = n_a;
-    _n_b = n_b;
-    _n_points = n_points;
+        a = w->lib->co_val + i * e;
+        b = w->lib->pre_val + i * n_pre_val;
+        w->dist[n]   = dval = getdist (w->tg_co_val, (double *) a, e);
+        w->lib_ix[n] = i;
+        sum_dst     += dval;
 
-    dtls_ (aug_mat, &ldc, &n_points, &n_a, &n_b, l_s, l_x, _ldx, l_wrk, &rank, &tol1, &tol2, &comprt, &ierr, &iwarn);
+        if (g_context->fn_tls.ref_meth == KTLS_REFMETH_XNN_GT_ZERO)
+            add_xnn (w, dval);
 
-/*    if (iwarn > 0)
- *      fprintf (stderr, "Warning: rank lowered to %d\n", rank);
- */
-    log_dtls (tol1, tol2, *_ldx, rank, ierr, iwarn, ldc, n_points, n_a, n_b, aug_mat, l_x, l_s);
+        /* Sums, divided at the end, instead of running means: no division per point.*/
+        if (g_context->fn_tls.center)
+        {
+            for (j = 0; j < e; j++)
+                w->means[j] += a[j];
+            for (j = 0; j < n_pre_val; j++)
+                w->means[e + j] += b[j];
+        }
 
-    *_x   = l_x;
-    *err  = ierr;
-    *warn = iwarn;
-    return ierr;
-}
+        n++;
+    }
 
-static void
-free_tls (void)
-{
-    if (l_s)
-        free (l_s);
-    if (l_x)
-        free (l_x);
-    if (l_wrk)
-        free (l_wrk);
-    if (l_status)
-        free (l_status);
+    if (n == 0)
+        return 0;
 
-    l_s      = NULL;
-    l_x      = NULL;
-    l_wrk    = NULL;
-    l_status = NULL;
+    if (g_context->fn_tls.center)
+        for (j = 0; j < n_col; j++)
+            w->means[j] /= n;
 
-    if (l_shortest_dist)
-    {
-        free (l_shortest_dist);
-        l_shortest_dist = NULL;
-        l_n_shortest_dist_alloc = 0;
-    }
+    *_ref_dst = reference_distance (w, sum_dst / n, NULL, n, g_context->fn_tls.ref_meth);
+
+    return n;
 }
 
-int
-fn_tls (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted)
+/* fill_lib_aug_mat: The unweighted (and possibly centered) augmented matrix of the n points that scan_library
+ *                   found, as fill_aug_mat makes it. For gram_lib, when the gram matrix is too ill-conditioned
+ *                   for lapack_tls_gram. The matrices are allocated at the first use.
+ * Returns: 0, or -1 when out of memory.
+ */
+static int
+fill_lib_aug_mat (Ttls_work *w, int n, int e, int n_pre_val)
 {
-    double   *sqdst, *sqdst_alloc, *weight;
-    double   *p1_x, *aug_mat, *p_pre_val;
-//    double   *c, *p1_x, *aug_mat, *p_pre_val;
-    int      aug_n_col, aug_n_points, ldc, e, n_pre_val, i, j, ierr, iwarn, ldx, n_warn;
-    long     n_rs, n_rs_alloc, n_rs_new;
-    Tpoint   **ptarget;
-    Tpoint   **rs, **rs_alloc;       /*result set*/
-    double   *means = NULL;
-    int      *p_status;
+    const double *a, *p;
+    double       *c;
+    int          aug_n_col, ldc = w->ldc, r, j;
 
-    e         = pre_set->e;
-    n_pre_val = pre_set->n_pre_val;
-    n_warn = 0;
+    aug_n_col = e + 1 + n_pre_val;
 
-    TMMSG("fn_tls: start");
+    if (!w->aug_mat)
+        w->aug_mat = (double *) malloc (ldc * aug_n_col * sizeof(double));
+    if (!w->aug_theta && w->n_theta > 1)
+        w->aug_theta = (double *) malloc (ldc * aug_n_col * sizeof(double));
+    if (!w->aug_mat || (w->n_theta > 1 && !w->aug_theta))
+        return -1;
 
-    /* means contains the mean value per axis, over all vectors from the result set.
-     * It is filled in fill_aug_matrix.
-     */
-    if (l_center)
-        means = (double *) malloc ((e + n_pre_val) * sizeof(double));
+    for (r = 0; r < n; r++)
+    {
+        a = w->lib->co_val + w->lib_ix[r] * e;
+        p = w->lib->pre_val + w->lib_ix[r] * n_pre_val;
+        c = w->aug_mat + r;
+        c[0] = 1.0;
+        if (g_context->fn_tls.center)
+        {
+            for (j = 0; j < e; j++)
+                c[(j + 1) * ldc] = a[j] - w->means[j];
+            for (j = 0; j < n_pre_val; j++)
+                c[(e + j + 1) * ldc] = p[j] - w->means[e + j];
+        }
+        else
+        {
+            for (j = 0; j < e; j++)
+                c[(j + 1) * ldc] = a[j];
+            for (j = 0; j < n_pre_val; j++)
+                c[(e + j + 1) * ldc] = p[j];
+        }
+    }
 
-    /* Matrix to hold predicted values */
-    if (l_pre_val)
-        free (l_pre_val);
-    l_pre_val = (double *) malloc (pre_set->n_point * n_pre_val * sizeof(double));
+    return 0;
+}
 
-    /* Array to hold status values */
-    if (l_status)
-        free (l_status);
-    l_status = (int *) calloc (pre_set->n_point * n_pre_val,  sizeof(int));
+#define TLS_GRAM_BLOCK 256  /*number of rows of the augmented matrix per dsyrk call*/
 
-    aug_n_col = e + 1 + n_pre_val;
+/* accumulate_gram: The gram matrix C'C (lower triangle) of the weighted augmented matrix C of the n points
+ *                  found by scan_library, into w->vt. C is never formed: blocks of its rows are made from
+ *                  the packed library, and added by dsyrk.
+ */
+static void
+accumulate_gram (Ttls_work *w, int n, int e, int n_pre_val, double theta, double ref_dst)
+{
+    const double *a, *p;
+    double       alpha = 1.0, beta = 0.0, fact, wt, *b = w->blk;
+    int          nl, n_col, i0, nb, ldb = TLS_GRAM_BLOCK, r, j;
+    char         uplo = 'L', trans = 'T';
 
-    if (l_nnn > 0)
-    {
-        rs = rs_alloc =  (Tpoint **) malloc (l_nnn * sizeof (Tpoint *));
-        n_rs = n_rs_alloc = l_nnn;
-        ldc        = aug_n_col > n_rs? aug_n_col: n_rs;  /*leading dimension of aug_mat (column-first order)*/
+    n_col = e + n_pre_val;
+    nl    = n_col + 1;
+    fact  = -1.0 * theta / ref_dst;
 
-        sqdst  = sqdst_alloc = (double *) malloc (ldc * sizeof (double));
-        if (!lib_set->tx)
-            lib_set->tx = kdtree ((void **) lib_set->point, lib_set->n_point, e, (double * (*)(void *))get_co_vec);
-    }
-    else
+    for (i0 = 0; i0 < n; i0 += TLS_GRAM_BLOCK)
     {
-        sqdst    = NULL;
-        rs       = lib_set->point;
-        n_rs     = lib_set->n_point;
-        ldc      = aug_n_col > n_rs? aug_n_col: n_rs;  /*leading dimension of aug_mat (column-first order)*/
-    }
+        nb = (n - i0 < TLS_GRAM_BLOCK)? n - i0: TLS_GRAM_BLOCK;
+        fn_exp_weights (w->dist + i0, nb, false, fact, w->weight + i0);
 
-    aug_mat = (double *) malloc (ldc * aug_n_col * sizeof(double));
-    weight  = (double *) malloc (n_rs * sizeof (double));
-
-    p_pre_val = l_pre_val;
-    p_status = l_status;
-    TMMSG("fn_tls: before main loop");
-    for (ptarget = pre_set->point; ptarget < pre_set->point + pre_set->n_point; ptarget++)
-    {
-        if (l_nnn > 0)
+        /* The rows as fill_aug_mat and weight_aug_mat make them: 1, the (centered) values, times the weight.*/
+        for (r = 0; r < nb; r++)
         {
-            TMMSG("fn_tls: before nnn find");
-
-            /* Find nearest neighbours */
-            n_rs_new = kdt_nn ((void *)(*ptarget), lib_set->tx, lib_set->e, l_nnn, 
-                               (void **) rs, sqdst, (double * (*)(void *))get_co_vec,
-                               (bool (*)(void *, void *))exclude, l_object_only_once); 
-
-            /* When kdt_nn returns a different number of neighbors than expected, we may have to
-             * adjust some parameters for the augmented matrix.
-             * The augmented matrix has already been allocated to its maximum needed size, 
-             * so no reallocation necessary.
-             */
-            if (n_rs_new != n_rs)
+            wt   = w->weight[i0 + r];
+            a    = w->lib->co_val + w->lib_ix[i0 + r] * e;
+            p    = w->lib->pre_val + w->lib_ix[i0 + r] * n_pre_val;
+            b[r] = wt;
+            if (g_context->fn_tls.center)
+            {
+                for (j = 0; j < e; j++)
+                    b[(j + 1) * ldb + r] = (a[j] - w->means[j]) * wt;
+                for (j = 0; j < n_pre_val; j++)
+                    b[(e + j + 1) * ldb + r] = (p[j] - w->means[e + j]) * wt;
+            }
+            else
             {
-                n_rs = n_rs_new;
-                ldc  = aug_n_col > n_rs? aug_n_col: n_rs;  /*leading dimension of aug_mat (column-first order)*/
+                for (j = 0; j < e; j++)
+                    b[(j + 1) * ldb + r] = a[j] * wt;
+                for (j = 0; j < n_pre_val; j++)
+                    b[(e + j + 1) * ldb + r] = p[j] * wt;
             }
+        }
 
-            /* The KDT algorithm (unfortunately) puts the smallest distance and corresponding point 
-             * at the end of the array. Unfilled positions occur at the start of the array.
-             */
-            rs = rs_alloc + n_rs_alloc - n_rs;
-            sqdst = sqdst_alloc + n_rs_alloc - n_rs;
+        dsyrk_ (&uplo, &trans, &nl, &nb, &alpha, b, &ldb, &beta, w->vt, &nl);
+        beta = 1.0;
+    }
+}
 
-            TMMSG("fn_tls: after nnn find");
 
-            log_nn (*ptarget, rs, sqdst, n_rs /*l_nnn*/);
-        }
+#define DTLS_NUMEPS 0.1E-15  /*smallest tolerance of dtls*/
+#define TLS_GRAM_GAP 1.0E-8  /*smallest gap of the eigenvalues of a gram matrix at the rank, relative to the largest*/
+#define TLS_IERR_GRAM_ILL 7  /*ierr of lapack_tls_gram for an ill-conditioned gram matrix (dtls uses 1 .. 6)*/
 
+/* lapack_tls_x: The TLS solution x (n x l) from the right singular vectors w->v ((n + l) x (n + l),
+ *               column first order) and the n_s singular values s (descending) of the m x (n + l)
+ *               augmented matrix. The rank is determined, and lowered, as dtls does. Singular values
+ *               up to s_zero are zero as well.
+ */
+static void
+lapack_tls_x (Ttls_work *w, int n_s, int m, int n, int l, int ldx, double tol1, double tol2, double s_zero,
+              int *_rank, int *iwarn)
+{
+    double *v = w->v, *f = w->f, *y = w->y;
+    double smax, smax2, s_r, s_r1, sum;
+    int    nl, rank, i, j, c, info;
+    char   uplo = 'L';
 
-        TMMSG("fn_tls: before aug_mat fill");
-        aug_n_points = fill_aug_mat (aug_mat, *ptarget, rs, n_rs, sqdst, weight,
-                                     ldc, e, n_pre_val, means, l_center, l_ref_meth);
-        TMMSG("fn_tls: after aug_mat fill");
+    nl = n + l;
 
-        if (aug_n_points == 0)
-        {
-            for (i = 0; i < n_pre_val; i++)
-            {
-                *p_pre_val++ = NAN;
-                *p_status++ = STLS_AUG_N_POINTS_ZERO;
-            }
+    for (j = 0; j < l; j++)
+        for (i = 0; i < n; i++)
+            w->x[j * ldx + i] = 0.0;
 
-            continue;
-        }
+    smax  = tol1 * sqrt (2.0 * (m > nl? m: nl));
+    smax2 = smax * smax;
 
-        /* TLS */
-        TMMSG("fn_tls: before tls");
-        if ((ierr = tls (aug_mat, ldc, aug_n_points, e + 1, n_pre_val, &p1_x, &ldx, &ierr, &iwarn)) != 0)
+    rank = m < n? m: n;
+    while (rank > 0 && (w->s[rank - 1] <= smax || w->s[rank - 1] <= s_zero))
+        rank--;
+
+    for (;;)
+    {
+        /* Lower the rank while the singular value is (almost) multiple.*/
+        for (;;)
         {
-            /* fprintf (stderr, "Error in TLS estimation <%d>.\n", ierr); */
-            for (i = 0; i < n_pre_val; i++)
+            if (rank == 0)
             {
-                *p_pre_val++ = NAN;
-
-                if (ierr >= 1000)
-                    *p_status++ = (ierr - 1000) * 0x2000 | iwarn * 0x0100 | STLS_ERROR;
-                else
-                    *p_status++ = ierr * 0x2000 | iwarn * 0x0100 | STLS_ERROR;
+                *_rank = 0;
+                return;
             }
-
-            continue;
+            s_r  = w->s[rank - 1];
+            s_r1 = (rank < n_s)? w->s[rank]: 0.0;
+            if (s_r * s_r - s_r1 * s_r1 > smax2)
+                break;
+            rank--;
+            *iwarn = 1;
         }
-        TMMSG("fn_tls: after tls");
 
-        if (l_warn_is_error && iwarn > 0)
-        {
-            for (i = 0; i < n_pre_val; i++)
+        /* x = -V12 V22' (V22 V22')^-1, with V12 (n x nl - rank) and V22 (l x nl - rank) the
+         * rows of the last singular vectors. F F' = V22 V22', with F upper triangular as in dtls,
+         * is computed as the Cholesky factor of the matrix with reversed rows and columns.
+         */
+        for (i = 0; i < l; i++)
+            for (j = 0; j <= i; j++)
             {
-                *p_pre_val++ = NAN;
-                *p_status++ = iwarn * 0x0100 | STLS_WARN_IS_ERROR;
+                sum = 0.0;
+                for (c = rank; c < nl; c++)
+                    sum += v[c * nl + n + l - 1 - i] * v[c * nl + n + l - 1 - j];
+                f[j * l + i] = sum;
             }
 
-            continue;
-        }
+        dpotrf_ (&uplo, &l, f, &l, &info);
+        if (info == 0 && fabs (f[l * l - 1]) > tol2)
+            break;
+
+        rank--;
+        *iwarn = 2;
+    }
 
-        if (iwarn > 0)
+    /* y = V22 V12', with reversed rows */
+    for (i = 0; i < l; i++)
+        for (j = 0; j < n; j++)
         {
-            n_warn++;
-            for (j = 0; j < n_pre_val; j++)
-                *(p_status + j) = iwarn * 0x0100 | STLS_WARNING;
+            sum = 0.0;
+            for (c = rank; c < nl; c++)
+                sum += v[c * nl + n + l - 1 - i] * v[c * nl + j];
+            y[j * l + i] = sum;
         }
 
-        log_var_params (*ptarget, e, n_pre_val, ldx, p1_x, l_center, means);
+    dpotrs_ (&uplo, &l, &n, f, &l, y, &l, &info);
 
-        TMMSG("fn_tls: before center");
-        if (l_center)
-        {
-            for (i = 0; i < n_pre_val; i++)
-            {
-                *p_pre_val = means[e + i] + p1_x[0];
-                for (j = 0; j < e; j++)
-                    *p_pre_val += ((*ptarget)->co_val[j] - means[j]) * p1_x[j+1];
-                if (l_restrict_prediction > 0.0 &&
-                        (*p_pre_val > l_restrict_prediction || *p_pre_val < -l_restrict_prediction))
-                {
-                    *p_pre_val = NAN;
-                    *p_status |= STLS_VAL_GT_RESTRICT;
-                }
-                p_status++;
-                p_pre_val++;
-                p1_x += ldx;
-            }
-        }
-        else
-        {
-            for (i = 0; i < n_pre_val; i++)
-            {
-                *p_pre_val = p1_x[0];
-                for (j = 0; j < e; j++)
-                    *p_pre_val += (*ptarget)->co_val[j] * p1_x[j+1];
-                if (l_restrict_prediction > 0.0 &&
-                        (*p_pre_val > l_restrict_prediction || *p_pre_val < l_restrict_prediction))
-                {
-                    *p_pre_val = NAN;
-                    *p_status |= STLS_VAL_GT_RESTRICT;
-                }
-                p_status++;
-                p_pre_val++;
-                p1_x += ldx;
-            }
-        }
-        TMMSG("fn_tls: after center");
-    }
+    for (j = 0; j < l; j++)
+        for (i = 0; i < n; i++)
+            w->x[j * ldx + i] = -y[i * l + l - 1 - j];
 
-    TMMSG("fn_tls: after main loop");
+    *_rank = rank;
+}
 
-    if (n_warn > 0)
-        fprintf (stderr, "Warning: %d warnings in tls procedure.\n", n_warn);
+/* lapack_tls_svd: TLS with the singular value decomposition of LAPACK dgesvd.
+ *                 The same arguments as dtls, which is the reference.
+ */
+static void
+lapack_tls_svd (Ttls_work *w, double *aug_mat, int ldc, int m, int n, int l, int ldx,
+                int *rank, double *tol1, double *tol2, int *ierr, int *iwarn)
+{
+    int  nl, i, j, info;
+    char jobu = 'N', jobvt = 'A';
 
-    log_predicted (pre_set->point, pre_set->n_point, pre_set->n_pre_val, l_pre_val, l_status);
+    nl     = n + l;
+    *tol1  = *tol1 > DTLS_NUMEPS? *tol1: DTLS_NUMEPS;
+    *tol2  = *tol2 > DTLS_NUMEPS? *tol2: DTLS_NUMEPS;
+    *ierr  = 0;
+    *iwarn = 0;
 
-    if (l_nnn > 0)
+    dgesvd_ (&jobu, &jobvt, &m, &nl, aug_mat, &ldc, w->s, NULL, &nl, w->vt, &nl, w->lwrk, &w->n_lwrk, &info);
+    if (info != 0)
     {
-        if (rs)
-            free (rs);
-        /* When doing imputations, we reuse the same tree several times.
-         * The kdt-tree is now deallocated in the next_set method.
-         */
-        if (sqdst)
-            free (sqdst);
+        *ierr = 1000 + (info > 0? info: -info);
+        return;
     }
 
-    if (aug_mat)
-        free (aug_mat);
-    if (weight)
-        free (weight);
-    if (means)
-        free (means);
+    for (j = 0; j < nl; j++)
+        for (i = 0; i < nl; i++)
+            w->v[j * nl + i] = w->vt[i * nl + j];
 
-    fflush (g_log_file);
+    lapack_tls_x (w, m < nl? m: nl, m, n, l, ldx, *tol1, *tol2, 0.0, rank, iwarn);
+}
 
-    *predicted = l_pre_val;
+/* lapack_tls_gram: TLS with the eigen decomposition (LAPACK dsyev) of the gram matrix C'C of the
+ *                  augmented matrix C. This squares the condition number: the eigenvalues have an error
+ *                  of about DTLS_NUMEPS times the largest, so singular values up to sqrt (DTLS_NUMEPS)
+ *                  times the largest are zero, and the singular vectors that give x are only accurate
+ *                  when the gap of the eigenvalues at the rank is at least TLS_GRAM_GAP times the largest.
+ *                  With a smaller gap, aug_mat is solved by lapack_tls_svd instead.
+ *                  The same arguments as dtls, which is the reference. When aug_mat is NULL, the gram
+ *                  matrix of the m points is already in w->vt (accumulate_gram), and a small gap gives
+ *                  ierr TLS_IERR_GRAM_ILL.
+ */
+static void
+lapack_tls_gram (Ttls_work *w, double *aug_mat, int ldc, int m, int n, int l, int ldx,
+                 int *rank, double *tol1, double *tol2, int *ierr, int *iwarn)
+{
+    double alpha = 1.0, beta = 0.0, *g = w->vt, *ev = w->wrk;
+    int    nl, r, i, j, info;
+    char   uplo = 'L', trans = 'T', jobz = 'V';
+
+    nl     = n + l;
+    *tol1  = *tol1 > DTLS_NUMEPS? *tol1: DTLS_NUMEPS;
+    *tol2  = *tol2 > DTLS_NUMEPS? *tol2: DTLS_NUMEPS;
+    *ierr  = 0;
+    *iwarn = 0;
+
+    if (aug_mat)
+        dsyrk_ (&uplo, &trans, &nl, &m, &alpha, aug_mat, &ldc, &beta, g, &nl);
+
+    dsyev_ (&jobz, &uplo, &nl, g, &nl, ev, w->lwrk, &w->n_lwrk, &info);
+    if (info != 0)
+    {
+        *ierr = 1000 + (info > 0? info: -info);
+        return;
+    }
+
+    /* Eigenvalues are ascending, singular values descending.*/
+    r = m < n? m: n;
+    if (r > 0 && ev[nl - r] - ev[nl - 1 - r] <= TLS_GRAM_GAP * ev[nl - 1])
+    {
+        if (aug_mat)
+            lapack_tls_svd (w, aug_mat, ldc, m, n, l, ldx, rank, tol1, tol2, ierr, iwarn);
+        else
+        {
+            *ierr       = TLS_IERR_GRAM_ILL;
+            w->gram_ill = true;
+        }
+        return;
+    }
+
+    for (j = 0; j < nl; j++)
+    {
+        w->s[j] = ev[nl - 1 - j] > 0.0? sqrt (ev[nl - 1 - j]): 0.0;
+        for (i = 0; i < nl; i++)
+            w->v[j * nl + i] = g[(nl - 1 - j) * nl + i];
+    }
+
+    lapack_tls_x (w, nl, m, n, l, ldx, *tol1, *tol2, sqrt (DTLS_NUMEPS) * w->s[0], rank, iwarn);
+}
+
+/* check_tls: Solve the copy of the augmented matrix in w->aug_check with both lapack solvers as well,
+ *            and keep the largest relative differences with the dtls solution x (n x l).
+ */
+static void
+check_tls (Ttls_work *w, int ldc, int m, int n, int l, int ldx, int dtls_ierr)
+{
+    double tol1 = 0.0000000000000001, tol2 = 0.00001, d, *x, *aug_mat;
+    int    rank, ierr, iwarn, i, k;
+
+    if (dtls_ierr != 0)
+        return;
+
+    x       = w->x;
+    w->x    = w->x_check;
+    aug_mat = w->aug_check + (n + l) * ldc;  /*the solvers overwrite their matrix*/
+
+    for (k = 0; k < 2; k++)
+    {
+        memcpy (aug_mat, w->aug_check, (n + l) * ldc * sizeof (double));
+
+        if (k == 0)
+            lapack_tls_svd (w, aug_mat, ldc, m, n, l, ldx, &rank, &tol1, &tol2, &ierr, &iwarn);
+        else
+            lapack_tls_gram (w, aug_mat, ldc, m, n, l, ldx, &rank, &tol1, &tol2, &ierr, &iwarn);
+
+        for (i = 0; i < ldx * l; i++)
+        {
+            d = (ierr != 0)? INFINITY: fabs (w->x[i] - x[i]) / (1.0 + fabs (x[i]));
+            if (d > w->check_diff[k])
+                w->check_diff[k] = d;
+        }
+    }
+
+    w->x = x;
+}
+
+/* tls: The workspace of w is sized for n_a, n_b and n_points in new_tls_work.*/
+int
+tls (Ttls_work *w, double *aug_mat, int ldc, int n_points, int n_a, int n_b, double **_x, int *_ldx, int *err, int *warn)
+{
+    int rank =  -1, ierr, iwarn;
+    double tol1 = 0.0000000000000001, tol2 = 0.00001;
+    char comprt = 'X'; /*compute both rank and tol1*/
+
+    *_ldx  = n_a;
+
+    if (g_context->fn_tls.solver == KTLS_SOLVER_SVD || w->gram_ill)
+        lapack_tls_svd (w, aug_mat, ldc, n_points, n_a, n_b, *_ldx, &rank, &tol1, &tol2, &ierr, &iwarn);
+    else if (g_context->fn_tls.solver == KTLS_SOLVER_GRAM)
+        lapack_tls_gram (w, aug_mat, ldc, n_points, n_a, n_b, *_ldx, &rank, &tol1, &tol2, &ierr, &iwarn);
+    else
+    {
+        if (g_context->fn_tls.solver == KTLS_SOLVER_CHECK)
+            memcpy (w->aug_check, aug_mat, (n_a + n_b) * ldc * sizeof (double));
+
+        dtls_ (aug_mat, &ldc, &n_points, &n_a, &n_b, w->s, w->x, _ldx, w->wrk, &rank, &tol1, &tol2, &comprt, &ierr, &iwarn);
+
+        if (g_context->fn_tls.solver == KTLS_SOLVER_CHECK)
+            check_tls (w, ldc, n_points, n_a, n_b, *_ldx, ierr);
+    }
+
+/*    if (iwarn > 0)
+ *      fprintf (stderr, "Warning: rank lowered to %d\n", rank);
+ */
+    log_dtls (tol1, tol2, *_ldx, rank, ierr, iwarn, ldc, n_points, n_a, n_b, aug_mat, w->x, w->s);
+
+    *_x   = w->x;
+    *err  = ierr;
+    *warn = iwarn;
+    return ierr;
+}
+
+/* new_tls_work: Allocate the memory needed to predict one target, with at most n_rs library
+ *               points in an augmented matrix with leading dimension ldc.
+ *               lib is the packed library when the whole library is used. With KTLS_SOLVER_GRAM, the gram
+ *               matrix is then accumulated from it, instead of filling the augmented matrix. That is only
+ *               made for a target with an ill-conditioned gram matrix (see fill_lib_aug_mat).
+ */
+static Ttls_work *
+new_tls_work (long n_rs, int ldc, int e, int n_pre_val, int n_theta, const Tpoint_pack *lib,
+              const Texcl_setting *excl)
+{
+    Ttls_work *w;
+    int       aug_n_col, n_a, n_b;
+
+    aug_n_col = e + 1 + n_pre_val;
+    n_a       = e + 1;
+    n_b       = n_pre_val;
+
+    w = (Ttls_work *) calloc (1, sizeof (Ttls_work));
+
+    /* means contains the mean value per axis, over all vectors from the result set.
+     * It is filled in fill_aug_matrix.
+     */
+    if (g_context->fn_tls.center)
+        w->means = (double *) malloc ((e + n_pre_val) * sizeof(double));
+
+    w->lib      = lib;
+    w->excl     = excl;
+    w->gram_lib = lib && g_context->fn_tls.solver == KTLS_SOLVER_GRAM;
+    w->ldc      = ldc;
+    w->n_theta  = n_theta;
+    if (w->gram_lib)
+    {
+        w->excl_win_only = exclude_get_win (excl, w->excl_win);
+        w->lib_ix    = (long *) malloc (n_rs * sizeof (long));
+        w->blk       = (double *) malloc (TLS_GRAM_BLOCK * aug_n_col * sizeof(double));
+    }
+    else
+    {
+        w->aug_mat = (double *) malloc (ldc * aug_n_col * sizeof(double));
+        if (n_theta > 1)
+            w->aug_theta = (double *) malloc (ldc * aug_n_col * sizeof(double));
+    }
+    w->dist    = (double *) malloc (n_rs * sizeof (double));
+    w->weight  = (double *) malloc (n_rs * sizeof (double));
+    w->tg_buf  = (double *) malloc (e * sizeof (double));
+    w->rs_buf  = (double *) malloc (e * sizeof (double));
+
+    w->s   = (double *) malloc ((n_a + n_b) * sizeof (double));
+    w->x   = (double *) malloc ((n_a * n_b) * sizeof (double));
+    w->wrk = (double *) malloc ((n_a + n_b + n_rs) * sizeof(double));
+
+    if (g_context->fn_tls.solver != KTLS_SOLVER_DTLS)
+    {
+        double lwrk_svd = 0.0, lwrk_gram = 0.0;
+        int    m, nl, lwork = -1, info;
+        char   jobu = 'N', jobvt = 'A', jobz = 'V', uplo = 'L';
+
+        m  = ldc;
+        nl = n_a + n_b;
+
+        w->v  = (double *) malloc (nl * nl * sizeof (double));
+        w->vt = (double *) malloc (nl * nl * sizeof (double));
+        w->f  = (double *) malloc (n_b * n_b * sizeof (double));
+        w->y  = (double *) malloc (n_b * n_a * sizeof (double));
+
+        /* Workspace queries, for the largest number of points. The gram solver falls back to dgesvd.*/
+        dgesvd_ (&jobu, &jobvt, &m, &nl, w->aug_mat, &ldc, w->s, NULL, &nl, w->vt, &nl, &lwrk_svd, &lwork, &info);
+        if (g_context->fn_tls.solver != KTLS_SOLVER_SVD)
+            dsyev_ (&jobz, &uplo, &nl, w->vt, &nl, w->wrk, &lwrk_gram, &lwork, &info);
+
+        w->n_lwrk = (int) (lwrk_svd > lwrk_gram? lwrk_svd: lwrk_gram);
+        w->lwrk   = (double *) malloc (w->n_lwrk * sizeof (double));
+
+        if (g_context->fn_tls.solver == KTLS_SOLVER_CHECK)
+        {
+            w->aug_check = (double *) malloc (2 * ldc * aug_n_col * sizeof(double));
+            w->x_check   = (double *) malloc ((n_a * n_b) * sizeof (double));
+        }
+    }
+
+    return w;
+}
+
+static void
+free_tls_work (Ttls_work *w)
+{
+    if (!w)
+        return;
+
+    if (w->means)
+        free (w->means);
+    if (w->aug_mat)
+        free (w->aug_mat);
+    if (w->aug_theta)
+        free (w->aug_theta);
+    if (w->dist)
+        free (w->dist);
+    if (w->weight)
+        free (w->weight);
+    if (w->tg_buf)
+        free (w->tg_buf);
+    if (w->rs_buf)
+        free (w->rs_buf);
+    if (w->s)
+        free (w->s);
+    if (w->x)
+        free (w->x);
+    if (w->wrk)
+        free (w->wrk);
+    if (w->v)
+        free (w->v);
+    if (w->vt)
+        free (w->vt);
+    if (w->f)
+        free (w->f);
+    if (w->y)
+        free (w->y);
+    if (w->lwrk)
+        free (w->lwrk);
+    if (w->lib_ix)
+        free (w->lib_ix);
+    if (w->blk)
+        free (w->blk);
+    if (w->aug_check)
+        free (w->aug_check);
+    if (w->x_check)
+        free (w->x_check);
+    if (w->shortest_dist)
+        free (w->shortest_dist);
+
+    free (w);
+}
+
+static void
+free_tls (void)
+{
+    if (l_status)
+        free (l_status);
+
+    l_status = NULL;
+
+    if (l_thetas)
+        free (l_thetas);
+
+    l_thetas  = NULL;
+    l_n_theta = 0;
+}
+
+/* solve_tls: Predict the n_pre_val values of one target from the weighted augmented matrix aug_mat
+ * of aug_n_points points, into p_pre_val, with status values in p_status.
+ * Return: 1 when dtls gave a warning (and the prediction is used), otherwise 0.
+ */
+static int
+solve_tls (Ttls_work *w, double *aug_mat, Tpoint *target, int ldc, int aug_n_points, int e, int n_pre_val,
+           double *p_pre_val, int *p_status)
+{
+    double   *p1_x;
+    double   *means = w->means;
+    int      i, j, ierr, iwarn, ldx;
+
+    /* TLS */
+    TMMSG("fn_tls: before tls");
+    if ((ierr = tls (w, aug_mat, ldc, aug_n_points, e + 1, n_pre_val, &p1_x, &ldx, &ierr, &iwarn)) != 0)
+    {
+        /* fprintf (stderr, "Error in TLS estimation <%d>.\n", ierr); */
+        for (i = 0; i < n_pre_val; i++)
+        {
+            *p_pre_val++ = NAN;
+
+            if (ierr >= 1000)
+                *p_status++ = (ierr - 1000) * 0x2000 | iwarn * 0x0100 | STLS_ERROR;
+            else
+                *p_status++ = ierr * 0x2000 | iwarn * 0x0100 | STLS_ERROR;
+        }
+
+        return 0;
+    }
+    TMMSG("fn_tls: after tls");
+
+    if (g_context->fn_tls.warn_is_error && iwarn > 0)
+    {
+        for (i = 0; i < n_pre_val; i++)
+        {
+            *p_pre_val++ = NAN;
+            *p_status++ = iwarn * 0x0100 | STLS_WARN_IS_ERROR;
+        }
+
+        return 0;
+    }
+
+    if (iwarn > 0)
+    {
+        for (j = 0; j < n_pre_val; j++)
+            *(p_status + j) = iwarn * 0x0100 | STLS_WARNING;
+    }
+
+    log_var_params (target, e, n_pre_val, ldx, p1_x, g_context->fn_tls.center, means);
+
+    TMMSG("fn_tls: before center");
+    if (g_context->fn_tls.center)
+    {
+        for (i = 0; i < n_pre_val; i++)
+        {
+            *p_pre_val = means[e + i] + p1_x[0];
+            for (j = 0; j < e; j++)
+                *p_pre_val += (w->tg_co_val[j] - means[j]) * p1_x[j+1];
+            if (g_context->fn_tls.restrict_prediction > 0.0 &&
+                    (*p_pre_val > g_context->fn_tls.restrict_prediction || *p_pre_val < -g_context->fn_tls.restrict_prediction))
+            {
+                *p_pre_val = NAN;
+                *p_status |= STLS_VAL_GT_RESTRICT;
+            }
+            p_status++;
+            p_pre_val++;
+            p1_x += ldx;
+        }
+    }
+    else
+    {
+        for (i = 0; i < n_pre_val; i++)
+        {
+            *p_pre_val = p1_x[0];
+            for (j = 0; j < e; j++)
+                *p_pre_val += w->tg_co_val[j] * p1_x[j+1];
+            if (g_context->fn_tls.restrict_prediction > 0.0 &&
+                    (*p_pre_val > g_context->fn_tls.restrict_prediction || *p_pre_val < g_context->fn_tls.restrict_prediction))
+            {
+                *p_pre_val = NAN;
+                *p_status |= STLS_VAL_GT_RESTRICT;
+            }
+            p_status++;
+            p_pre_val++;
+            p1_x += ldx;
+        }
+    }
+    TMMSG("fn_tls: after center");
+
+    return (iwarn > 0)? 1: 0;
+}
+
+/* predict_tls: Predict the n_pre_val values of one target from the n_rs points in rs, for the n_theta
+ * values in theta, into p_pre_val, with status values in p_status. The values for theta[t] start
+ * at t * theta_stride. sqdst holds the square distances of the neighbours, NULL when rs is the whole
+ * library.
+ * Return: the number of thetas for which dtls gave a warning (and the prediction is used).
+ */
+static int
+predict_tls (Ttls_work *w, Tpoint *target, Tpoint **rs, double *sqdst, long n_rs, int e, int n_pre_val,
+             int n_theta, const double *theta, long theta_stride, double *p_pre_val, int *p_status)
+{
+    double   *aug_mat, ref_dst;
+    int      aug_n_col, aug_n_points, ldc, i, t, n_warn = 0;
+
+    aug_n_col = e + 1 + n_pre_val;
+
+    /* When kdt_nn returns a different number of neighbors than expected, we may have to
+     * adjust some parameters for the augmented matrix.
+     * The augmented matrix has already been allocated to its maximum needed size,
+     * so no reallocation necessary.
+     */
+    ldc = aug_n_col > n_rs? aug_n_col: n_rs;  /*leading dimension of aug_mat (column-first order)*/
+
+    if (sqdst)
+        log_nn (target, rs, sqdst, n_rs /*g_context->fn_tls.nnn*/);
+
+    w->tg_co_val = point_co_val (target, w->tg_buf);
+    w->gram_ill  = false;
+
+    TMMSG("fn_tls: before aug_mat fill");
+    if (w->gram_lib)
+        aug_n_points = scan_library (w, target, rs, n_rs, e, n_pre_val, &ref_dst);
+    else
+        aug_n_points = fill_aug_mat (w, w->aug_mat, target, rs, n_rs, sqdst, w->dist,
+                                     ldc, e, n_pre_val, w->means, g_context->fn_tls.center, g_context->fn_tls.ref_meth, &ref_dst);
+    TMMSG("fn_tls: after aug_mat fill");
+
+    for (t = 0; t < n_theta; t++, p_pre_val += theta_stride, p_status += theta_stride)
+    {
+        if (aug_n_points == 0)
+        {
+            for (i = 0; i < n_pre_val; i++)
+            {
+                p_pre_val[i] = NAN;
+                p_status[i]  = STLS_AUG_N_POINTS_ZERO;
+            }
+
+            continue;
+        }
+
+        if (w->gram_lib && !w->gram_ill)
+        {
+            accumulate_gram (w, aug_n_points, e, n_pre_val, theta[t], ref_dst);
+            n_warn += solve_tls (w, NULL, target, ldc, aug_n_points, e, n_pre_val, p_pre_val, p_status);
+            if (!w->gram_ill)
+                continue;
+
+            /* The gram matrix is ill-conditioned: the augmented matrix after all, for the other thetas as well.*/
+            if (fill_lib_aug_mat (w, aug_n_points, e, n_pre_val) < 0)
+            {
+                w->gram_ill = false;
+                continue;
+            }
+            for (i = 0; i < n_pre_val; i++)
+                p_status[i] = STLS_OK;
+        }
+
+        /* dtls overwrites its matrix, so while there are more thetas to go, it gets a weighted copy.*/
+        aug_mat = (t < n_theta - 1)? w->aug_theta: w->aug_mat;
+        weight_aug_mat (w->aug_mat, aug_mat, w->dist, w->weight, aug_n_points, ldc, aug_n_col, theta[t], ref_dst);
+
+        n_warn += solve_tls (w, aug_mat, target, ldc, aug_n_points, e, n_pre_val, p_pre_val, p_status);
+    }
+
+    return n_warn;
+}
+
+/* new_tls_sweep_set: The next set of the sweep, with memory for its predictions for the other thetas.
+ * Returns: NULL when there is no memory, or when it would make the kept predictions larger than
+ *          TLS_SWEEP_MAX. The set is then predicted per theta.
+ */
+static Ttls_sweep_set *
+new_tls_sweep_set (Tpoint_set *lib_set, Tpoint_set *pre_set)
+{
+    Ttls_sweep_set *sw;
+    long           n_val, size;
+
+    if (l_i_sweep != l_n_sweep)
+        return NULL;
+
+    sw = (Ttls_sweep_set *) realloc (l_sweep, (l_n_sweep + 1) * sizeof (Ttls_sweep_set));
+    if (!sw)
+        return NULL;
+    l_sweep = sw;
+    sw = l_sweep + l_n_sweep++;
+    sw->pre_val = NULL;
+    sw->status  = NULL;
+
+    n_val = pre_set->n_point * pre_set->n_pre_val;
+    size  = (l_n_theta - 1) * n_val * (long) (sizeof (double) + sizeof (int));
+    if (l_sweep_size + size > TLS_SWEEP_MAX)
+        return NULL;
+
+    sw->pre_val = (double *) malloc ((l_n_theta - 1) * n_val * sizeof (double));
+    sw->status  = (int *) malloc ((l_n_theta - 1) * n_val * sizeof (int));
+    if (!sw->pre_val || !sw->status)
+    {
+        if (sw->pre_val)
+            free (sw->pre_val);
+        if (sw->status)
+            free (sw->status);
+        sw->pre_val = NULL;
+        sw->status  = NULL;
+        return NULL;
+    }
+
+    sw->fp      = fn_set_fingerprint (lib_set, pre_set);
+    sw->n_point = pre_set->n_point;
+    sw->n_val   = n_val;
+    l_sweep_size += size;
+
+    return sw;
+}
+
+static void
+free_tls_sweep_set (Ttls_sweep_set *sw)
+{
+    if (!sw->pre_val)
+        return;
+
+    free (sw->pre_val);
+    free (sw->status);
+    sw->pre_val = NULL;
+    sw->status  = NULL;
+    l_sweep_size -= (l_n_theta - 1) * sw->n_val * (long) (sizeof (double) + sizeof (int));
+}
+
+static void
+free_tls_sweep (void)
+{
+    long i;
+
+    for (i = 0; i < l_n_sweep; i++)
+        free_tls_sweep_set (l_sweep + i);
+
+    if (l_sweep)
+        free (l_sweep);
+
+    l_sweep      = NULL;
+    l_n_sweep    = 0;
+    l_i_sweep    = -1;
+    l_sweep_size = 0;
+}
+
+/* n_tls_warn: The number of targets for which dtls gave a warning and the prediction is used.*/
+static int
+n_tls_warn (const int *status, long n_point, int n_pre_val)
+{
+    long i;
+    int  n_warn = 0;
+
+    for (i = 0; i < n_point; i++)
+        if (status[i * n_pre_val] & STLS_WARNING)
+            n_warn++;
+
+    return n_warn;
+}
+
+/* fn_tls_swept: Hand out the predictions of a set for the current theta, made with the first theta.*/
+static int
+fn_tls_swept (Ttls_sweep_set *sw, Tpoint_set *pre_set, double **predicted)
+{
+    int n_warn;
+
+    if (l_pre_val)
+        free (l_pre_val);
+    l_pre_val = (double *) malloc (sw->n_val * sizeof(double));
+
+    if (l_status)
+        free (l_status);
+    l_status = (int *) malloc (sw->n_val * sizeof(int));
+
+    memcpy (l_pre_val, sw->pre_val + (l_i_theta - 1) * sw->n_val, sw->n_val * sizeof(double));
+    memcpy (l_status, sw->status + (l_i_theta - 1) * sw->n_val, sw->n_val * sizeof(int));
+
+    /* The last theta: this set is done.*/
+    if (l_i_theta == l_n_theta - 1)
+        free_tls_sweep_set (sw);
+
+    if ((n_warn = n_tls_warn (l_status, pre_set->n_point, pre_set->n_pre_val)) > 0)
+        fprintf (stderr, "Warning: %d warnings in tls procedure.\n", n_warn);
+
+    log_predicted (pre_set->point, pre_set->n_point, pre_set->n_pre_val, l_pre_val, l_status);
+
+    fflush (g_log_file);
+
+    *predicted = l_pre_val;
+
+    return 0;
+}
+
+int
+fn_tls (Tpoint_set *lib_set, Tpoint_set *pre_set, double **predicted)
+{
+    Ttls_sweep_set *sw = NULL;
+    int      aug_n_col, ldc, e, n_pre_val, n_warn, n_thread, n_theta, res = 0;
+    double   check_svd = 0.0, check_gram = 0.0;  /*KTLS_SOLVER_CHECK*/
+    Tpoint_pack *lib = NULL;
+    long     n_rs, n_val, i_first, n_batch;
+    Tpoint   **rs = NULL;      /*result sets of a batch of targets*/
+    double   *sqdst = NULL;
+    int      *n_found = NULL;
+    double   *thetas, *pre_val;
+    int      *status;
+    const Texcl_setting *excl;
+    bool     per_target_log;
+
+    e         = pre_set->e;
+    n_pre_val = pre_set->n_pre_val;
+    n_val     = pre_set->n_point * n_pre_val;
+    n_warn = 0;
+
+    TMMSG("fn_tls: start");
+
+    /* Per target logging has to be written in target order, and per theta.*/
+    per_target_log = g_log_file && (g_log_level & (LOG_NEAR_NEIGH | LOG_VAR_PAR | LOG_DTLS_STATUS | LOG_DTLS_ARRAYS));
+    n_thread       = per_target_log? 1: get_fn_n_thread ();
+
+    l_i_sweep++;
+    if (l_i_theta > 0 && l_i_sweep < l_n_sweep && l_sweep[l_i_sweep].pre_val)
+    {
+        sw = l_sweep + l_i_sweep;
+        if (sw->n_point == pre_set->n_point && sw->fp == fn_set_fingerprint (lib_set, pre_set))
+            return fn_tls_swept (sw, pre_set, predicted);
+
+        /* The set functions gave a different set this time.*/
+        free_tls_sweep_set (sw);
+        sw = NULL;
+    }
+
+    /* With the first theta, predict for all thetas at once.*/
+    if (l_i_theta == 0 && l_n_theta > 1 && !per_target_log)
+        sw = new_tls_sweep_set (lib_set, pre_set);
+    n_theta = sw? l_n_theta: 1;
+
+    /* Matrix to hold predicted values, per theta */
+    if (l_pre_val)
+        free (l_pre_val);
+    l_pre_val = (double *) malloc (n_theta * n_val * sizeof(double));
+
+    /* Array to hold status values, per theta */
+    if (l_status)
+        free (l_status);
+    l_status = (int *) calloc (n_theta * n_val,  sizeof(int));
+
+    /* The theta, prediction and exclusion variables are per thread (see traverse_all): the fn threads
+     * share these.
+     */
+    thetas  = l_thetas + l_i_theta;
+    pre_val = l_pre_val;
+    status  = l_status;
+    excl    = exclude_setting ();
+
+    aug_n_col = e + 1 + n_pre_val;
+
+    if (g_context->fn_tls.nnn > 0)
+        n_rs = g_context->fn_tls.nnn;
+    else
+        n_rs = lib_set->n_point;
+
+    ldc = aug_n_col > n_rs? aug_n_col: n_rs;  /*leading dimension of aug_mat (column-first order)*/
+
+    /* With the whole library, every target reads all of it: from the packed copy, made once per set.
+     * The gram solver does not even need the augmented matrix, only its gram matrix.
+     */
+    if (g_context->fn_tls.nnn == 0 && (lib = point_set_pack (lib_set)) == NULL)
+        res = -1;
+
+    /* The neighbours of a batch of targets are searched at once, into g_context->fn_tls.nnn columns per target.
+     * Every thread has its own augmented matrix and dtls workspace, and writes into its own part
+     * of pre_val and status. The cost per target varies with the number of neighbours found,
+     * so targets are handed out dynamically.
+     */
+    n_batch = pre_set->n_point < FN_NN_BATCH? pre_set->n_point: FN_NN_BATCH;
+    if (g_context->fn_tls.nnn > 0)
+    {
+        /* The neighbours do not depend on theta: keep them for the next theta, unless the set is
+         * already predicted for it.
+         */
+        if (fn_nn_begin (lib_set, pre_set, g_context->fn_tls.nnn, g_context->fn_tls.object_only_once, !sw && l_i_theta + 1 < l_n_theta) < 0)
+            res = -1;
+        rs      = (Tpoint **) malloc (n_batch * g_context->fn_tls.nnn * sizeof(Tpoint *));
+        sqdst   = (double *) malloc (n_batch * g_context->fn_tls.nnn * sizeof(double));
+        n_found = (int *) malloc (n_batch * sizeof(int));
+    }
+
+    TMMSG("fn_tls: before main loop");
+    for (i_first = 0; i_first < pre_set->n_point && res == 0; i_first += n_batch)
+    {
+        if (n_batch > pre_set->n_point - i_first)
+            n_batch = pre_set->n_point - i_first;
+
+        if (g_context->fn_tls.nnn > 0)
+        {
+            TMMSG("fn_tls: before nnn find");
+            if (fn_nn_batch (lib_set, pre_set, i_first, n_batch, g_context->fn_tls.nnn, g_context->fn_tls.object_only_once,
+                             rs, sqdst, n_found, n_thread) < 0)
+            {
+                res = -1;
+                break;
+            }
+            TMMSG("fn_tls: after nnn find");
+        }
+
+#pragma omp parallel num_threads(n_thread) if(n_thread > 1) copyin(g_context) \
+                     reduction(+:n_warn) reduction(max:check_svd, check_gram)
+        {
+            Ttls_work *w;
+            long      i, i_target;
+
+            w = new_tls_work (n_rs, ldc, e, n_pre_val, n_theta, lib, excl);
+
+#pragma omp for schedule(dynamic, 16)
+            for (i = 0; i < n_batch; i++)
+            {
+                i_target = i_first + i;
+
+                /* The KDT algorithm (unfortunately) puts the smallest distance and corresponding point
+                 * at the end of a row. Unfilled positions occur at the start of the row.
+                 */
+                if (g_context->fn_tls.nnn > 0)
+                    n_warn += predict_tls (w, pre_set->point[i_target],
+                                           rs + (i + 1) * g_context->fn_tls.nnn - n_found[i], sqdst + (i + 1) * g_context->fn_tls.nnn - n_found[i],
+                                           n_found[i], e, n_pre_val, n_theta, thetas, n_val,
+                                           pre_val + i_target * n_pre_val, status + i_target * n_pre_val);
+                else
+                    n_warn += predict_tls (w, pre_set->point[i_target], lib_set->point, NULL, lib_set->n_point,
+                                           e, n_pre_val, n_theta, thetas, n_val,
+                                           pre_val + i_target * n_pre_val, status + i_target * n_pre_val);
+            }
+
+            if (w->check_diff[0] > check_svd)
+                check_svd = w->check_diff[0];
+            if (w->check_diff[1] > check_gram)
+                check_gram = w->check_diff[1];
+
+            free_tls_work (w);
+        }
+    }
+    TMMSG("fn_tls: after main loop");
+
+    if (g_context->fn_tls.solver == KTLS_SOLVER_CHECK && res == 0)
+    {
+        l_check_diff[0] = check_svd;
+        l_check_diff[1] = check_gram;
+        log_tls_check (check_svd, check_gram);
+    }
+
+    if (rs)
+        free (rs);
+    if (sqdst)
+        free (sqdst);
+    if (n_found)
+        free (n_found);
+
+    if (sw)
+    {
+        /* Keep the predictions for the other thetas.*/
+        if (res == 0)
+        {
+            memcpy (sw->pre_val, l_pre_val + n_val, (n_theta - 1) * n_val * sizeof(double));
+            memcpy (sw->status, l_status + n_val, (n_theta - 1) * n_val * sizeof(int));
+            n_warn = n_tls_warn (l_status, pre_set->n_point, n_pre_val);
+        }
+        else
+            free_tls_sweep_set (sw);
+    }
+
+    if (res < 0)
+        return res;
+
+    if (n_warn > 0)
+        fprintf (stderr, "Warning: %d warnings in tls procedure.\n", n_warn);
+
+    log_predicted (pre_set->point, pre_set->n_point, pre_set->n_pre_val, l_pre_val, l_status);
+
+    /* When doing imputations, we reuse the same tree several times.
+     * The kdt-tree is now deallocated in the next_set method.
+     */
+
+    fflush (g_log_file);
+
+    *predicted = l_pre_val;
 
     TMMSG("fn_tls: end");
 
@@ -778,12 +1663,12 @@ log_fn_params_tls (void)
     if (!(g_log_level & LOG_FN_PAR))
         return 2;
 
-    log_kptls.nnn = l_nnn;
-    log_kptls.excl = (int) l_excl;
-    log_kptls.var_win = l_var_win;
+    log_kptls.nnn = g_context->fn_tls.nnn;
+    log_kptls.excl = (int) g_context->fn_tls.excl;
+    log_kptls.var_win = g_context->fn_tls.var_win;
     log_kptls.theta = l_theta;
-    log_kptls.center = l_center? 1: 0;
-    log_kptls.object_only_once = l_object_only_once;
+    log_kptls.center = g_context->fn_tls.center? 1: 0;
+    log_kptls.object_only_once = g_context->fn_tls.object_only_once;
 
     LOGREC(LOG_KPTLS, &log_kptls, sizeof (log_kptls), &meta_log_kptls);
 
@@ -842,6 +1727,45 @@ log_var_params (Tpoint *target, int e, int n_pre_val, int ldx, double *var_par,
     return 0;
 }
 
+/* get_tls_check_diff: With KTLS_SOLVER_CHECK, the largest relative differences with dtls of the solutions
+ *                     of the svd and the gram solvers, in the last call of fn_tls in the calling thread
+ *                     that solved the tls problems.
+ * Returns: -1 when there was no such call, otherwise 0.
+ */
+int
+get_tls_check_diff (double *svd_diff, double *gram_diff)
+{
+    if (l_check_diff[0] < 0.0)
+        return -1;
+
+    *svd_diff  = l_check_diff[0];
+    *gram_diff = l_check_diff[1];
+
+    return 0;
+}
+
+int
+log_tls_check (double svd_diff, double gram_diff)
+{
+    static struct s_log_tlschk log_tlschk;
+#ifdef LOG_HUMAN
+    ATTACH_META_TLSCHK(meta_log_tlschk, log_tlschk);
+#endif
+
+    if (!g_log_file)
+        return 1;
+
+    if (!(g_log_level & LOG_DTLS_STATUS))
+        return 2;
+
+    log_tlschk.svd_diff  = svd_diff;
+    log_tlschk.gram_diff = gram_diff;
+
+    LOGREC(LOG_TLSCHK, &log_tlschk, sizeof (log_tlschk), &meta_log_tlschk);
+
+    return 0;
+}
+
 int
 log_dtls (double tol1, double tol2, int ldx, int rank, int ierr,
           int iwarn, int ldc, int m, int n, int l,
@@ -880,23 +1804,27 @@ log_dtls (double tol1, double tol2, int ldx, int rank, int ierr,
     if ( !(g_log_level & LOG_DTLS_ARRAYS) )
         return 0;
 
-    log_dtlsan.name = 'C';
-    log_dtlsan.nrow = ldc;
-    log_dtlsan.ncol = n + l;
+    /* There is no augmented matrix when its gram matrix was accumulated.*/
+    if (c)
+    {
+      log_dtlsan.name = 'C';
+      log_dtlsan.nrow = ldc;
+      log_dtlsan.ncol = n + l;
 
-    LOGREC(LOG_DTLSAN, &log_dtlsan, sizeof (log_dtlsan), &meta_log_dtlsan);
+      LOGREC(LOG_DTLSAN, &log_dtlsan, sizeof (log_dtlsan), &meta_log_dtlsan);
 
-    prow = c;
-    for (log_dtlsav.row = 0; log_dtlsav.row < log_dtlsan.nrow; log_dtlsav.row++)
-    {
-      pval = prow;
-      for (log_dtlsav.col = 0; log_dtlsav.col < log_dtlsan.ncol; log_dtlsav.col++)
+      prow = c;
+      for (log_dtlsav.row = 0; log_dtlsav.row < log_dtlsan.nrow; log_dtlsav.row++)
       {
-        log_dtlsav.val = *pval;
-        pval += ldc;
-        LOGREC(LOG_DTLSAV, &log_dtlsav, sizeof (log_dtlsav), &meta_log_dtlsav);
+        pval = prow;
+        for (log_dtlsav.col = 0; log_dtlsav.col < log_dtlsan.ncol; log_dtlsav.col++)
+        {
+          log_dtlsav.val = *pval;
+          pval += ldc;
+          LOGREC(LOG_DTLSAV, &log_dtlsav, sizeof (log_dtlsav), &meta_log_dtlsav);
+        }
+        prow++;
       }
-      prow++;
     }
 
     log_dtlsan.name = 'S';
@@ -11,38 +11,244 @@
 #include <float.h>
 #include <stdbool.h>
 #include <math.h>
-/*#include "heap.h" replaced by qsort*/
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "kdt.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KDT_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define KDT_BLOCK 16           /*number of distances computed per call of the distance kernel*/
+#define KDT_TASK_CUTOFF 20000  /*subtrees with fewer points are built by one thread*/
+#define KDT_MORTON_MIN_TARGET 256  /*batches with fewer targets are not sorted*/
+#define KDT_MORTON_MAX_DIM 21      /*dimensions used for the Morton code, 3 bits each at least*/
+
+static Tkdt_opt l_default_opt = {KDT_DEFAULT_BUCKET_SIZE, true, 1, 0, NULL};
+
+/* Tbuild: Input of a tree build. The valid points are numbered 0..n-1; the build partitions an
+ * array of these numbers.
+ */
 typedef struct
 {
-    void    *obj;
-    double  *vec;
-    double  val;
-    long    id;
-} Tsorted;
+    Tkdt    *tree;
+    double  *co;     /*coordinates of the points, k per point*/
+    void    **obj;   /*objects of the points*/
+    int32_t *mult;   /*multiplicities of the points*/
+} Tbuild;
+
+int nnf (Tkdt_search *, int32_t);
+static long kdt_n_node (long, int);
+static int nn_batch (const Tkdt_search *, void **, long, const Tkdt *const *, int, int, int, void **, double *, int *,
+                     double * (*)(void *), bool (*)(void *, void *), bool, int);
+static void kdbranch (Tbuild *, int32_t *, long, int, int32_t, long);
+
+/* kdt_size: Size in bytes of a tree with memory for n_alloc nodes of dimension k, with n_key keys.
+ *           The header, nodes, coordinates, objects, keys, key ranges, multiplicities and point flags follow each
+ *           other in this order.
+ */
+static size_t kdt_size (long n_alloc, int k, int n_key)
+{
+    return sizeof (Tkdt) + n_alloc * (sizeof (TkdtNode) + k * sizeof (double) + sizeof (void *) +
+                                      3 * n_key * sizeof (long) + sizeof (int32_t) + sizeof (uint8_t));
+}
+
+static inline void kdt_set_arrays (Tkdt *tree)
+{
+    tree->node   = (TkdtNode *) (tree + 1);
+    tree->vec    = (double *) (tree->node + tree->n_alloc);  /*sizeof (TkdtNode) is a multiple of sizeof (double)*/
+    tree->obj    = (void **) (tree->vec + tree->n_alloc * tree->k);
+    tree->key    = (long *) (tree->obj + tree->n_alloc);
+    tree->key_lo = tree->key + tree->n_alloc * tree->n_key;
+    tree->key_hi = tree->key_lo + tree->n_alloc * tree->n_key;
+    tree->mult   = (int32_t *) (tree->key_hi + tree->n_alloc * tree->n_key);
+    tree->flag   = (uint8_t *) (tree->mult + tree->n_alloc);
+}
+
+/* new_kdt: Allocate an empty tree, with memory for n_alloc nodes.*/
+static Tkdt *new_kdt (long n_alloc, int k, const Tkdt_opt *opt)
+{
+    Tkdt *tree;
+    int  n_key;
+
+    n_key = opt->getkey? opt->n_key: 0;
 
-TkdtNode * kdbranch (Tsorted ***, int, int, long, int);
-int nnf (void *, TkdtNode *, int, int, void *[], double *, double *, double *, bool *,
-         double * (*)(void *), bool (*)(void *, void *), bool);
+    if ((tree = (Tkdt *) malloc (kdt_size (n_alloc, k, n_key))) == NULL)
+        return NULL;
+
+    tree->k           = k;
+    tree->bucket_size = opt->bucket_size;
+    tree->simd        = opt->simd;
+    tree->root        = -1;
+    tree->n_node      = 0;
+    tree->n_point     = 0;
+    tree->n_alloc     = n_alloc;
+    tree->n_key       = n_key;
+    tree->getkey      = opt->getkey;
+    kdt_set_arrays (tree);
+
+    return tree;
+}
 
-#if 0
-double compare (Tsorted *a, Tsorted *b)  /*to pass to heapsort*/
+/* kdt_set_point: Copy object and coordinates into point pt, and make node i_nd a leaf with that point.*/
+static void kdt_set_point (Tkdt *tree, int32_t i_nd, long pt, void *obj, const double *vec, int dm)
 {
-    return ((Tsorted *)a)->val - ((Tsorted *)b)->val;
+    TkdtNode *nd;
+    double   *pv;
+    int      d;
+
+    nd     = tree->node + i_nd;
+    nd->pt = (int32_t) pt;
+    pv     = tree->vec + (long) nd->pt * tree->k;
+    for (d = 0; d < tree->k; d++)
+        pv[d] = vec[d];
+
+    tree->obj[nd->pt]  = obj;
+    tree->mult[nd->pt] = 1;
+    tree->flag[nd->pt] = 0;
+    if (tree->n_key)
+        tree->getkey (obj, tree->key + pt * tree->n_key);
+    nd->l   = nd->r = -1;
+    nd->dm  = dm;
+    nd->cnt = 1;
+    nd->val = pv[dm];
 }
-#endif
 
-int compare_sorted (const void *a, const void *b)  /*to pass to qsort*/
+typedef struct
+{
+    void    *obj;
+    long    pt;
+} Tobj_pt;
+
+int compare_obj_pt (const void *a, const void *b)  /*to pass to qsort*/
 {
-    double x = (*(Tsorted **) a)->val;
-    double y = (*(Tsorted **) b)->val;
+    uintptr_t x = (uintptr_t) ((Tobj_pt *) a)->obj;
+    uintptr_t y = (uintptr_t) ((Tobj_pt *) b)->obj;
 
     if (x > y)
         return 1;
     else if (x < y)
         return -1;
+    else if (((Tobj_pt *) a)->pt > ((Tobj_pt *) b)->pt)
+        return 1;
+    else if (((Tobj_pt *) a)->pt < ((Tobj_pt *) b)->pt)
+        return -1;
+
+    return 0;
+}
+
+/* build_unique: Keep the first point of every object, with the number of points of that object as
+ *               its multiplicity. The order of the points is kept.
+ * Returns: the number of points left, or -1 when out of memory.
+ */
+static long build_unique (Tbuild *b, long n, int k)
+{
+    Tobj_pt *op;
+    long    i, j, m;
+    int     d;
+
+    if ((op = (Tobj_pt *) malloc (n * sizeof (Tobj_pt))) == NULL)
+        return -1;
+
+    for (i = 0; i < n; i++)
+    {
+        op[i].obj = b->obj[i];
+        op[i].pt  = i;
+    }
+
+    qsort (op, n, sizeof (Tobj_pt), compare_obj_pt);
+
+    for (i = 0; i < n; i = j)
+    {
+        for (j = i + 1; j < n && op[j].obj == op[i].obj; j++)
+            b->mult[op[j].pt] = 0;
+        b->mult[op[i].pt] = (int32_t) (j - i);
+    }
+
+    free (op);
+
+    for (i = m = 0; i < n; i++)
+    {
+        if (b->mult[i] == 0)
+            continue;
+        if (m < i)
+        {
+            for (d = 0; d < k; d++)
+                b->co[m * k + d] = b->co[i * k + d];
+            b->obj[m]  = b->obj[i];
+            b->mult[m] = b->mult[i];
+        }
+        m++;
+    }
+
+    return m;
+}
+
+/* kdt_set_key_ranges: Set the key ranges of all nodes. Children come after their parent.*/
+static void kdt_set_key_ranges (Tkdt *tree)
+{
+    const TkdtNode *nd;
+    long           *lo, *hi, *key;
+    int32_t        i_nd, i_ch[2];
+    int            i, j, c, n_key;
+
+    if (!(n_key = tree->n_key))
+        return;
+
+    for (i_nd = (int32_t) tree->n_node - 1; i_nd >= 0; i_nd--)
+    {
+        nd = tree->node + i_nd;
+        lo = tree->key_lo + (long) i_nd * n_key;
+        hi = tree->key_hi + (long) i_nd * n_key;
+
+        for (j = 0; j < nd->cnt; j++)
+        {
+            key = tree->key + (long) (nd->pt + j) * n_key;
+            for (i = 0; i < n_key; i++)
+            {
+                if (j == 0 || key[i] < lo[i])
+                    lo[i] = key[i];
+                if (j == 0 || key[i] > hi[i])
+                    hi[i] = key[i];
+            }
+        }
+
+        i_ch[0] = nd->l;
+        i_ch[1] = nd->r;
+        for (c = 0; c < 2; c++)
+        {
+            if (i_ch[c] < 0)
+                continue;
+            for (i = 0; i < n_key; i++)
+            {
+                if (tree->key_lo[(long) i_ch[c] * n_key + i] < lo[i])
+                    lo[i] = tree->key_lo[(long) i_ch[c] * n_key + i];
+                if (tree->key_hi[(long) i_ch[c] * n_key + i] > hi[i])
+                    hi[i] = tree->key_hi[(long) i_ch[c] * n_key + i];
+            }
+        }
+    }
+}
+
+/* kdt_get_default_opt: Options used by kdtree.*/
+void kdt_get_default_opt (Tkdt_opt *opt)
+{
+    *opt = l_default_opt;
+}
+
+/* kdt_set_default_opt: Set the options used by kdtree.
+ * Returns: -1 when the bucket size or the number of keys is out of range, otherwise 0.
+ */
+int kdt_set_default_opt (const Tkdt_opt *opt)
+{
+    if (opt->bucket_size < 1 || opt->bucket_size > KDT_MAX_BUCKET_SIZE ||
+            opt->n_key < 0 || opt->n_key > KDT_MAX_KEY)
+        return -1;
 
+    l_default_opt = *opt;
     return 0;
 }
 
@@ -51,37 +257,49 @@ int compare_sorted (const void *a, const void *b)  /*to pass to qsort*/
  * n: the size of p.
  * k: the dimension of the vector in the objects.
  * getvec: a function that extracts the k-dimensional vector from the object.
+ * The coordinates are copied into the tree, so getvec is not needed anymore during a search.
+ * Returns: the tree, or NULL when there are no objects without NA's, or when out of memory.
  */
-TkdtNode *kdtree (void *p[], long n, int k, double * (*getvec)(void *))
+Tkdt *kdtree (void *p[], long n, int k, double * (*getvec)(void *))
+{
+    return kdtree_opt (p, n, k, getvec, &l_default_opt);
+}
+
+/* kdtree_opt: As kdtree, with options for the layout of the tree and the build. opt NULL gives the
+ *             default options.
+ */
+Tkdt *kdtree_opt (void *p[], long n, int k, double * (*getvec)(void *), const Tkdt_opt *opt)
 {
-    int      d;
     long     i, j;
-    Tsorted  ***sl; /* sortlist points to array of k pointers to n-dimensional sort structs array */
-    Tsorted  **Ps;
-    Tsorted  *Psh;  /* assist in assigning values to pointers */
     void     *Po;
-    TkdtNode *Pnd;
+    Tkdt     *tree;
+    Tbuild   b;
+    int32_t  *ix;     /*the array that is partitioned*/
     long     n_valid; /*number of valid objects (without NA's)*/
     double   *vec;
+    int      n_thread;
 
-    if (n <= 0)
-        return NULL;
-    if ((sl = (Tsorted ***) malloc ((k + 1) * sizeof (Tsorted **))) == NULL)    /*last row is for temp values*/
+    if (!opt)
+        opt = &l_default_opt;
+
+    if (n <= 0 || n > INT32_MAX || opt->bucket_size < 1 || opt->bucket_size > KDT_MAX_BUCKET_SIZE ||
+            opt->n_key < 0 || opt->n_key > KDT_MAX_KEY)
         return NULL;
-    Ps = (Tsorted **) malloc (k * sizeof (Tsorted *));
 
-    for (d = 0; d < k + 1; d++)
+    b.co  = (double *) malloc (n * k * sizeof (double));
+    b.obj  = (void **) malloc (n * sizeof (void *));
+    b.mult = (int32_t *) malloc (n * sizeof (int32_t));
+    ix     = (int32_t *) malloc (n * sizeof (int32_t));
+    if (!b.co || !b.obj || !b.mult || !ix)
     {
-        sl[d] = (Tsorted **) malloc (n * sizeof (Tsorted *));
-        if (d < k)
-        {
-            Ps[d] = (Tsorted *) malloc (n * sizeof (Tsorted));
-            for (i = 0; i < n; i++)
-                *(sl[d] + i) = Ps[d] + i;
-        }
+        free (b.co);
+        free (b.obj);
+        free (b.mult);
+        free (ix);
+        return NULL;
     }
 
-    /* Fill the sort structures with coordinate values for each dimension */
+    /* Copy the coordinates of the objects without NA's */
     n_valid = 0;
     for (i = 0; i < n; i++)
     {
@@ -96,127 +314,201 @@ TkdtNode *kdtree (void *p[], long n, int k, double * (*getvec)(void *))
         if (j < k)
             continue;
 
-        for (d = 0; d < k; d++)
-        {
-            Psh = *(*(sl + d) + n_valid);
-            Psh->obj = Po;
-            Psh->vec = vec;
-            Psh->val = *(Psh->vec + d);
-            Psh->id  = n_valid; /*Was i. Check if this goes well*/
-        }
+        for (j = 0; j < k; j++)
+            b.co[n_valid * k + j] = vec[j];
+        b.obj[n_valid] = Po;
+        ix[n_valid]    = (int32_t) n_valid;
 
         n_valid++;
     }
 
-    /* Sort the arrays with pointers to vectors */
-    for(d = 0; d < k; d++)
+    /* An object that is given more than once (e.g. in a bootstrap sample) becomes one point.*/
+    n_valid = build_unique (&b, n_valid, k);
+
+    /* And build the tree, in one block of memory. There are at most as many nodes as points.*/
+    tree = NULL;
+    if (n_valid > 0 && (tree = new_kdt (n_valid, k, opt)) != NULL)
     {
-#if 0
-        if ((res = heapsort( (void **) *(sl+d), n_valid, (double (*)(void *, void *)) compare )) < 0)
-            return NULL;
+        b.tree        = tree;
+        tree->n_node  = kdt_n_node (n_valid, opt->bucket_size);
+        tree->n_point = n_valid;
+        tree->root    = 0;
+
+        n_thread = opt->n_thread;
+#ifdef _OPENMP
+        if (n_thread < 1)
+            n_thread = omp_get_max_threads ();
 #endif
-        qsort (*(sl+d), n_valid, sizeof(Tsorted *), compare_sorted);
+        if (n_valid < KDT_TASK_CUTOFF)
+            n_thread = 1;
+
+#pragma omp parallel num_threads(n_thread) if(n_thread > 1)
+#pragma omp single
+        kdbranch (&b, ix, n_valid, 0, 0, 0);
+
+        kdt_set_key_ranges (tree);
     }
 
-    /* And build the tree */
-    Pnd = kdbranch (sl, 0, k, n_valid, 0);
+    free (b.co);
+    free (b.obj);
+    free (b.mult);
+    free (ix);
+
+    return tree;
+}
+
+/* kdt_n_node: The number of nodes of a subtree with n points.*/
+static long kdt_n_node (long n, int bucket_size)
+{
+    if (n <= 0)
+        return 0;
+    if (n <= bucket_size)
+        return 1;
+    if (bucket_size == 1)
+        return n;
+
+    return 1 + kdt_n_node (n / 2, bucket_size) + kdt_n_node (n - n / 2 - 1, bucket_size);
+}
+
+#define KEY(i) (co[(long) ix[i] * k + dm])
+#define SWAP(i, j) do { t = ix[i]; ix[i] = ix[j]; ix[j] = t; } while (0)
+
+/* select_ix: Partition ix[0..n-1] so that ix[m] is the point with the m-th smallest coordinate dm,
+ *            points before m have a smaller or equal coordinate, points after m a greater or equal one.
+ */
+static void select_ix (int32_t *ix, long n, long m, const double *co, int k, int dm)
+{
+    long    lo, hi, mid, i, j;
+    double  pv;
+    int32_t t;
 
-    /* Release the sort structures */
-    for (d = 0; d < k; d++)
-        free (Ps[d]);
-    for (d = 0; d < (k + 1); d++)
-        free (*(sl + d));
-    free(sl);
-    free(Ps);
+    lo = 0;
+    hi = n - 1;
+    while (hi > lo)
+    {
+        /* Median of three as pivot, which also guards the scans below.*/
+        mid = lo + (hi - lo) / 2;
+        if (KEY(mid) < KEY(lo))
+            SWAP(mid, lo);
+        if (KEY(hi) < KEY(lo))
+            SWAP(hi, lo);
+        if (KEY(hi) < KEY(mid))
+            SWAP(hi, mid);
+        pv = KEY(mid);
+
+        i = lo;
+        j = hi;
+        while (i <= j)
+        {
+            while (KEY(i) < pv)
+                i++;
+            while (KEY(j) > pv)
+                j--;
+            if (i <= j)
+            {
+                SWAP(i, j);
+                i++;
+                j--;
+            }
+        }
 
-    return Pnd;
+        /* Now [lo, j] <= pv, (j, i) == pv, [i, hi] >= pv.*/
+        if (m <= j)
+            hi = j;
+        else if (m >= i)
+            lo = i;
+        else
+            break;
+    }
 }
 
-TkdtNode * kdbranch (Tsorted ***sl, int st, int k, long n, int dm) /*dm = rotated dim*/
+#undef KEY
+#undef SWAP
+
+/* kdt_set_bucket: Make node i_nd a leaf with the n points in ix, stored from point pt on.
+ *                 The coordinates are stored dimension by dimension, for the distance kernels.
+ */
+static void kdt_set_bucket (Tbuild *b, int32_t *ix, long n, int dm, int32_t i_nd, long pt)
 {
-    Tsorted **Psfr, **Psto, **Ps0, **Pstmp, **Pli, **Pri, **Psend;
+    Tkdt     *tree = b->tree;
     TkdtNode *nd;
-    int     d;     /*dim*/
-    int     id;
-    long    m;     /*median position*/
-    double  mval;  /*median value*/
+    double   *pv;
+    long     j;
+    int      d, k;
 
-    nd = (TkdtNode *) malloc(sizeof(TkdtNode));
+    k = tree->k;
 
-    if (n == 1) /*leaf*/
+    if (n == 1)
     {
-        nd->l = nd->r = NULL;
-        nd->vec = (*(*sl + st))->vec;
-        nd->obj = (*(*sl + st))->obj;
-        nd->dm  = dm;
-        nd->val = *(nd->vec + dm);
-        return nd;
+        kdt_set_point (tree, i_nd, pt, b->obj[ix[0]], b->co + (long) ix[0] * k, dm);
+        tree->mult[pt] = b->mult[ix[0]];
+        return;
     }
 
-    Ps0   = *sl + st;
-    Pstmp = *(sl + k) + st;
-    Psend = Ps0 + n;
+    /* The split value of a leaf is only used when points are inserted below it.*/
+    select_ix (ix, n, n / 2, b->co, k, dm);
 
-    for (Psfr = Ps0; Psfr < Psend; Psfr++)
+    nd     = tree->node + i_nd;
+    nd->pt = (int32_t) pt;
+    pv     = tree->vec + pt * k;
+
+    for (j = 0; j < n; j++)
     {
-        /*copy 0 array to temp array in row k*/
-        *Pstmp = *Psfr;
-        Pstmp++;
+        for (d = 0; d < k; d++)
+            pv[d * n + j] = b->co[(long) ix[j] * k + d];
+        tree->obj[pt + j]  = b->obj[ix[j]];
+        tree->mult[pt + j] = b->mult[ix[j]];
+        tree->flag[pt + j] = 0;
+        if (tree->n_key)
+            tree->getkey (tree->obj[pt + j], tree->key + (pt + j) * tree->n_key);
     }
 
-    /* Find median value index m of dimension 0 */
-    Pstmp = *(sl + k) + st;
-    for (m = (int) n / 2; m > 0; m--)
-        if ((*(Pstmp + m - 1))->val < (*(Pstmp + m))->val)
-            break;
-
-    nd->vec = (*(Pstmp + m))->vec;
-    nd->obj = (*(Pstmp + m))->obj;
+    nd->l   = nd->r = -1;
     nd->dm  = dm;
-    nd->val = *(nd->vec + dm);
-    mval    = nd->val;
-    id      = (*(Pstmp + m))->id;
+    nd->cnt = (int16_t) n;
+    nd->val = b->co[(long) ix[n / 2] * k + dm];
+}
 
-    /* Split arrays and rotate dimensions */
-    for(d = 1; d < k; d++)
-    {
-        Pli   = *(sl + d - 1) + st; /*start of left subdivision*/
-        Pri   = Pli + m + 1;      /*start of right subdivision*/
-        Psend = *(sl + d) + st + n;
-        for (Psfr = *(sl + d) + st; Psfr < Psend; Psfr++)
-        {
-            if ((*Psfr)->id == id)
-                continue;
+/* kdbranch: Build the subtree of the n points in ix, splitting on dimension dm first.
+ *           Node numbers and point numbers of a subtree follow from its size, so the subtree
+ *           takes nodes from i_nd and points from pt on, in depth-first order.
+ *           Large subtrees are built in parallel as OpenMP tasks.
+ */
+static void kdbranch (Tbuild *b, int32_t *ix, long n, int dm, int32_t i_nd, long pt)
+{
+    Tkdt     *tree = b->tree;
+    TkdtNode *nd;
+    long     m;     /*median position*/
+    int      k, dm_next;
 
-            if (((*Psfr)->vec[dm]) < mval)
-            {
-                Psto = Pli;
-                Pli++;
-            }
-            else 
-            {
-                Psto = Pri;
-                Pri++;
-            }
-            *Psto = *Psfr;
-        }
-    }
-    /* Put temp array back into last dimension */
-    Psto  = *(sl + k - 1) + st;
-    Psend = *(sl + k) + st + n;
-    for (Pstmp = (*(sl + k) + st); Pstmp < Psend; Pstmp++)
+    k = tree->k;
+
+    if (n <= tree->bucket_size) /*leaf*/
     {
-        *Psto = *Pstmp;
-        Psto++;
+        kdt_set_bucket (b, ix, n, dm, i_nd, pt);
+        return;
     }
 
-    nd->l = nd->r = NULL;
-    if (m > 0) 
-        nd->l = kdbranch (sl, st, k, m, (dm + 1) % k);
-    if ((n - m - 1) > 0) 
-        nd->r = kdbranch (sl, st + m + 1, k, n - m - 1, (dm + 1) % k);
+    m = n / 2;
+    select_ix (ix, n, m, b->co, k, dm);
+
+    kdt_set_point (tree, i_nd, pt, b->obj[ix[m]], b->co + (long) ix[m] * k, dm);
+    tree->mult[pt] = b->mult[ix[m]];
+
+    nd      = tree->node + i_nd;
+    nd->l   = (m > 0)? i_nd + 1: -1;
+    nd->r   = (n - m - 1 > 0)? i_nd + 1 + (int32_t) kdt_n_node (m, tree->bucket_size): -1;
+    dm_next = (dm + 1) % k;
 
-    return nd;
+    if (nd->l >= 0)
+    {
+#pragma omp task if(n > KDT_TASK_CUTOFF)
+        kdbranch (b, ix, m, dm_next, nd->l, pt + 1);
+    }
+    if (nd->r >= 0)
+        kdbranch (b, ix + m + 1, n - m - 1, dm_next, nd->r, pt + 1 + m);
+
+#pragma omp taskwait
 }
 
 bool ball_within_bounds (double *tg, int k, double *hr_l, double *hr_h, double *sqdst)
@@ -261,264 +553,1232 @@ bool bounds_overlap_ball (double *tg, int k, double *hr_l, double *hr_h, double
     return false;
 }
 
-
-int nnf (void *tgob /*target obj*/, TkdtNode *nd, int k, int n, void *rs[], double *sqdst, 
-         double *hr_l, double *hr_h, bool *bwb, double * (*getvec)(void *), bool (*exclude)(void *, void *),
-         bool object_only_once)
+/* Distance kernels: compute the square distances from tg to n points, of which coordinate d is at
+ * vec[d * stride + j]. All kernels add the squares in the same order, so they give the same result.
+ */
+static void sqdst_block_scalar (const double *vec, long stride, int n, int k, const double *tg, double *out)
 {
-    double *pcv, *ptv, d, sqd = 0.0, hr_tmp;
-    int    i, j;
-    double *tg; /*target vector*/
+    const double *pv;
+    double       d;
+    int          i, j;
 
-    tg = getvec (tgob);
+    for (j = 0; j < n; j++)
+        out[j] = 0.0;
 
-    /*traverse down*/
-    if (*(tg + nd->dm) < nd->val)
+    for (i = 0, pv = vec; i < k; i++, pv += stride)
     {
-        if (nd->l)
+        for (j = 0; j < n; j++)
         {
-            hr_tmp         = *(hr_h + nd->dm);
-            *(hr_h + nd->dm) = nd->val;
-            nnf (tgob, nd->l, k, n, rs, sqdst, hr_l, hr_h, bwb,
-                    (double * (*)(void *)) getvec, (bool (*)(void *, void *)) exclude, object_only_once);
-            *(hr_h + nd->dm) = hr_tmp;
+            d       = tg[i] - pv[j];
+            out[j] += d * d;
         }
     }
-    else
+}
+
+#ifdef KDT_X86_SIMD
+__attribute__ ((target ("sse2")))
+static void sqdst_block_sse2 (const double *vec, long stride, int n, int k, const double *tg, double *out)
+{
+    const double *pv;
+    __m128d      t, d, s;
+    int          i, j;
+
+    for (j = 0; j + 2 <= n; j += 2)
     {
-        if (nd->r)
+        s = _mm_setzero_pd ();
+        for (i = 0, pv = vec + j; i < k; i++, pv += stride)
         {
-            hr_tmp         = *(hr_l + nd->dm);
-            *(hr_l + nd->dm) = nd->val;
-            nnf (tgob,nd->r, k, n, rs, sqdst, hr_l, hr_h, bwb,
-                    (double * (*)(void *)) getvec, (bool (*)(void *, void *)) exclude, object_only_once);
-            *(hr_l + nd->dm) = hr_tmp;
+            t = _mm_set1_pd (tg[i]);
+            d = _mm_sub_pd (t, _mm_loadu_pd (pv));
+            s = _mm_add_pd (s, _mm_mul_pd (d, d));
         }
+        _mm_storeu_pd (out + j, s);
     }
 
-    if (*bwb) \
-        return 0; /*lower results already had ball within bounds*/
+    if (j < n)
+        sqdst_block_scalar (vec + j, stride, n - j, k, tg, out + j);
+}
 
-    /*check nodes own value against result set         */
-    /*replace item in result set: order: large to small*/
-    pcv = nd->vec;
-    for (ptv = tg; ptv < (tg + k); ptv++)
-    {
-        d = *ptv - *pcv;
-        sqd += d * d;
-        pcv++;
-        if (sqd > *sqdst)
-            break;
-    }
+__attribute__ ((target ("avx2")))
+static void sqdst_block_avx2 (const double *vec, long stride, int n, int k, const double *tg, double *out)
+{
+    const double *pv;
+    __m256d      t, d, s;
+    int          i, j;
 
-    if (!exclude (tgob, nd->obj))
+    for (j = 0; j + 4 <= n; j += 4)
     {
-        for (i = 0; i < n; i++)
-            if (sqd > *(sqdst + i))
-                break;
-
-        if (i > 0)
+        s = _mm256_setzero_pd ();
+        for (i = 0, pv = vec + j; i < k; i++, pv += stride)
         {
-            if (!(object_only_once && *(rs + i - 1) == nd->obj))
-            {
-                for (j = 0; j < i; j++)
-                {
-                    if (j == (i - 1))
-                    {
-                        *(sqdst + j) = sqd;
-                        *(rs + j)    = nd->obj;
-                    }
-                    else
-                    {
-                        *(sqdst + j) = *(sqdst + j + 1);
-                        *(rs + j)    = *(rs + j + 1);
-                    }
-                }
-            }
+            t = _mm256_set1_pd (tg[i]);
+            d = _mm256_sub_pd (t, _mm256_loadu_pd (pv));
+            s = _mm256_add_pd (s, _mm256_mul_pd (d, d));
         }
+        _mm256_storeu_pd (out + j, s);
     }
 
-    /*recursive call on further son, if necessary*/
-    if (*(tg + nd->dm) < nd->val)
-    {
-        if (nd->r)
-        {
-            hr_tmp         = *(hr_l + nd->dm);
-            *(hr_l + nd->dm) = nd->val;
-            if (bounds_overlap_ball (tg, k, hr_l, hr_h, sqdst))
-                nnf (tgob, nd->r, k, n, rs, sqdst, hr_l, hr_h, bwb,
-                        (double * (*)(void *)) getvec,(bool (*)(void *, void *)) exclude, object_only_once);
-            *(hr_l + nd->dm) = hr_tmp;
-        }
-    }
-    else
+    if (j < n)
+        sqdst_block_sse2 (vec + j, stride, n - j, k, tg, out + j);
+}
+#endif
+
+/* select_sqdst_block: Choose the distance kernel for the cpu we are running on.*/
+static void (*select_sqdst_block (const Tkdt *tree)) (const double *, long, int, int, const double *, double *)
+{
+#ifdef KDT_X86_SIMD
+    if (tree && tree->simd)
     {
-        if (nd->l)
-        {
-            hr_tmp         = *(hr_h + nd->dm);
-            *(hr_h + nd->dm) = nd->val;
-            if (bounds_overlap_ball (tg, k, hr_l, hr_h, sqdst))
-                nnf (tgob,nd->l, k, n, rs, sqdst, hr_l, hr_h, bwb,
-                        (double * (*)(void *)) getvec,(bool (*)(void *, void *)) exclude, object_only_once);
-            *(hr_h + nd->dm) = hr_tmp;
-        }
+        if (__builtin_cpu_supports ("avx2"))
+            return sqdst_block_avx2;
+        if (__builtin_cpu_supports ("sse2"))
+            return sqdst_block_sse2;
     }
-
-    *bwb = ball_within_bounds (tg, k, hr_l, hr_h, sqdst);
-
-    return 0;
+#endif
+    return sqdst_block_scalar;
 }
 
-static double *l_hr_l = NULL, *l_hr_h = NULL;  /*hyperrectangle boundaries*/
-static int    l_k_al = 0;
-
-/* kdt_nn: Find n nearest neighbors, with the possibility of providing a function to exclude
- *         some objects from the result set.
- *
- * tgob: the target object.
- * nd: the node where the search will start (usually the root).
- * k: the dimension of the space.
- * n: the number of nearest neighbors to return.
- * rs: the result set, consisting of pointers to objects. Length = n. Allocation in calling function.
- *     If such a pointer is NULL, there were no more objects.
- * sqdst: an array of length n, containing the square distances to tgob  of the objects in 
- *        the result set. Allocation in calling function.
- * getvec: function that retrieves the vector from the object.
- * exclude: function that excludes objects, based upon their relation to the target.
- * object_only_once: If the tree contains nodes that point to the same object, only one of
- *                   those nodes will be selected.
- * Returns: the number of nodes found.
- */
-int kdt_nn (void *tgob /*target obj*/, TkdtNode *nd, int k, int n /*n nearest neighb.*/, 
-            void *rs[], double *sqdst,
-            double * (*getvec)(void *), bool (*exclude)(void *, void *),
-            bool object_only_once)
+/* The result set is a max-heap during the search: the farthest neighbour found is at position 0.*/
+static inline void heap_sift_up (void **rs, double *sqdst, int i)
 {
-    int  i;
-    int  n_missing;
-    bool bwb = false;
+    int    parent;
+    void   *obj = rs[i];
+    double sqd  = sqdst[i];
 
-    if (k != l_k_al)
+    while (i > 0 && sqdst[parent = (i - 1) / 2] < sqd)
     {
-        l_hr_l = (double *) realloc (l_hr_l, k * sizeof(double)); /*lowest*/
-        l_hr_h = (double *) realloc (l_hr_h, k * sizeof(double)); /*highest*/
-        l_k_al = k;
+        rs[i]    = rs[parent];
+        sqdst[i] = sqdst[parent];
+        i        = parent;
     }
 
-    for (i = 0; i < k; i++)
-    {
-        *(l_hr_l + i) = -DBL_MAX;
-        *(l_hr_h + i) = DBL_MAX;
-    }
+    rs[i]    = obj;
+    sqdst[i] = sqd;
+}
+
+static inline void heap_sift_down (void **rs, double *sqdst, int n, int i)
+{
+    int    child;
+    void   *obj = rs[i];
+    double sqd  = sqdst[i];
 
-    for (i = 0; i < n; i++) 
+    while ((child = 2 * i + 1) < n)
     {
-        *(sqdst + i) = DBL_MAX;
-        *(rs + i)    = NULL;
+        if (child + 1 < n && sqdst[child + 1] > sqdst[child])
+            child++;
+        if (sqdst[child] <= sqd)
+            break;
+        rs[i]    = rs[child];
+        sqdst[i] = sqdst[child];
+        i        = child;
     }
 
-    nnf (tgob, nd, k, n, rs, sqdst, l_hr_l, l_hr_h, &bwb,
-          (double * (*)(void *)) getvec, (bool (*)(void *, void *)) exclude, object_only_once);
+    rs[i]    = obj;
+    sqdst[i] = sqd;
+}
 
-    for (n_missing = 0; n_missing < n; n_missing++)
-        if (rs[n_missing])
-            break;
+/* in_excl_win: Is a point with keys from lo to hi (per key) within an exclusion window of the target?*/
+static inline bool in_excl_win (const Tkdt_search *srch, const long *lo, const long *hi)
+{
+    int i;
 
-    return n - n_missing;
+    for (i = 0; i < srch->tree->n_key; i++)
+        if (srch->excl_win[i] > 0 &&
+                lo[i] > srch->tg_key[i] - srch->excl_win[i] && hi[i] < srch->tg_key[i] + srch->excl_win[i])
+            return true;
 
+    return false;
 }
 
-int insert_node (TkdtNode *node, TkdtNode *branch, int k)
+/* add_to_rs: Add point pt with square distance sqd to the result set, if it is near enough.*/
+static inline void add_to_rs (Tkdt_search *srch, long pt, double sqd)
 {
-    if (node->vec[branch->dm] < branch->val)
+    int32_t m;
+    void    *obj;
+    long    *key;
+
+    if (sqd > srch->radius || (srch->tree->flag[pt] & (KDT_FLAG_DELETED | KDT_FLAG_MASKED)))
+        return;
+
+    if (srch->use_win)
     {
-        if (branch->l)
-            return insert_node (node, branch->l, k);
-        else
-            branch->l = node;
+        key = srch->tree->key + pt * srch->tree->n_key;
+        if (in_excl_win (srch, key, key))
+            return;
     }
-    else
+
+    obj = srch->tree->obj[pt];
+    if (!(srch->use_win && srch->excl_win_only) &&
+            (srch->exclude_r? srch->exclude_r (srch->tgob, obj, srch->exclude_arg): srch->exclude (srch->tgob, obj)))
+        return;
+
+    /* An object with multiplicity m takes up to m places, unless objects may occur only once.
+     * Every object is one point in a tree, so there is no need to look in the result set.
+     */
+    for (m = srch->object_only_once? 1: srch->tree->mult[pt]; m > 0 && sqd <= srch->radius; m--)
     {
-        if (branch->r)
-            return insert_node (node, branch->r, k);
-        else
-            branch->r = node;
-    }
+        if (srch->n_found < srch->n)
+        {
+            srch->rs[srch->n_found]    = obj;
+            srch->sqdst[srch->n_found] = sqd;
+            heap_sift_up (srch->rs, srch->sqdst, srch->n_found++);
 
-    node->dm = (branch->dm + 1) % k;
-    node->val = node->vec[node->dm];
+            if (srch->n_found < srch->n)
+                continue;
+        }
+        else
+        {
+            /* Replace the farthest neighbour.*/
+            srch->rs[0]    = obj;
+            srch->sqdst[0] = sqd;
+            heap_sift_down (srch->rs, srch->sqdst, srch->n, 0);
+        }
 
-    return 0; 
+        srch->radius = srch->sqdst[0];
+    }
 }
 
-/* kdt_insert: Insert a node in an existing tree */
-int kdt_insert (void *obj, TkdtNode *nd, int k, double * (*getvec)(void *))
+/* sort_rs: Sort the result set from large to small distance, and move it to the end of the arrays.
+ *          Unfilled positions at the start are set to NULL and DBL_MAX.
+ */
+static void sort_rs (Tkdt_search *srch)
 {
-    TkdtNode *ndi;
-    double   *vec;
-    int i;
-
-    if (obj == NULL)
-        return -1;
+    void   **rs = srch->rs, *obj;
+    double *sqdst = srch->sqdst, sqd;
+    int    i, m, n_empty;
 
-    if (nd == NULL)
-        return -2;
+    /* Heap sort: repeatedly move the farthest neighbour to the end of the heap.*/
+    for (m = srch->n_found - 1; m > 0; m--)
+    {
+        obj = rs[m];    rs[m]    = rs[0];    rs[0]    = obj;
+        sqd = sqdst[m]; sqdst[m] = sqdst[0]; sqdst[0] = sqd;
+        heap_sift_down (rs, sqdst, m, 0);
+    }
 
-    vec = getvec(obj);
-    if (vec == NULL)
-        return -3;
+    /* Now from small to large in the first n_found positions: reverse, and shift to the end.*/
+    for (i = 0, m = srch->n_found - 1; i < m; i++, m--)
+    {
+        obj = rs[m];    rs[m]    = rs[i];    rs[i]    = obj;
+        sqd = sqdst[m]; sqdst[m] = sqdst[i]; sqdst[i] = sqd;
+    }
 
-    for (i = 0; i < k; i++)
+    n_empty = srch->n - srch->n_found;
+    if (n_empty > 0)
     {
-        if (isnan(vec[i]))
-            return -4;
+        memmove (rs + n_empty, rs, srch->n_found * sizeof (void *));
+        memmove (sqdst + n_empty, sqdst, srch->n_found * sizeof (double));
+    }
+
+    for (i = 0; i < n_empty; i++)
+    {
+        rs[i]    = NULL;
+        sqdst[i] = DBL_MAX;
+    }
+}
+
+int nnf (Tkdt_search *srch, int32_t i_nd)
+{
+    double *pcv, *ptv, d, sqd = 0.0, hr_tmp, prune;
+    double sqd_blk[KDT_BLOCK];
+    int    j, j0, n_blk;
+    int    k;
+    double *tg, *hr_l, *hr_h, *radius;
+    const TkdtNode *nd;
+
+    tg     = srch->tg;
+    k      = srch->k;
+    hr_l   = srch->hr_l;
+    hr_h   = srch->hr_h;
+    radius = &srch->radius;
+    nd     = srch->tree->node + i_nd;
+
+    /* All points of the subtree are excluded*/
+    if (srch->use_win && in_excl_win (srch, srch->tree->key_lo + (long) i_nd * srch->tree->n_key,
+                                      srch->tree->key_hi + (long) i_nd * srch->tree->n_key))
+        return 0;
+
+    /*traverse down*/
+    if (*(tg + nd->dm) < nd->val)
+    {
+        if (nd->l >= 0)
+        {
+            hr_tmp         = *(hr_h + nd->dm);
+            *(hr_h + nd->dm) = nd->val;
+            nnf (srch, nd->l);
+            *(hr_h + nd->dm) = hr_tmp;
+        }
+    }
+    else
+    {
+        if (nd->r >= 0)
+        {
+            hr_tmp         = *(hr_l + nd->dm);
+            *(hr_l + nd->dm) = nd->val;
+            nnf (srch, nd->r);
+            *(hr_l + nd->dm) = hr_tmp;
+        }
+    }
+
+    /* Lower results already had ball within bounds. Only when the node has one point, that point is
+     * on the boundary of the child; the points of a bucket (with inserted children) are not.
+     */
+    if (srch->bwb && nd->cnt == 1)
+        return 0;
+
+    /*check nodes own points against result set*/
+    pcv = srch->tree->vec + (long) nd->pt * srch->tree->k;
+    if (nd->cnt == 1)
+    {
+        for (ptv = tg; ptv < (tg + k); ptv++)
+        {
+            d = *ptv - *pcv;
+            sqd += d * d;
+            pcv++;
+            if (sqd > *radius)
+                break;
+        }
+
+        add_to_rs (srch, nd->pt, sqd);
+    }
+    else
+    {
+        for (j0 = 0; j0 < nd->cnt; j0 += KDT_BLOCK)
+        {
+            n_blk = (nd->cnt - j0 < KDT_BLOCK)? nd->cnt - j0: KDT_BLOCK;
+            srch->sqdst_block (pcv + j0, nd->cnt, n_blk, k, tg, sqd_blk);
+            for (j = 0; j < n_blk; j++)
+                add_to_rs (srch, nd->pt + j0 + j, sqd_blk[j]);
+        }
+    }
+    srch->n_leaf++;
+
+    /* Approximate search: no more nodes after max_leaf, once n points are found.*/
+    if (srch->max_leaf > 0 && srch->n_leaf >= srch->max_leaf && srch->n_found >= srch->n)
+        return 0;
+
+    /*recursive call on further son, if necessary. The approximate search only takes it when it can
+     *hold a point that is more than 1 + eps times closer than the farthest neighbour found.*/
+    prune = *radius * srch->approx_fact;
+    if (*(tg + nd->dm) < nd->val)
+    {
+        if (nd->r >= 0)
+        {
+            hr_tmp         = *(hr_l + nd->dm);
+            *(hr_l + nd->dm) = nd->val;
+            if (bounds_overlap_ball (tg, k, hr_l, hr_h, &prune))
+                nnf (srch, nd->r);
+            *(hr_l + nd->dm) = hr_tmp;
+        }
+    }
+    else
+    {
+        if (nd->l >= 0)
+        {
+            hr_tmp         = *(hr_h + nd->dm);
+            *(hr_h + nd->dm) = nd->val;
+            if (bounds_overlap_ball (tg, k, hr_l, hr_h, &prune))
+                nnf (srch, nd->l);
+            *(hr_h + nd->dm) = hr_tmp;
+        }
+    }
+
+    srch->bwb = ball_within_bounds (tg, k, hr_l, hr_h, radius);
+
+    return 0;
+}
+
+/* new_kdt_search: Create a search context for trees of dimension k.
+ *                 The context holds all memory that is written during a search, so each thread
+ *                 that queries a (shared) tree should use its own context.
+ * Returns: the context, or NULL when k < 1 or out of memory.
+ */
+Tkdt_search *new_kdt_search (int k)
+{
+    Tkdt_search *srch;
+
+    if (k < 1)
+        return NULL;
+
+    if ((srch = (Tkdt_search *) malloc (sizeof (Tkdt_search))) == NULL)
+        return NULL;
+
+    srch->k_alloc = k;
+    if ((srch->hr_l = (double *) malloc (2 * k * sizeof(double))) == NULL) /*lowest, followed by highest*/
+    {
+        free (srch);
+        return NULL;
+    }
+    srch->hr_h    = srch->hr_l + k;
+    kdt_search_excl_win (srch, 0, NULL, false);
+    kdt_search_approx (srch, 0.0, 0);
+    kdt_search_exclude (srch, NULL, NULL);
+
+    return srch;
+}
+
+/* kdt_search_excl_win: Set exclusion windows for the searches with srch, on trees built with keys.
+ *                      An object is excluded when |key[i] - key[i] of the target| < win[i], for some i.
+ *                      win[i] <= 0 switches off the window of key i.
+ *                      win_only: the windows give the complete exclusion, so the exclude function
+ *                      does not need to be called (on trees with keys).
+ *                      Whole subtrees within a window are skipped.
+ * Returns: -1 when n_key is too large, otherwise 0.
+ */
+int kdt_search_excl_win (Tkdt_search *srch, int n_key, const long *win, bool win_only)
+{
+    int i;
+
+    if (n_key > KDT_MAX_KEY)
+        return -1;
+
+    for (i = 0; i < KDT_MAX_KEY; i++)
+        srch->excl_win[i] = (i < n_key)? win[i]: 0;
+
+    srch->excl_win_only = win_only;
+
+    return 0;
+}
+
+/* kdt_search_approx: Make the searches with srch approximate, for large trees in many dimensions.
+ *                    eps > 0: a subtree is only searched when it can hold a point that is closer than
+ *                    the farthest neighbour found so far divided by 1 + eps. So the distance of the i-th
+ *                    neighbour found is at most 1 + eps times the exact one.
+ *                    max_leaf > 0: once n neighbours are found, the search stops after the points of
+ *                    max_leaf nodes are checked.
+ *                    eps 0 and max_leaf 0 give the exact search.
+ * Returns: -1 when eps or max_leaf is negative, otherwise 0.
+ */
+int kdt_search_approx (Tkdt_search *srch, double eps, long max_leaf)
+{
+    if (eps < 0.0 || max_leaf < 0)
+        return -1;
+
+    srch->approx_eps  = eps;
+    srch->approx_fact = 1.0 / ((1.0 + eps) * (1.0 + eps));
+    srch->max_leaf    = max_leaf;
+
+    return 0;
+}
+
+/* kdt_search_exclude: Exclude objects in the searches with srch by exclude_r (target, candidate, arg),
+ *                     instead of by the exclude function passed to the search, which may then be NULL.
+ *                     The threads of kdt_nn_batch all get exclude_r and arg.
+ *                     exclude_r NULL goes back to the exclude function of the search.
+ */
+void kdt_search_exclude (Tkdt_search *srch, bool (*exclude_r)(void *, void *, void *), void *arg)
+{
+    srch->exclude_r   = exclude_r;
+    srch->exclude_arg = arg;
+}
+
+void free_kdt_search (Tkdt_search *srch)
+{
+    if (!srch)
+        return;
+
+    if (srch->hr_l)
+        free (srch->hr_l);
+
+    free (srch);
+}
+
+/* nn_tree: Add the nearest points of a tree to the result set of the current query.*/
+static void nn_tree (Tkdt_search *srch, const Tkdt *tree)
+{
+    int  i;
+
+    if (!tree || tree->root < 0 || srch->n <= 0)
+        return;
+
+    for (i = 0; i < srch->k; i++)
+    {
+        *(srch->hr_l + i) = -DBL_MAX;
+        *(srch->hr_h + i) = DBL_MAX;
+    }
+
+    srch->tree        = tree;
+    srch->bwb         = false;
+    srch->sqdst_block = select_sqdst_block (tree);
+
+    srch->use_win = false;
+    if (tree->n_key > 0)
+    {
+        for (i = 0; i < tree->n_key; i++)
+            if (srch->excl_win[i] > 0)
+                srch->use_win = true;
+        if (srch->use_win)
+            tree->getkey (srch->tgob, srch->tg_key);
+    }
+
+    nnf (srch, tree->root);
+}
+
+/* nn_r: Query the n_tree trees (NULL entries are skipped) together. See kdt_nn_r.*/
+static int nn_r (Tkdt_search *srch, void *tgob, const Tkdt *const *tree, int n_tree, int k, int n,
+                 void *rs[], double *sqdst,
+                 double * (*getvec)(void *), bool (*exclude)(void *, void *),
+                 bool object_only_once)
+{
+    int  i;
+
+    if (k > srch->k_alloc)
+        return -1;
+
+    srch->tgob             = tgob;
+    srch->tg               = getvec (tgob);
+    srch->k                = k;
+    srch->n                = n;
+    srch->rs               = rs;
+    srch->sqdst            = sqdst;
+    srch->n_found          = 0;
+    srch->n_leaf           = 0;
+    srch->radius           = DBL_MAX;
+    srch->exclude          = exclude;
+    srch->object_only_once = object_only_once;
+
+    for (i = 0; i < n_tree; i++)
+        nn_tree (srch, tree[i]);
+
+    sort_rs (srch);
+
+    return srch->n_found;
+}
+
+/* kdt_nn_r: Reentrant version of kdt_nn. All scratch memory is taken from srch, which should have
+ *           been created for a dimension of at least k. The tree itself is only read.
+ *           See kdt_nn for the other parameters.
+ * Returns: the number of nodes found, or -1 when srch is too small for k.
+ */
+int kdt_nn_r (Tkdt_search *srch, void *tgob /*target obj*/, const Tkdt *tree, int k, int n /*n nearest neighb.*/,
+              void *rs[], double *sqdst,
+              double * (*getvec)(void *), bool (*exclude)(void *, void *),
+              bool object_only_once)
+{
+    return nn_r (srch, tgob, &tree, 1, k, n, rs, sqdst, getvec, exclude, object_only_once);
+}
+
+/* kdt_nn: Find n nearest neighbors, with the possibility of providing a function to exclude
+ *         some objects from the result set.
+ *         The hyperrectangle boundaries are kept on the stack, so kdt_nn may be called
+ *         concurrently on the same tree.
+ *
+ * tgob: the target object.
+ * tree: the tree to search, may be NULL.
+ * k: the dimension of the space.
+ * n: the number of nearest neighbors to return.
+ * rs: the result set, consisting of pointers to objects. Length = n. Allocation in calling function.
+ *     If such a pointer is NULL, there were no more objects.
+ * sqdst: an array of length n, containing the square distances to tgob  of the objects in 
+ *        the result set. Allocation in calling function.
+ * getvec: function that retrieves the vector from the object.
+ * exclude: function that excludes objects, based upon their relation to the target.
+ * object_only_once: If the tree contains nodes that point to the same object, only one of
+ *                   those nodes will be selected.
+ * Returns: the number of nodes found.
+ */
+int kdt_nn (void *tgob /*target obj*/, const Tkdt *tree, int k, int n /*n nearest neighb.*/, 
+            void *rs[], double *sqdst,
+            double * (*getvec)(void *), bool (*exclude)(void *, void *),
+            bool object_only_once)
+{
+    Tkdt_search srch;
+    double      hr[2 * k];
+
+    srch.k_alloc = k;
+    srch.hr_l    = hr;
+    srch.hr_h    = hr + k;
+    kdt_search_excl_win (&srch, 0, NULL, false);
+    kdt_search_approx (&srch, 0.0, 0);
+    kdt_search_exclude (&srch, NULL, NULL);
+
+    return kdt_nn_r (&srch, tgob, tree, k, n, rs, sqdst, getvec, exclude, object_only_once);
+}
+
+typedef struct
+{
+    uint64_t code;
+    long     i;
+} Tmorton;
+
+int compare_morton (const void *a, const void *b)  /*to pass to qsort*/
+{
+    uint64_t x = ((Tmorton *) a)->code;
+    uint64_t y = ((Tmorton *) b)->code;
+
+    if (x > y)
+        return 1;
+    else if (x < y)
+        return -1;
+
+    return 0;
+}
+
+/* morton_order: Order of the targets along a Morton (z-order) curve through their bounding box,
+ *               so that targets that follow each other are near each other in space.
+ * Returns: the order, or NULL when out of memory.
+ */
+static long *morton_order (void *tgob[], long n_target, int k, double * (*getvec)(void *))
+{
+    Tmorton  *mc;
+    long     *order, i;
+    double   lo[KDT_MORTON_MAX_DIM], hi[KDT_MORTON_MAX_DIM], *vec, x;
+    uint64_t q[KDT_MORTON_MAX_DIM], q_max;
+    int      d, b, n_bit, k_use;
+
+    k_use = (k < KDT_MORTON_MAX_DIM)? k: KDT_MORTON_MAX_DIM;
+    n_bit = 63 / k_use;
+    if (n_bit > 21)
+        n_bit = 21;
+    q_max = ((uint64_t) 1 << n_bit) - 1;
+
+    mc    = (Tmorton *) malloc (n_target * sizeof (Tmorton));
+    order = (long *) malloc (n_target * sizeof (long));
+    if (!mc || !order)
+    {
+        free (mc);
+        free (order);
+        return NULL;
+    }
+
+    for (d = 0; d < k_use; d++)
+    {
+        lo[d] = DBL_MAX;
+        hi[d] = -DBL_MAX;
+    }
+
+    for (i = 0; i < n_target; i++)
+    {
+        vec = getvec (tgob[i]);
+        for (d = 0; d < k_use; d++)
+        {
+            if (vec[d] < lo[d])
+                lo[d] = vec[d];
+            if (vec[d] > hi[d])
+                hi[d] = vec[d];
+        }
+    }
+
+    for (i = 0; i < n_target; i++)
+    {
+        vec = getvec (tgob[i]);
+        for (d = 0; d < k_use; d++)
+        {
+            x    = (hi[d] > lo[d])? (vec[d] - lo[d]) / (hi[d] - lo[d]): 0.0;
+            q[d] = (x >= 0.0 && x <= 1.0)? (uint64_t) (x * q_max): 0;  /*NaN gives 0*/
+        }
+
+        mc[i].code = 0;
+        for (b = n_bit - 1; b >= 0; b--)
+            for (d = 0; d < k_use; d++)
+                mc[i].code = (mc[i].code << 1) | ((q[d] >> b) & 1);
+        mc[i].i = i;
+    }
+
+    qsort (mc, n_target, sizeof (Tmorton), compare_morton);
+
+    for (i = 0; i < n_target; i++)
+        order[i] = mc[i].i;
+
+    free (mc);
+
+    return order;
+}
+
+/* kdt_nn_batch: Find the n nearest neighbours of each of n_target targets.
+ *               The targets are visited in Morton order, so that consecutive searches follow the
+ *               same paths through the tree, and divided over n_thread threads
+ *               (smaller than 1: all processors).
+ *
+ * srch: search context of which the exclusion windows (kdt_search_excl_win), the exclude function
+ *       (kdt_search_exclude) and the approximation (kdt_search_approx) are used, may be NULL.
+ *       It is not written.
+ * tgob: the n_target target objects.
+ * rs, sqdst: n_target x n matrices, row i (at rs + i * n) gets the result of target i, in the same
+ *            order as kdt_nn.
+ * n_found: if not NULL, n_found[i] gets the number of neighbours found for target i.
+ * See kdt_nn for the other parameters.
+ * Returns: 0, or -1 when out of memory.
+ */
+int kdt_nn_batch (const Tkdt_search *srch, void *tgob[], long n_target, const Tkdt *tree, int k, int n,
+                  void *rs[], double *sqdst, int *n_found,
+                  double * (*getvec)(void *), bool (*exclude)(void *, void *),
+                  bool object_only_once, int n_thread)
+{
+    return nn_batch (srch, tgob, n_target, &tree, 1, k, n, rs, sqdst, n_found, getvec, exclude,
+                     object_only_once, n_thread);
+}
+
+/* nn_batch: kdt_nn_batch on the n_tree trees together.*/
+static int nn_batch (const Tkdt_search *srch, void *tgob[], long n_target, const Tkdt *const *tree, int n_tree,
+                     int k, int n, void *rs[], double *sqdst, int *n_found,
+                     double * (*getvec)(void *), bool (*exclude)(void *, void *),
+                     bool object_only_once, int n_thread)
+{
+    long *order = NULL;
+    int  res = 0;
+
+    if (n_target <= 0)
+        return 0;
+
+    if (n_target >= KDT_MORTON_MIN_TARGET && (order = morton_order (tgob, n_target, k, getvec)) == NULL)
+        return -1;
+
+#ifdef _OPENMP
+    if (n_thread < 1)
+        n_thread = omp_get_max_threads ();
+#endif
+
+#pragma omp parallel num_threads(n_thread) if(n_thread > 1) reduction(min:res)
+    {
+        Tkdt_search *srch_th;
+        long        i_ord, i;
+        int         m;
+
+        if ((srch_th = new_kdt_search (k)) == NULL)
+            res = -1;
+        else if (srch)
+        {
+            kdt_search_excl_win (srch_th, KDT_MAX_KEY, srch->excl_win, srch->excl_win_only);
+            kdt_search_approx (srch_th, srch->approx_eps, srch->max_leaf);
+            kdt_search_exclude (srch_th, srch->exclude_r, srch->exclude_arg);
+        }
+
+#pragma omp for schedule(dynamic, 64)
+        for (i_ord = 0; i_ord < n_target; i_ord++)
+        {
+            if (!srch_th)
+                continue;
+
+            i = order? order[i_ord]: i_ord;
+            m = nn_r (srch_th, tgob[i], tree, n_tree, k, n, rs + i * n, sqdst + i * n, getvec, exclude,
+                      object_only_once);
+            if (n_found)
+                n_found[i] = m;
+        }
+
+        free_kdt_search (srch_th);
+    }
+
+    free (order);
+
+    return res;
+}
+
+int insert_node (Tkdt *tree, int32_t i_node, int32_t i_branch)
+{
+    TkdtNode *branch;
+    double   *vec;
+    long     *key;
+    int      dm, i;
+
+    vec = tree->vec + (long) tree->node[i_node].pt * tree->k;
+    key = tree->key + (long) tree->node[i_node].pt * tree->n_key;
+
+    for (i = 0; i < tree->n_key; i++)
+        tree->key_lo[(long) i_node * tree->n_key + i] = tree->key_hi[(long) i_node * tree->n_key + i] = key[i];
+
+    for (;;)
+    {
+        branch = tree->node + i_branch;
+
+        /* The new point will be in the subtree of branch.*/
+        for (i = 0; i < tree->n_key; i++)
+        {
+            if (key[i] < tree->key_lo[(long) i_branch * tree->n_key + i])
+                tree->key_lo[(long) i_branch * tree->n_key + i] = key[i];
+            if (key[i] > tree->key_hi[(long) i_branch * tree->n_key + i])
+                tree->key_hi[(long) i_branch * tree->n_key + i] = key[i];
+        }
+
+        if (vec[branch->dm] < branch->val)
+        {
+            if (branch->l < 0)
+            {
+                branch->l = i_node;
+                break;
+            }
+            i_branch = branch->l;
+        }
+        else
+        {
+            if (branch->r < 0)
+            {
+                branch->r = i_node;
+                break;
+            }
+            i_branch = branch->r;
+        }
+    }
+
+    dm = (branch->dm + 1) % tree->k;
+    tree->node[i_node].dm  = dm;
+    tree->node[i_node].val = vec[dm];
+
+    return 0; 
+}
+
+/* kdt_find_obj: Find the point of obj, with coordinates vec, in the subtree of node i_nd, by following
+ *               the path of vec. Points equal to the split value can be on both sides.
+ *               Deleted points are skipped.
+ * Returns: the index of the point, or -1 when obj is not in the subtree.
+ */
+static long kdt_find_obj (const Tkdt *tree, int32_t i_nd, void *obj, const double *vec)
+{
+    const TkdtNode *nd;
+    long           pt;
+    int            j;
+
+    while (i_nd >= 0)
+    {
+        nd = tree->node + i_nd;
+        for (j = 0; j < nd->cnt; j++)
+            if (tree->obj[nd->pt + j] == obj && !(tree->flag[nd->pt + j] & KDT_FLAG_DELETED))
+                return nd->pt + j;
+
+        if (vec[nd->dm] == nd->val && (pt = kdt_find_obj (tree, nd->l, obj, vec)) >= 0)
+            return pt;
+
+        i_nd = (vec[nd->dm] < nd->val)? nd->l: nd->r;
+    }
+
+    return -1;
+}
+
+/* kdt_insert: Insert a node in an existing tree. When obj is already in the tree, its multiplicity
+ *             is raised instead.
+ *             When the tree has no room for the node, it is moved to a larger block of memory,
+ *             so *tree may change.
+ */
+int kdt_insert (void *obj, Tkdt **tree, double * (*getvec)(void *))
+{
+    Tkdt     *tr, *tr_new;
+    Tkdt_opt opt;
+    double   *vec;
+    int32_t  i_nd;
+    long     n_alloc, pt;
+    int      i;
+
+    if (obj == NULL)
+        return -1;
+
+    if (tree == NULL || *tree == NULL)
+        return -2;
+
+    tr  = *tree;
+    vec = getvec(obj);
+    if (vec == NULL)
+        return -3;
+
+    for (i = 0; i < tr->k; i++)
+    {
+        if (isnan(vec[i]))
+            return -4;
+    }
+
+    if ((pt = kdt_find_obj (tr, tr->root, obj, vec)) >= 0)
+    {
+        tr->mult[pt]++;
+        return 0;
+    }
+
+    if (tr->n_point >= tr->n_alloc)  /*n_node <= n_point*/
+    {
+        if (tr->n_alloc >= INT32_MAX)
+            return -5;
+
+        n_alloc = 2 * tr->n_alloc;
+        if (n_alloc > INT32_MAX)
+            n_alloc = INT32_MAX;
+
+        opt.bucket_size = tr->bucket_size;
+        opt.simd        = tr->simd;
+        opt.n_key       = tr->n_key;
+        opt.getkey      = tr->getkey;
+        if ((tr_new = new_kdt (n_alloc, tr->k, &opt)) == NULL)
+            return -5;
+
+        tr_new->root    = tr->root;
+        tr_new->n_node  = tr->n_node;
+        tr_new->n_point = tr->n_point;
+        memcpy (tr_new->node, tr->node, tr->n_node * sizeof (TkdtNode));
+        memcpy (tr_new->vec, tr->vec, tr->n_point * tr->k * sizeof (double));
+        memcpy (tr_new->obj, tr->obj, tr->n_point * sizeof (void *));
+        memcpy (tr_new->mult, tr->mult, tr->n_point * sizeof (int32_t));
+        memcpy (tr_new->flag, tr->flag, tr->n_point * sizeof (uint8_t));
+        memcpy (tr_new->key, tr->key, tr->n_point * tr->n_key * sizeof (long));
+        memcpy (tr_new->key_lo, tr->key_lo, tr->n_node * tr->n_key * sizeof (long));
+        memcpy (tr_new->key_hi, tr->key_hi, tr->n_node * tr->n_key * sizeof (long));
+        free (tr);
+        *tree = tr = tr_new;
     }
 
     /* Create the node.*/
-    ndi = (TkdtNode *) malloc(sizeof(TkdtNode));
-    ndi->l = NULL;
-    ndi->r = NULL;
-    ndi->vec = vec;
-    ndi->obj = obj;
+    i_nd = (int32_t) tr->n_node++;
+    kdt_set_point (tr, i_nd, tr->n_point++, obj, vec, 0);
 
-    return (insert_node (ndi, nd, k));
+    if (tr->root < 0)
+    {
+        tr->root = i_nd;
+        kdt_set_key_ranges (tr);
+        return 0;
+    }
+
+    return (insert_node (tr, i_nd, tr->root));
 }
 
-void free_kdt (TkdtNode *nd)
+void free_kdt (Tkdt *tree)
 {
-    if (nd->l)
-        free_kdt (nd->l);
-    if (nd->r)
-        free_kdt (nd->r);
-    
-    free (nd);
+    free (tree);
+}
 
-    if (l_hr_l)
-        free (l_hr_l);
-    
-    l_hr_l = NULL;
-    
-    if (l_hr_h)
-        free (l_hr_h);
-    
-    l_hr_h = NULL;
-    l_k_al = 0;
+/* new_kdt_forest: Create an empty forest of trees of dimension k. The trees are built with opt
+ *                 (NULL: the default options), from the coordinates that getvec gives.
+ */
+Tkdt_forest *new_kdt_forest (int k, double * (*getvec)(void *), const Tkdt_opt *opt)
+{
+    Tkdt_forest *forest;
+    int         i;
+
+    if (!opt)
+        opt = &l_default_opt;
+
+    if (k < 1 || opt->bucket_size < 1 || opt->bucket_size > KDT_MAX_BUCKET_SIZE ||
+            opt->n_key < 0 || opt->n_key > KDT_MAX_KEY)
+        return NULL;
+
+    if ((forest = (Tkdt_forest *) malloc (sizeof (Tkdt_forest))) == NULL)
+        return NULL;
+
+    forest->k         = k;
+    forest->getvec    = getvec;
+    forest->opt       = *opt;
+    forest->n_point   = 0;
+    forest->n_deleted = 0;
+    for (i = 0; i < KDT_FOREST_MAX_TREE; i++)
+        forest->tree[i] = NULL;
+
+    return forest;
 }
 
-int kdt_print (TkdtNode *nd, int k, int lvl)
+void free_kdt_forest (Tkdt_forest *forest)
 {
     int i;
 
-    if (nd == NULL) return 0;
-    for (i = 0; i < lvl; i++) printf("  ");
-    printf("%d", nd->dm);
-    for (i = 0; i < k; i++) printf(", %f", nd->vec[i]);
-    printf("\n");
+    if (!forest)
+        return;
+
+    for (i = 0; i < KDT_FOREST_MAX_TREE; i++)
+        free_kdt (forest->tree[i]);
+
+    free (forest);
+}
+
+/* tree_n_obj: The number of objects in the points of a tree that are not deleted, counted with
+ *             their multiplicities.
+ */
+static long tree_n_obj (const Tkdt *tree)
+{
+    long pt, n = 0;
+
+    for (pt = 0; pt < tree->n_point; pt++)
+        if (!(tree->flag[pt] & KDT_FLAG_DELETED))
+            n += tree->mult[pt];
+
+    return n;
+}
+
+/* forest_take_points: Append the objects of the points of tree i that are not deleted to obj, each as
+ *                     many times as its multiplicity, and free the tree. The masked objects are also
+ *                     appended to masked (once), from position *n_masked on.
+ * Returns: the number of objects appended to obj.
+ */
+static long forest_take_points (Tkdt_forest *forest, int i, void **obj, void **masked, long *n_masked)
+{
+    Tkdt    *tree = forest->tree[i];
+    long    pt, n = 0;
+    int32_t m;
+
+    for (pt = 0; pt < tree->n_point; pt++)
+    {
+        if (tree->flag[pt] & KDT_FLAG_DELETED)
+        {
+            forest->n_deleted--;
+            continue;
+        }
+
+        for (m = 0; m < tree->mult[pt]; m++)
+            obj[n++] = tree->obj[pt];
+        if (tree->flag[pt] & KDT_FLAG_MASKED)
+            masked[(*n_masked)++] = tree->obj[pt];
+    }
+
+    free_kdt (tree);
+    forest->tree[i] = NULL;
+
+    return n;
+}
+
+/* forest_find_obj: Find the point of obj in a forest.
+ * Returns: the tree, with the point in *pt, or -1 when obj is not in the forest.
+ */
+static int forest_find_obj (const Tkdt_forest *forest, void *obj, long *pt)
+{
+    int j;
+
+    for (j = KDT_FOREST_MAX_TREE - 1; j >= 0; j--)
+        if (forest->tree[j] &&
+                (*pt = kdt_find_obj (forest->tree[j], forest->tree[j]->root, obj, forest->getvec (obj))) >= 0)
+            return j;
+
+    return -1;
+}
+
+/* forest_count: Count the points of a forest that are not deleted.*/
+static void forest_count (Tkdt_forest *forest)
+{
+    int j;
+
+    forest->n_point = -forest->n_deleted;
+    for (j = 0; j < KDT_FOREST_MAX_TREE; j++)
+        if (forest->tree[j])
+            forest->n_point += forest->tree[j]->n_point;
+}
+
+/* kdt_forest_insert: Insert n objects into a forest. An object that is already in the forest gets a
+ *                    higher multiplicity. The other objects are merged with the smallest trees, which
+ *                    are too small to hold them, into one new balanced tree. Each point is thus
+ *                    rebuilt O(log n) times, instead of the whole tree for every change.
+ *                    Objects with NA's in their coordinates are skipped.
+ * Returns: 0, -1 when out of memory, -2 when the forest is full.
+ */
+int kdt_forest_insert (Tkdt_forest *forest, void *obj[], long n)
+{
+    void   **all, **all_new, **masked;
+    double *vec;
+    long   m, n_new, n_all, n_masked, i, pt;
+    int    i_tree, j, d, res;
+
+    if (n <= 0)
+        return 0;
+
+    if ((all = (void **) malloc (n * sizeof (void *))) == NULL)
+        return -1;
+
+    n_new = 0;
+    for (i = 0; i < n; i++)
+    {
+        vec = forest->getvec (obj[i]);
+        for (d = 0; d < forest->k; d++)
+            if (isnan(vec[d]))
+                break;
+        if (d < forest->k)
+            continue;
+
+        if ((j = forest_find_obj (forest, obj[i], &pt)) >= 0)
+            forest->tree[j]->mult[pt]++;
+        else
+            all[n_new++] = obj[i];
+    }
+
+    /* The new tree replaces all smaller trees, and is the first one that is free and large enough.*/
+    m     = n_new;  /*points*/
+    n_all = n_new;  /*objects, with their multiplicities*/
+    for (i_tree = 0; n_new > 0 && i_tree < KDT_FOREST_MAX_TREE; i_tree++)
+    {
+        if (!forest->tree[i_tree] && m <= ((long) KDT_FOREST_BASE << i_tree))
+            break;
+        if (forest->tree[i_tree])
+        {
+            m     += forest->tree[i_tree]->n_point;
+            n_all += tree_n_obj (forest->tree[i_tree]);
+        }
+    }
+
+    if (n_new == 0 || i_tree == KDT_FOREST_MAX_TREE)
+    {
+        free (all);
+        return n_new == 0? 0: -2;
+    }
+
+    masked = (void **) malloc ((m - n_new + 1) * sizeof (void *));
+    if (!masked || (all_new = (void **) realloc (all, n_all * sizeof (void *))) == NULL)
+    {
+        free (all);
+        free (masked);
+        return -1;
+    }
+    all = all_new;
+
+    m        = n_new;
+    n_masked = 0;
+    for (j = 0; j < i_tree; j++)
+        if (forest->tree[j])
+            m += forest_take_points (forest, j, all + m, masked, &n_masked);
+
+    forest->tree[i_tree] = kdtree_opt (all, m, forest->k, forest->getvec, &forest->opt);
+    forest_count (forest);
+
+    /* The new tree has no flags yet.*/
+    res = forest->tree[i_tree]? kdt_forest_mask (forest, masked, n_masked, true): -1;
+
+    free (all);
+    free (masked);
+
+    return res;
+}
+
+/* kdt_forest_delete: Delete n objects from a forest. Deleting an object lowers its multiplicity; at
+ *                    zero the point is deleted. Objects that are not in the forest are skipped.
+ *                    When more than half of the points in the trees are deleted, the forest is rebuilt.
+ * Returns: 0, or -1 when out of memory.
+ */
+int kdt_forest_delete (Tkdt_forest *forest, void *obj[], long n)
+{
+    void   **all, **masked;
+    long   i, pt, m, n_masked;
+    int    j;
+
+    for (i = 0; i < n; i++)
+        if ((j = forest_find_obj (forest, obj[i], &pt)) >= 0 && --forest->tree[j]->mult[pt] == 0)
+        {
+            forest->tree[j]->flag[pt] |= KDT_FLAG_DELETED;
+            forest->n_point--;
+            forest->n_deleted++;
+        }
+
+    if (forest->n_deleted <= forest->n_point)
+        return 0;
+
+    /* Rebuild: take out all points, and insert them again.*/
+    m = 1;
+    for (j = 0; j < KDT_FOREST_MAX_TREE; j++)
+        if (forest->tree[j])
+            m += tree_n_obj (forest->tree[j]);
+
+    all    = (void **) malloc (m * sizeof (void *));
+    masked = (void **) malloc ((forest->n_point + 1) * sizeof (void *));
+    if (!all || !masked)
+    {
+        free (all);
+        free (masked);
+        return -1;
+    }
+
+    m        = 0;
+    n_masked = 0;
+    for (j = 0; j < KDT_FOREST_MAX_TREE; j++)
+        if (forest->tree[j])
+            m += forest_take_points (forest, j, all + m, masked, &n_masked);
+
+    forest->n_point = 0;
+    if ((i = kdt_forest_insert (forest, all, m)) == 0)
+        i = kdt_forest_mask (forest, masked, n_masked, true);
+
+    free (all);
+    free (masked);
+    return (int) i;
+}
+
+/* kdt_forest_mask: Mask (mask true) or unmask n objects of a forest. Searches skip masked points, e.g.
+ *                  the held-out fold of a cross validation, so one forest can serve all folds.
+ *                  Unmasking an object that is not in the forest inserts it.
+ * Returns: 0, or the error of kdt_forest_insert.
+ */
+int kdt_forest_mask (Tkdt_forest *forest, void *obj[], long n, bool mask)
+{
+    void **ins = NULL;
+    long i, pt, n_ins = 0;
+    int  j, res = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if ((j = forest_find_obj (forest, obj[i], &pt)) >= 0)
+        {
+            if (mask)
+                forest->tree[j]->flag[pt] |= KDT_FLAG_MASKED;
+            else
+                forest->tree[j]->flag[pt] &= ~KDT_FLAG_MASKED;
+        }
+        else if (!mask)
+        {
+            if (!ins && (ins = (void **) malloc (n * sizeof (void *))) == NULL)
+                return -1;
+            ins[n_ins++] = obj[i];
+        }
+    }
+
+    if (n_ins > 0)
+        res = kdt_forest_insert (forest, ins, n_ins);
+
+    free (ins);
+    return res;
+}
+
+/* forest_trees: Put the trees of a forest in tree, the largest first: they give a small radius soonest.
+ * Returns: the number of trees.
+ */
+static int forest_trees (const Tkdt_forest *forest, const Tkdt **tree)
+{
+    int i, n_tree = 0;
+
+    if (forest)
+        for (i = KDT_FOREST_MAX_TREE - 1; i >= 0; i--)
+            if (forest->tree[i])
+                tree[n_tree++] = forest->tree[i];
+
+    return n_tree;
+}
+
+/* kdt_forest_nn_r: kdt_nn_r on all trees of a forest together. forest may be NULL.*/
+int kdt_forest_nn_r (Tkdt_search *srch, void *tgob, const Tkdt_forest *forest, int k, int n,
+                     void *rs[], double *sqdst,
+                     double * (*getvec)(void *), bool (*exclude)(void *, void *),
+                     bool object_only_once)
+{
+    const Tkdt *tree[KDT_FOREST_MAX_TREE];
+    int        n_tree;
+
+    n_tree = forest_trees (forest, tree);
+
+    return nn_r (srch, tgob, tree, n_tree, k, n, rs, sqdst, getvec, exclude, object_only_once);
+}
+
+/* kdt_forest_nn_batch: kdt_nn_batch on all trees of a forest together. forest may be NULL.*/
+int kdt_forest_nn_batch (const Tkdt_search *srch, void *tgob[], long n_target, const Tkdt_forest *forest,
+                         int k, int n, void *rs[], double *sqdst, int *n_found,
+                         double * (*getvec)(void *), bool (*exclude)(void *, void *),
+                         bool object_only_once, int n_thread)
+{
+    const Tkdt *tree[KDT_FOREST_MAX_TREE];
+    int        n_tree;
+
+    n_tree = forest_trees (forest, tree);
+
+    return nn_batch (srch, tgob, n_target, tree, n_tree, k, n, rs, sqdst, n_found, getvec, exclude,
+                     object_only_once, n_thread);
+}
+
+int kdt_print (const Tkdt *tree, int32_t i_nd, int lvl)
+{
+    int i, j;
+    const TkdtNode *nd;
+    const double   *pv;
+
+    if (tree == NULL || i_nd < 0) return 0;
+    nd = tree->node + i_nd;
+    pv = tree->vec + (long) nd->pt * tree->k;
+    for (j = 0; j < nd->cnt; j++)
+    {
+        for (i = 0; i < lvl; i++) printf("  ");
+        printf("%d", nd->dm);
+        for (i = 0; i < tree->k; i++) printf(", %f", pv[i * nd->cnt + j]);
+        printf("\n");
+    }
     for (i = 0; i < lvl; i++) printf("  ");
     printf("l\n");
-    kdt_print (nd->l, k, lvl + 1);
+    kdt_print (tree, nd->l, lvl + 1);
     for (i = 0; i < lvl; i++) printf("  ");
     printf("r\n");
-    kdt_print (nd->r, k, lvl + 1);
+    kdt_print (tree, nd->r, lvl + 1);
     return 0;
 }
@@ -55,6 +55,8 @@ static struct s_log_addt l_log_addt;
 static struct s_log_dtlso l_log_dtlso;
 static struct s_log_dtlsan l_log_dtlsan;
 static struct s_log_dtlsav l_log_dtlsav;
+static struct s_log_nncal l_log_nncal;
+static struct s_log_tlschk l_log_tlschk;
 
 /* Attach meta definitions */
 ATTACH_META_BP(meta_bp, l_log_bp);
@@ -87,6 +89,8 @@ ATTACH_META_ADDT(meta_addt, l_log_addt);
 ATTACH_META_DTLSO(meta_dtlso, l_log_dtlso);
 ATTACH_META_DTLSAN(meta_dtlsan, l_log_dtlsan);
 ATTACH_META_DTLSAV(meta_dtlsav, l_log_dtlsav);
+ATTACH_META_NNCAL(meta_nncal, l_log_nncal);
+ATTACH_META_TLSCHK(meta_tlschk, l_log_tlschk);
 
 static Ttbl_rec *l_tbl_rec = NULL;
 
@@ -357,6 +361,8 @@ init_struct_lists (Trec_meta *rec_meta[], void *rec_struct[N_LOG_REC])
     rec_meta[meta_dtlso.rec_type] = &meta_dtlso;
     rec_meta[meta_dtlsan.rec_type] = &meta_dtlsan;
     rec_meta[meta_dtlsav.rec_type] = &meta_dtlsav;
+    rec_meta[meta_nncal.rec_type] = &meta_nncal;
+    rec_meta[meta_tlschk.rec_type] = &meta_tlschk;
 
     for (i = 0; i < N_LOG_REC; i++)
         rec_struct[i] = rec_meta[i]->rec; /*pointer to corresponding structure*/
@@ -15,6 +15,7 @@
 #include "mkembed.h"
 #include "log.h"
 #include "mkembed_log.h"
+#include "context.h"
 
 static int
 create_meta (Tembed *emb, Temb_lag_def *eld, Tfdat *fdat);
@@ -42,6 +43,7 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
     double  **addit_lag_mapper = NULL, *curr_addit_val;
     double  **bundle_mapper = NULL, *curr_bundle_val;
     long    **t_mapper, *curr_t_val, **t_pre_mapper, *curr_t_pre_val, **t_addit_mapper = NULL, *curr_t_addit_val, *curr_vec_num;
+    long    *curr_row = NULL;
     char    **id_mapper, *id_val, **curr_id, id_val_init[] = "1qDfx*()gV";
     bool    *use_in_lib_mapper, *use_in_pre_mapper, *curr_use_in_lib, *curr_use_in_pre;
 
@@ -57,6 +59,7 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
     emb->bundle_mat         = NULL;
     emb->addit_mat          = NULL;
     emb->t_co_mat           = NULL;
+    emb->view               = NULL;
     emb->t_pre_mat          = NULL;
     emb->t_addit_mat        = NULL;
     emb->id                 = NULL;
@@ -119,6 +122,25 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
         co_lag_mapper[i] = fdat->dat + (zero_begin_offset - emb->co_meta[i].lag) * fdat->n_col + var_no;
     }
 
+    /* With a view, the coordinates and their t values are not copied: only the source row of each vector
+     * is kept. The mappers of the coordinates are then only used to skip vectors with NA's.
+     */
+    if (g_context->mkembed.view)
+    {
+        emb->view         = (Temb_view *) calloc (1, sizeof (Temb_view));
+        emb->view->dat    = fdat->dat;
+        emb->view->t      = fdat->t;
+        emb->view->n_col  = fdat->n_col;
+        emb->view->e      = emb->e;
+        emb->view->co_off = (long *) malloc (emb->e * sizeof(long));
+        emb->view->t_off  = (long *) malloc (emb->e * sizeof(long));
+        for (i = 0; i < emb->e; i++)
+        {
+            emb->view->co_off[i] = -(long) emb->co_meta[i].lag * fdat->n_col + emb->co_meta[i].var_no;
+            emb->view->t_off[i]  = -emb->co_meta[i].lag;
+        }
+    }
+
     pre_lag_mapper = (double **) malloc (emb->n_pre_val * sizeof(double *));
     for (i = 0; i < emb->n_pre_val; i++)
     {
@@ -195,9 +217,22 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
 
         if (emb->n_row == rows_avail) /*end of available space reached, increase space*/
         {
-            emb->co_val_mat = (double *)
-                realloc (emb->co_val_mat, (rows_avail + rows_malloc) * emb->e * sizeof(double));
-            curr_co_val = emb->co_val_mat + emb->n_row * emb->e;
+            if (emb->view)
+            {
+                emb->view->row = (long *)
+                    realloc (emb->view->row, (rows_avail + rows_malloc) * sizeof(long));
+                curr_row = emb->view->row + emb->n_row;
+            }
+            else
+            {
+                emb->co_val_mat = (double *)
+                    realloc (emb->co_val_mat, (rows_avail + rows_malloc) * emb->e * sizeof(double));
+                curr_co_val = emb->co_val_mat + emb->n_row * emb->e;
+
+                emb->t_co_mat = (long *)
+                    realloc (emb->t_co_mat, (rows_avail + rows_malloc) * emb->e * sizeof(long));
+                curr_t_val = emb->t_co_mat + emb->n_row * emb->e;
+            }
 
             emb->pre_val_mat = (double *)
                 realloc (emb->pre_val_mat, (rows_avail + rows_malloc) * emb->n_pre_val * sizeof(double));
@@ -214,10 +249,6 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
                 curr_t_addit_val = emb->t_addit_mat + emb->n_row * emb->n_addit_val;
             }
 
-            emb->t_co_mat = (long *)
-                realloc (emb->t_co_mat, (rows_avail + rows_malloc) * emb->e * sizeof(long));
-            curr_t_val = emb->t_co_mat + emb->n_row * emb->e;
-
             emb->t_pre_mat = (long *)
                 realloc (emb->t_pre_mat, (rows_avail + rows_malloc) * emb->n_pre_val * sizeof(long));
             curr_t_pre_val = emb->t_pre_mat + emb->n_row * emb->n_pre_val;
@@ -271,11 +302,16 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
         }
 
 
-        for (j = 0; j < emb->e; j++)
-              *curr_co_val++ = *co_lag_mapper[j];
+        if (emb->view)
+            *curr_row++ = i + zero_begin_offset;
+        else
+        {
+            for (j = 0; j < emb->e; j++)
+                  *curr_co_val++ = *co_lag_mapper[j];
 
-        for (j = 0; j < emb->e; j++)
-            *curr_t_val++ = *t_mapper[j];
+            for (j = 0; j < emb->e; j++)
+                *curr_t_val++ = *t_mapper[j];
+        }
 
         for (j = 0; j < emb->n_pre_val; j++)
             *curr_t_pre_val++ = *t_pre_mapper[j];
@@ -353,10 +389,25 @@ create_embed (Tfdat *fdat, Temb_lag_def *eld, int emb_num)
     return emb;
 }
 
+/* set_embed_view: With view true, create_embed does not copy the coordinates of the vectors and their t values
+ *                 into co_val_mat and t_co_mat, the points read them from the time series data (see Temb_view).
+ *                 This saves the memory of e values and t values per vector, at the price of a gather where
+ *                 the coordinates are used. The time series data then has to be kept until free_embed.
+ *                 Default false.
+ */
+int
+set_embed_view (bool view)
+{
+    g_context->mkembed.view = view;
+
+    return 0;
+}
+
 char *
 emb_label_add_lag (char *emb_label, char *var_name, int lag, bool first_of_group)
 {
     static char *prev_var_name = NULL;
+#pragma omp threadprivate(prev_var_name)
     char aint[15];
 
     if (!emb_label)
@@ -553,6 +604,13 @@ free_embed (Tembed *emb)
     if (emb->t_addit_mat) free (emb->t_addit_mat);
 
     if (emb->co_val_mat) free (emb->co_val_mat);
+    if (emb->view)
+    {
+        if (emb->view->co_off) free (emb->view->co_off);
+        if (emb->view->t_off) free (emb->view->t_off);
+        if (emb->view->row) free (emb->view->row);
+        free (emb->view);
+    }
     if (emb->pre_val_mat) free (emb->pre_val_mat);
     if (emb->addit_mat) free (emb->addit_mat);
     if (emb->bundle_mat) free (emb->bundle_mat);
@@ -683,7 +741,8 @@ log_emb_vec (Tembed *emb)
     int i, j;
 
     char    **id;
-    long    *t, *t_pre, *t_addit, *vec_num;
+    long    *t, *t_pre, *t_addit, *vec_num, *row;
+    const double *co_dat;
     double  *co_val, *pre_val, *addit_val, *bundle_val;
     bool    *use_in_lib, *use_in_pre;
     static struct s_log_vid log_vid;
@@ -710,6 +769,7 @@ log_emb_vec (Tembed *emb)
     use_in_lib = emb->use_in_lib;
     use_in_pre = emb->use_in_pre;
     vec_num    = emb->vec_num;
+    row        = emb->view? emb->view->row: NULL;
 
     for (i = 0; i < emb->n_row; i++)
     {
@@ -724,16 +784,32 @@ log_emb_vec (Tembed *emb)
         if (use_in_lib) use_in_lib++;
         if (use_in_pre) use_in_pre++;
 
-        for (j = 0; j < emb->e; j++)
+        if (row)
         {
-            log_val.copr    = 'C';
-            log_val.idx     = j;
-            log_val.t       = *t;
-            log_val.val     = *co_val;
-            LOGREC(LOG_VAL, &log_val, sizeof (log_val), &meta_log_val);
-
-            t++;
-            co_val++;
+            co_dat = emb->view->dat + *row * emb->view->n_col;
+            for (j = 0; j < emb->e; j++)
+            {
+                log_val.copr    = 'C';
+                log_val.idx     = j;
+                log_val.t       = emb->view->t[*row + emb->view->t_off[j]];
+                log_val.val     = co_dat[emb->view->co_off[j]];
+                LOGREC(LOG_VAL, &log_val, sizeof (log_val), &meta_log_val);
+            }
+            row++;
+        }
+        else
+        {
+            for (j = 0; j < emb->e; j++)
+            {
+                log_val.copr    = 'C';
+                log_val.idx     = j;
+                log_val.t       = *t;
+                log_val.val     = *co_val;
+                LOGREC(LOG_VAL, &log_val, sizeof (log_val), &meta_log_val);
+
+                t++;
+                co_val++;
+            }
         }
 
         for (j = 0; j < emb->n_pre_val; j++)
@@ -7,12 +7,65 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "point.h"
 
+/* Coordinates of the last point of get_co_vec with a view, per thread.*/
+static double *l_co_buf = NULL;
+static int    l_n_co_buf = 0;
+#pragma omp threadprivate(l_co_buf, l_n_co_buf)
+
+/* get_co_vec: The coordinates of point. With a view they are gathered into a buffer of the calling
+ *             thread, which the next call overwrites: the kd tree functions use them before that.
+ */
 double *
 get_co_vec (Tpoint *point)
 {
-    return point->co_val;
+    if (!point->view)
+        return point->co_val;
+
+    if (l_n_co_buf < point->view->e)
+    {
+        free (l_co_buf);
+        l_n_co_buf = point->view->e;
+        if ((l_co_buf = (double *) malloc (l_n_co_buf * sizeof (double))) == NULL)
+        {
+            l_n_co_buf = 0;
+            return NULL;
+        }
+    }
+
+    return point_co_val (point, l_co_buf);
+}
+
+/* point_co_val: The coordinates of point: its row in the co_val matrix, or with a view a copy in buf
+ *               (size e).
+ */
+double *
+point_co_val (Tpoint *point, double *buf)
+{
+    const Temb_view *view = point->view;
+    const double    *dat;
+    int             j;
+
+    if (!view)
+        return point->co_val;
+
+    dat = view->dat + point->row * view->n_col;
+    for (j = 0; j < view->e; j++)
+        buf[j] = dat[view->co_off[j]];
+
+    return buf;
+}
+
+/* point_t: The t value of coordinate j of point.*/
+long
+point_t (const Tpoint *point, int j)
+{
+    if (point->view)
+        return point->view->t[point->row + point->view->t_off[j]];
+
+    return point->t[j];
 }
 
 long *
@@ -27,44 +80,56 @@ get_pre_vec (Tpoint *point)
     return point->pre_val;
 }
 
-static Texcl l_excl;
-static int   l_var_win;
-static int   l_e;
+/* The exclusion setting of the calling thread, which traverses one embedding at a time (see traverse_all).
+ * The threads that search the neighbours for it get it as the argument of the exclude function of the
+ * search (see kdt_search_exclude).
+ */
+static Texcl_setting l_excl;
+#pragma omp threadprivate(l_excl)
 
 int 
 exclude_init (Texcl excl, int var_win, int e)
 {
-    l_excl    = excl;
-    l_var_win = var_win;
-    l_e       = e;
+    l_excl.excl    = excl;
+    l_excl.var_win = var_win;
+    l_excl.e       = e;
 
     return 0;
 }
 
+/* exclude_setting: The exclusion setting that exclude_init made in the calling thread.*/
+const Texcl_setting *
+exclude_setting (void)
+{
+    return &l_excl;
+}
+
 bool 
-exclude (Tpoint *tg, Tpoint *cd)  /*exclude candidate from prediction set for target?*/
+exclude (Tpoint *tg, Tpoint *cd, const Texcl_setting *excl)  /*exclude candidate from prediction set for target?*/
 {
-    if (tg->co_val == cd->co_val)
+    if (tg->vec_num == cd->vec_num)
         return true;
 
 #if 0
-    if ( (l_excl & (T_EXCL_TIME_COORD + T_EXCL_TIME_WIN + T_EXCL_SELF)) &&
+    if ( (excl->excl & (T_EXCL_TIME_COORD + T_EXCL_TIME_WIN + T_EXCL_SELF)) &&
             tg == cd)
         return true;
 #endif
 
-    if (l_excl & T_EXCL_TIME_COORD)
+    if (excl->excl & T_EXCL_TIME_COORD)
     {
         /*exclude if vectors share time coordinates*/
-        long *t_tg, *t_cd;
+        long  t_tg;
+        int   i, j;
         short *vn_tg, *vn_cd;
         vn_tg = tg->co_var_num;
-        for (t_tg = tg->t; t_tg < tg->t + l_e; t_tg++)
+        for (i = 0; i < excl->e; i++)
         {
+            t_tg  = point_t (tg, i);
             vn_cd = cd->co_var_num;
-            for (t_cd = cd->t; t_cd < cd->t + l_e; t_cd++)
+            for (j = 0; j < excl->e; j++)
             {
-                if (*t_tg == *t_cd && *vn_tg == *vn_cd)
+                if (t_tg == point_t (cd, j) && *vn_tg == *vn_cd)
                     return true;
                 vn_cd++;
             }
@@ -72,16 +137,100 @@ exclude (Tpoint *tg, Tpoint *cd)  /*exclude candidate from prediction set for ta
         }
     }
 
-    if(l_excl & T_EXCL_TIME_WIN)
+    if(excl->excl & T_EXCL_TIME_WIN)
     {
         /*exclude if vectors are too close in time*/
-        if (abs ((int)((*tg->t) - (*cd->t))) < l_var_win)
+        if (abs ((int)(point_t (tg, 0) - point_t (cd, 0))) < excl->var_win)
             return true;
     }
 
     return false;
 }
 
+/* exclude_get_key: The EXCL_N_KEY keys of a point, to which the windows of exclude_get_win apply.*/
+void
+exclude_get_key (Tpoint *pt, long *key)
+{
+    key[0] = point_t (pt, 0);
+    key[1] = pt->vec_num;
+}
+
+/* exclude_get_win: Exclusion windows for the keys of exclude_get_key: a candidate is excluded when
+ *                  |key[i] - key[i] of target| < win[i] for some i. A window <= 0 excludes nothing.
+ *                  The window on vec_num excludes the target itself (same vector).
+ * Returns: true when the windows are the complete exclusion of setting excl, false when
+ *          exclude still has to be called (T_EXCL_TIME_COORD).
+ */
+bool
+exclude_get_win (const Texcl_setting *excl, long *win)
+{
+    win[0] = (excl->excl & T_EXCL_TIME_WIN)? excl->var_win: 0;
+    win[1] = 1;
+
+    return !(excl->excl & T_EXCL_TIME_COORD);
+}
+
+/* point_set_pack: The packed copy of the points of set. It is made at the first call for a set, and kept
+ *                 (in set->pack) until the set functions change the points of the set.
+ * Returns: NULL when out of memory.
+ */
+Tpoint_pack *
+point_set_pack (Tpoint_set *set)
+{
+    Tpoint_pack *pack;
+    Tpoint      *pt;
+    long        i;
+
+    if (set->pack)
+        return set->pack;
+
+    if ((pack = (Tpoint_pack *) malloc (sizeof (Tpoint_pack))) == NULL)
+        return NULL;
+
+    pack->n_point = set->n_point;
+    pack->co_val  = (double *) malloc ((set->n_point * set->e + 1) * sizeof (double));
+    pack->pre_val = (double *) malloc ((set->n_point * set->n_pre_val + 1) * sizeof (double));
+    pack->key     = (long *) malloc ((set->n_point * EXCL_N_KEY + 1) * sizeof (long));
+
+    if (!pack->co_val || !pack->pre_val || !pack->key)
+    {
+        set->pack = pack;
+        point_set_unpack (set);
+        return NULL;
+    }
+
+    for (i = 0; i < set->n_point; i++)
+    {
+        pt = set->point[i];
+        if (pt->view)
+            point_co_val (pt, pack->co_val + i * set->e);
+        else
+            memcpy (pack->co_val + i * set->e, pt->co_val, set->e * sizeof (double));
+        memcpy (pack->pre_val + i * set->n_pre_val, pt->pre_val, set->n_pre_val * sizeof (double));
+        exclude_get_key (pt, pack->key + i * EXCL_N_KEY);
+    }
+
+    set->pack = pack;
+    return pack;
+}
+
+/* point_set_unpack: Free the packed copy of the points of set, if there is one.*/
+void
+point_set_unpack (Tpoint_set *set)
+{
+    if (!set || !set->pack)
+        return;
+
+    if (set->pack->co_val)
+        free (set->pack->co_val);
+    if (set->pack->pre_val)
+        free (set->pack->pre_val);
+    if (set->pack->key)
+        free (set->pack->key);
+    free (set->pack);
+    set->pack = NULL;
+}
+
 int compare_point_vec_num (const void *a, const void *b)
 {
     Tpoint **x = (Tpoint **) a;
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2022 Roelof Bart Toonen
+ * License: MIT license (spdx.org MIT)
+ *
+ * Random number generators, see rng.h.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "rng.h"
+
+#define RNG_GAMMA 0x9e3779b97f4a7c15ULL
+
+/* mix64: The finalizer of splitmix64, a bijection of 64 bit values with good avalanche.*/
+static uint64_t
+mix64 (uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* libc_next: The next value of RNG_LIBC, in 0 .. 2^31 - 1 (random_r of glibc with TYPE_3).*/
+static long
+libc_next (Trng *rng)
+{
+    uint32_t val;
+
+    val = rng->libc_r[rng->libc_f] += rng->libc_r[rng->libc_b];
+
+    if (++rng->libc_f >= RNG_LIBC_DEG)
+        rng->libc_f = 0;
+    if (++rng->libc_b >= RNG_LIBC_DEG)
+        rng->libc_b = 0;
+
+    return (long) (val >> 1);  /*the lowest bit is the least random*/
+}
+
+/* libc_seed: Start RNG_LIBC as srandom_r of glibc: the state by a linear congruential generator, then
+ *            10 * RNG_LIBC_DEG values discarded.
+ */
+static void
+libc_seed (Trng *rng, unsigned int seed)
+{
+    int32_t word;
+    long    hi, lo;
+    int     i;
+
+    if (seed == 0)
+        seed = 1;
+
+    rng->libc_r[0] = seed;
+    word = (int32_t) seed;  /*negative for seeds from 2^31, as in glibc*/
+    for (i = 1; i < RNG_LIBC_DEG; i++)
+    {
+        hi   = word / 127773;
+        lo   = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0)
+            word += 2147483647;
+        rng->libc_r[i] = (uint32_t) word;
+    }
+
+    rng->libc_f = RNG_LIBC_SEP;
+    rng->libc_b = 0;
+    for (i = 0; i < 10 * RNG_LIBC_DEG; i++)
+        libc_next (rng);
+}
+
+/* rng_init: Initialize the generator rng of kind kind with seed, at the start of stream 0.*/
+void
+rng_init (Trng *rng, Trng_kind kind, uint64_t seed)
+{
+    rng->kind = kind;
+    rng->seed = seed;
+
+    if (kind == RNG_LIBC)
+        libc_seed (rng, (unsigned int) seed);
+
+    rng_stream (rng, 0, NULL);
+}
+
+/* rng_stream: Start the stream identified by the seed and the n_id values of id.*/
+void
+rng_stream (Trng *rng, int n_id, const long *id)
+{
+    uint64_t key;
+    int      i;
+
+    if (rng->kind != RNG_COUNTER)
+        return;
+
+    key = mix64 (rng->seed + RNG_GAMMA);
+    for (i = 0; i < n_id; i++)
+        key = mix64 (key ^ ((uint64_t) id[i] + RNG_GAMMA));
+
+    rng->key = key;
+    rng->ctr = 0;
+}
+
+static uint64_t
+rng_next (Trng *rng)
+{
+    rng->ctr++;
+    return mix64 (mix64 (rng->key + rng->ctr * RNG_GAMMA) ^ rng->key);
+}
+
+/* rng_uniform: A random number in 0 .. n-1 (n > 0).
+ *              RNG_COUNTER: without bias, values in the lowest part of the range that would favour the
+ *              smaller numbers are skipped. RNG_LIBC: as rand () % n.
+ */
+long
+rng_uniform (Trng *rng, long n)
+{
+    uint64_t r, min;
+
+    if (rng->kind == RNG_LIBC)
+        return libc_next (rng) % n;
+
+    min = -(uint64_t) n % (uint64_t) n;  /*2^64 mod n*/
+    do
+        r = rng_next (rng);
+    while (r < min);
+
+    return (long) (r % (uint64_t) n);
+}
@@ -14,10 +14,16 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "embed.h"
 #include "bundle.h"
 #include "point.h"
+#include "context.h"
+#include "rng.h"
 #include "sets.h"
 #include "log.h"
 #include "sets_log.h"
@@ -26,16 +32,31 @@
 static Tembed        *l_emb;
 static Tpoint        *l_all_points = NULL;
 static int           l_set_num;
+static int           l_bundle_num;
 static long          l_n_points = 0;  /*Fix -Walloc_size.. warning of gcc*/
 
 static Tpoint      **l_rnd_point_twice = NULL;
 static Tpoint      **l_all_point_twice = NULL;
 static Tpoint      **l_all_point_rnd   = NULL;
+static Tpoint      **l_tree_point      = NULL;  /*library of the previous set, the points in its kd tree*/
+static long        l_n_tree_point    = 0;
+static long        *l_point_cnt      = NULL;  /*per point: scratch for update_lib_tree*/
+static Tpoint      **l_masked_point  = NULL;  /*points that are masked in the kd tree of the library*/
+static long        l_n_masked_point  = 0;
 
 static Tpoint_set  *l_lib_set, *l_pre_set;
 
 static short       *l_co_var_num = NULL;
 
+static Trng        l_rng;
+
+/* The state of the set functions is per thread, so that traverse_all can handle several embeddings at
+ * once. The parameters of the init functions are in the context (see context.h).
+ */
+#pragma omp threadprivate(l_emb, l_all_points, l_set_num, l_bundle_num, l_n_points, l_rnd_point_twice, l_all_point_twice, \
+                          l_all_point_rnd, l_tree_point, l_n_tree_point, l_point_cnt, l_masked_point, \
+                          l_n_masked_point, l_lib_set, l_pre_set, l_co_var_num, l_rng)
+
 int
 new_sets_convergent_lib (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set, Tpoint_set **pre_set);
 
@@ -110,7 +131,8 @@ free_sets (void)
     if (l_lib_set)
     {
         if (l_lib_set->tx)
-            free_kdt (l_lib_set->tx);
+            free_kdt_forest (l_lib_set->tx);
+        point_set_unpack (l_lib_set);
     
         free (l_lib_set);
         l_lib_set = NULL;
@@ -118,6 +140,7 @@ free_sets (void)
 
     if (l_pre_set)
     {
+        point_set_unpack (l_pre_set);
         free (l_pre_set);
         l_pre_set = NULL;
     }
@@ -146,6 +169,26 @@ free_sets (void)
         l_co_var_num = NULL;
     }
 
+    if (l_tree_point)
+    {
+        free (l_tree_point);
+        l_tree_point = NULL;
+    }
+    l_n_tree_point = 0;
+
+    if (l_point_cnt)
+    {
+        free (l_point_cnt);
+        l_point_cnt = NULL;
+    }
+
+    if (l_masked_point)
+    {
+        free (l_masked_point);
+        l_masked_point = NULL;
+    }
+    l_n_masked_point = 0;
+
     return 0;
 }
 
@@ -180,7 +223,7 @@ static int
 make_sets (Tembed *emb, Tbundle_set *bundle_set)
 {
     char   **id;
-    long   *t, *t_pre, *vec_num;
+    long   *t, *t_pre, *vec_num, *row;
     double *co_val, *pre_val, *addit_val;
     bool   *use_in_lib, *use_in_pre;
     Tpoint *point;
@@ -193,6 +236,7 @@ make_sets (Tembed *emb, Tbundle_set *bundle_set)
         return -2;
 
     l_emb = emb;
+    l_bundle_num = bundle_set? bundle_set->bundle_num: 0;
 
     /* create new array with all points */
     l_n_points = bundle_set? bundle_set->n_idx: emb->n_row;
@@ -208,6 +252,7 @@ make_sets (Tembed *emb, Tbundle_set *bundle_set)
     use_in_lib   = emb->use_in_lib;
     use_in_pre   = emb->use_in_pre;
     addit_val    = emb->addit_mat;
+    row          = emb->view? emb->view->row: NULL;
 
     n_pre_val    = emb->n_pre_val;
     e            = emb->e;
@@ -229,9 +274,11 @@ make_sets (Tembed *emb, Tbundle_set *bundle_set)
             point->use_in_pre = use_in_pre? *(use_in_pre + idx): true;
             point->vec_num    = *(vec_num + idx);
             point->id         = id? *(id + idx): NULL;
-            point->t          = t + idx * e;
+            point->t          = t? t + idx * e: NULL;
             point->t_pre      = t_pre + idx * n_pre_val;
-            point->co_val     = co_val + idx * e;
+            point->co_val     = co_val? co_val + idx * e: NULL;
+            point->view       = emb->view;
+            point->row        = row? row[idx]: 0;
             point->pre_val    = pre_val + idx * n_pre_val;
             point->co_var_num = l_co_var_num;
             point->addit_val  = addit_val ? addit_val + idx * n_addit_val: NULL;
@@ -250,6 +297,8 @@ make_sets (Tembed *emb, Tbundle_set *bundle_set)
             point->t          = t;
             point->t_pre      = t_pre;
             point->co_val     = co_val;
+            point->view       = emb->view;
+            point->row        = row? *row++: 0;
             point->pre_val    = pre_val;
             point->co_var_num = l_co_var_num;
             point->addit_val  = addit_val? addit_val: NULL;
@@ -258,9 +307,9 @@ make_sets (Tembed *emb, Tbundle_set *bundle_set)
             vec_num++;
             if (use_in_lib) use_in_lib++;
             if (use_in_pre) use_in_pre++;
-            t       += e;
+            if (t) t += e;
             t_pre   += n_pre_val;
-            co_val  += e;
+            if (co_val) co_val += e;
             pre_val += n_pre_val;
             if (addit_val) addit_val += n_addit_val;
         }
@@ -282,6 +331,7 @@ init_set (Tembed *emb)
     set->set_num     = -1;
     set->n_addit_val = emb->n_addit_val;
     set->tx          = NULL;
+    set->pack        = NULL;
 
     return set;
 }
@@ -296,6 +346,51 @@ shrink_points (Tpoint_set *set, long n)
 }
 
 
+/* set_sets_rng: The random number generator for the sets, and its seed. Default RNG_LIBC with seed 1,
+ *               which gives the sets of the versions that used rand () (with glibc).
+ *               RNG_COUNTER gives other sets, which do not depend on the order in which they are made,
+ *               so that bootstrap replicates can be made in several threads (see set_bootstrap_n_thread).
+ */
+int
+set_sets_rng (Trng_kind kind, unsigned long seed)
+{
+    g_context->sets.rng_kind = kind;
+    g_context->sets.rng_seed = seed;
+
+    return 0;
+}
+
+/* set_rng_set: Use the random numbers of set set_num. With the counter based generator each set of an
+ *              embedding and bundle has a stream of its own, so its random numbers do not depend on the
+ *              draws for the sets before it.
+ */
+static void
+set_rng_set (int set_num)
+{
+    long id[3];
+
+    id[0] = l_emb->emb_num;
+    id[1] = l_bundle_num;
+    id[2] = set_num;
+    rng_stream (&l_rng, 3, id);
+}
+
+/* set_rng_start: Start the random numbers for the sets of the embedding and bundle of make_sets, with the
+ *                generator and seed of the context.
+ */
+static void
+set_rng_start (void)
+{
+    rng_init (&l_rng, g_context->sets.rng_kind, g_context->sets.rng_seed);
+    set_rng_set (0);
+}
+
+static long
+set_rand (long n)
+{
+    return rng_uniform (&l_rng, n);
+}
+
 static int
 shuffle (int n, int *values)
 {
@@ -303,7 +398,7 @@ shuffle (int n, int *values)
 
     for (i = n - 1; i > 0; i--)
     {
-        j = rand() % (i + 1); /*skewed, but will do*/
+        j = set_rand (i + 1);
         swap = values[i];
         values[i] = values[j];
         values[j] = swap;
@@ -333,24 +428,25 @@ fill_rnd_point_twice (Tpoint ** rnd_point_twice, Tpoint *all_points, int n_point
 }
 
 /* convergence graph methods *******************************************/
-static long             l_lib_size_min, l_lib_size_max, l_lib_inc, l_lib_inc_start, l_n_bootstrap;
-static float            l_lib_inc_inc_factor, l_f_lib_inc;
-static Tlib_shift_meth  l_lib_shift_meth;
-static long             l_lib_size = 0, l_lib_shift = 0, l_shift, l_i_boot = 0;
+static long             l_lib_inc;
+static float            l_f_lib_inc;
+static long             l_lib_size = 0, l_shift, l_i_boot = 0;
+static long             l_lib_size_end;  /*lib_size_max of the context, or the number of points when that is smaller*/
 static int              l_permut_swaps;
+#pragma omp threadprivate(l_lib_inc, l_f_lib_inc, l_lib_size, l_shift, l_i_boot, l_lib_size_end, l_permut_swaps)
 
 int
 init_set_convergent_lib (int lib_size_min, int lib_size_max, int lib_inc, float lib_inc_inc_factor,
                          Tlib_shift_meth lib_shift_meth, int lib_shift, int n_bootstrap,
                          Tnew_sets *new_sets, Tnext_set *next_set, Tfree_set *free_set)
 {
-    l_lib_size_min       = lib_size_min;
-    l_lib_size_max       = lib_size_max;
-    l_lib_inc_start      = lib_inc < 1? 1: lib_inc;
-    l_lib_inc_inc_factor = lib_inc_inc_factor;
-    l_lib_shift_meth     = lib_shift_meth;
-    l_lib_shift          = lib_shift < 1? 1: lib_shift;
-    l_n_bootstrap        = n_bootstrap > 0? n_bootstrap: 1;
+    g_context->sets.lib_size_min       = lib_size_min;
+    g_context->sets.lib_size_max       = lib_size_max;
+    g_context->sets.lib_inc_start      = lib_inc < 1? 1: lib_inc;
+    g_context->sets.lib_inc_inc_factor = lib_inc_inc_factor;
+    g_context->sets.lib_shift_meth     = lib_shift_meth;
+    g_context->sets.lib_shift          = lib_shift < 1? 1: lib_shift;
+    g_context->sets.n_bootstrap        = n_bootstrap > 0? n_bootstrap: 1;
 
     *new_sets = &new_sets_convergent_lib;
     *next_set = &next_set_convergent_lib;
@@ -359,7 +455,75 @@ init_set_convergent_lib (int lib_size_min, int lib_size_max, int lib_inc, float
     return 0;
 }
 
+/* update_lib_tree: Bring the kd tree of the library, when the prediction function has made one, up to
+ *                  date, by deleting the points that left the library and inserting the new points.
+ *                  When more than half of the library changed, the tree is freed instead, and the
+ *                  prediction function builds a new one.
+ */
+static int
+update_lib_tree (void)
+{
+    Tpoint **del, **ins;
+    long   i, j, idx, n_del = 0, n_ins = 0;
+
+    if (l_lib_set->tx)
+    {
+        /* Count per point how many times more it was in the previous library than in this one.*/
+        for (i = 0; i < l_n_tree_point; i++)
+            l_point_cnt[l_tree_point[i] - l_all_points]++;
+        for (i = 0; i < l_lib_set->n_point; i++)
+            l_point_cnt[l_lib_set->point[i] - l_all_points]--;
+
+        for (idx = 0; idx < l_n_points; idx++)
+        {
+            if (l_point_cnt[idx] > 0)
+                n_del += l_point_cnt[idx];
+            else
+                n_ins -= l_point_cnt[idx];
+        }
+
+        del = ins = NULL;
+        if (n_del + n_ins <= l_lib_set->n_point / 2)
+        {
+            del = (Tpoint **) malloc ((n_del + 1) * sizeof (Tpoint *));
+            ins = (Tpoint **) malloc ((n_ins + 1) * sizeof (Tpoint *));
+        }
+
+        if (del && ins)
+        {
+            n_del = n_ins = 0;
+            for (idx = 0; idx < l_n_points; idx++)
+            {
+                for (j = 0; j < l_point_cnt[idx]; j++)
+                    del[n_del++] = l_all_points + idx;
+                for (j = 0; j > l_point_cnt[idx]; j--)
+                    ins[n_ins++] = l_all_points + idx;
+            }
+        }
+
+        if (!del || !ins ||
+            kdt_forest_delete (l_lib_set->tx, (void **) del, n_del) < 0 ||
+            kdt_forest_insert (l_lib_set->tx, (void **) ins, n_ins) < 0)
+        {
+            free_kdt_forest (l_lib_set->tx);
+            l_lib_set->tx = NULL;
+        }
+
+        if (del)
+            free (del);
+        if (ins)
+            free (ins);
+        memset (l_point_cnt, 0, l_n_points * sizeof (long));
+    }
+
+    memcpy (l_tree_point, l_lib_set->point, l_lib_set->n_point * sizeof (Tpoint *));
+    l_n_tree_point = l_lib_set->n_point;
+
+    return 0;
+}
+
 static long l_old_lib_size;
+#pragma omp threadprivate(l_old_lib_size)
 int
 new_sets_convergent_lib (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set, Tpoint_set **pre_set)
 {
@@ -371,28 +535,29 @@ new_sets_convergent_lib (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_
         return -1;
     }
 
-    if (l_lib_size_min > l_n_points && l_n_bootstrap != 1)
+    if (g_context->sets.lib_size_min > l_n_points && g_context->sets.n_bootstrap != 1)
     {
         free_sets_convergent_lib ();
         return -2;
     }
 
-    if (l_lib_size_min > l_lib_size_max)
+    if (g_context->sets.lib_size_min > g_context->sets.lib_size_max)
     {
         free_sets_convergent_lib ();
         return -3;
     }
 
-    srand(1);
+    set_rng_start ();
 
-    l_lib_size = l_lib_size_min;
+    l_lib_size = g_context->sets.lib_size_min;
+    l_lib_size_end = g_context->sets.lib_size_max;
     l_shift    = 0;
     l_i_boot   = 0;
     l_set_num  = 0;
     l_old_lib_size = -1;
 
-    l_f_lib_inc = l_lib_inc_start;
-    l_lib_inc   = l_lib_inc_start;
+    l_f_lib_inc = g_context->sets.lib_inc_start;
+    l_lib_inc   = g_context->sets.lib_inc_start;
 
     l_pre_set = init_set (emb);
     l_pre_set->point = (Tpoint **) malloc (l_n_points * sizeof (Tpoint *));
@@ -402,7 +567,11 @@ new_sets_convergent_lib (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_
 
     l_lib_set = init_set (emb);
 
-    switch (l_lib_shift_meth)
+    l_tree_point   = (Tpoint **) malloc ((l_lib_size_end > l_n_points? l_lib_size_end: l_n_points) * sizeof (Tpoint *));
+    l_n_tree_point = 0;
+    l_point_cnt    = (long *) calloc (l_n_points, sizeof (long));
+
+    switch (g_context->sets.lib_shift_meth)
     {
         case LIB_SHIFT_RANDOM:
             l_rnd_point_twice = (Tpoint **) calloc (2 * l_n_points, sizeof (Tpoint *));
@@ -417,19 +586,19 @@ new_sets_convergent_lib (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_
             l_lib_set->n_point = l_lib_size;
             break;
         case LIB_SHIFT_BOOTSTRAP:
-            l_all_point_rnd = (Tpoint **) calloc (l_lib_size_max, sizeof (Tpoint *));
+            l_all_point_rnd = (Tpoint **) calloc (l_lib_size_end, sizeof (Tpoint *));
             l_lib_set->point = l_all_point_rnd;
             l_lib_set->n_point = l_lib_size;
             break;
         case LIB_SHIFT_BOOT_PERMUT:
-            if (l_lib_size_max > l_n_points)
-                l_lib_size_max = l_n_points;
+            if (l_lib_size_end > l_n_points)
+                l_lib_size_end = l_n_points;
             l_all_point_rnd = (Tpoint **) calloc (l_n_points, sizeof (Tpoint *));
             l_lib_set->point = l_all_point_rnd;
             l_lib_set->n_point = l_lib_size;
             for (i = 0; i < l_n_points; i++)
                 l_all_point_rnd[i] = l_all_points + i;
-            /*l_permut_swaps = l_lib_size / log ((double) l_n_bootstrap);*/
+            /*l_permut_swaps = l_lib_size / log ((double) g_context->sets.n_bootstrap);*/
             l_permut_swaps = l_lib_size / 2 + 1;
             break;
     }
@@ -447,43 +616,34 @@ next_set_convergent_lib ()
     long   l;
     Tpoint *sav_point;
 
-    if ( ((l_lib_shift_meth == LIB_SHIFT_RANDOM || l_lib_shift_meth == LIB_SHIFT_SHIFT) &&
+    if ( ((g_context->sets.lib_shift_meth == LIB_SHIFT_RANDOM || g_context->sets.lib_shift_meth == LIB_SHIFT_SHIFT) &&
           l_shift >= l_n_points) ||
-         ((l_lib_shift_meth == LIB_SHIFT_BOOTSTRAP || l_lib_shift_meth == LIB_SHIFT_BOOT_PERMUT) &&
-          l_i_boot >= l_n_bootstrap)
+         ((g_context->sets.lib_shift_meth == LIB_SHIFT_BOOTSTRAP || g_context->sets.lib_shift_meth == LIB_SHIFT_BOOT_PERMUT) &&
+          l_i_boot >= g_context->sets.n_bootstrap)
        )
     {
         /*increase library size*/
         l_old_lib_size = l_lib_size;
         l_lib_size += l_lib_inc;
         /*if lib_inc_inc_factor > 0.0 => also increase factor*/
-        l_f_lib_inc  += l_lib_inc_inc_factor * l_f_lib_inc;
+        l_f_lib_inc  += g_context->sets.lib_inc_inc_factor * l_f_lib_inc;
         l_lib_inc = l_f_lib_inc;
 
         /*Make sure max lib_size is used*/
-        if (l_lib_size > l_lib_size_max && l_old_lib_size < l_lib_size_max)
-            l_lib_size = l_lib_size_max;
+        if (l_lib_size > l_lib_size_end && l_old_lib_size < l_lib_size_end)
+            l_lib_size = l_lib_size_end;
 
         l_lib_set->n_point = l_lib_size;
         l_shift = 0;
         l_i_boot = 0;
 
-        /*l_permut_swaps = l_lib_size / log ((double) l_n_bootstrap) + 1;*/
+        /*l_permut_swaps = l_lib_size / log ((double) g_context->sets.n_bootstrap) + 1;*/
         l_permut_swaps = l_lib_size / 2 + 1;
-
-        /* If the lib set also has an attached kd-tree, free it here, because it now has other vectors.
-         * The prediction function will make  a new kd-tree if needed.
-         */
-        if (l_lib_set->tx)
-        {
-            free_kdt (l_lib_set->tx);
-            l_lib_set->tx = NULL;
-        }
     }
 
 
-    if (l_lib_size > l_lib_size_max ||
-        (l_lib_size >= l_n_points && l_lib_shift_meth != LIB_SHIFT_BOOTSTRAP) )
+    if (l_lib_size > l_lib_size_end ||
+        (l_lib_size >= l_n_points && g_context->sets.lib_shift_meth != LIB_SHIFT_BOOTSTRAP) )
     {
         free_sets_convergent_lib ();
         return 1;   /*end of iterations*/
@@ -494,28 +654,30 @@ next_set_convergent_lib ()
 
     log_set_par_convergent_lib ();
 
-    switch (l_lib_shift_meth)
+    switch (g_context->sets.lib_shift_meth)
     {
         case LIB_SHIFT_RANDOM:
             l_lib_set->point = l_rnd_point_twice + l_shift;
-            l_shift += l_lib_shift; /*prepare next shift through lib*/
+            l_shift += g_context->sets.lib_shift; /*prepare next shift through lib*/
             break;
         case LIB_SHIFT_SHIFT:
             l_lib_set->point = l_all_point_twice + l_shift;
-            l_shift += l_lib_shift; /*prepare next shift through lib*/
+            l_shift += g_context->sets.lib_shift; /*prepare next shift through lib*/
             break;
         case LIB_SHIFT_BOOTSTRAP:
+            set_rng_set (l_set_num);
             for (l = 0; l < l_lib_size; l++)
-                l_all_point_rnd[l] = l_all_points + (rand() % l_n_points);
+                l_all_point_rnd[l] = l_all_points + set_rand (l_n_points);
             l_i_boot++;
             break;
         case LIB_SHIFT_BOOT_PERMUT:
             if (l_lib_size >= l_n_points)
                 break;
+            set_rng_set (l_set_num);
             for (i = 0; i < l_permut_swaps; i++)
             {
-                idx1 = rand () % l_lib_size;
-                idx2 = l_lib_size + rand () % (l_n_points - l_lib_size);
+                idx1 = set_rand (l_lib_size);
+                idx2 = l_lib_size + set_rand (l_n_points - l_lib_size);
                 sav_point = l_all_point_rnd[idx1];
                 l_all_point_rnd[idx1] =  l_all_point_rnd[idx2];
                 l_all_point_rnd[idx2] = sav_point;
@@ -524,6 +686,10 @@ next_set_convergent_lib ()
             break;
     }
 
+    /* The library now has other vectors: update its kd tree, if there is one, and drop its packed copy.*/
+    update_lib_tree ();
+    point_set_unpack (l_lib_set);
+
     log_set (LOG_LIB_SET, l_lib_set);
     log_set (LOG_PRE_SET, l_pre_set);
     l_set_num++;
@@ -544,10 +710,9 @@ free_sets_convergent_lib ()
 }
 
 /* k_fold validation ***************************************************/
-static int         l_k_fold;
 static int         l_k;
 static int         l_repetition;
-static int         l_n_repetition;
+#pragma omp threadprivate(l_k, l_repetition)
 
 int
 init_set_k_fold (int k_fold, int n_repetition, /*set n_repetition to 1 for regular k-fold*/
@@ -557,8 +722,8 @@ init_set_k_fold (int k_fold, int n_repetition, /*set n_repetition to 1 for regul
     *next_set = &next_set_k_fold;
     *free_set = &free_sets;
 
-    l_k_fold       = k_fold;
-    l_n_repetition = n_repetition;
+    g_context->sets.k_fold       = k_fold;
+    g_context->sets.n_repetition = n_repetition;
 
     return 0;
 }
@@ -572,7 +737,7 @@ new_sets_k_fold (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set, Tpo
         return -1;
     }
 
-    if ((long) l_k_fold > l_n_points)
+    if ((long) g_context->sets.k_fold > l_n_points)
     {
         free_sets ();
         *lib_set = NULL;
@@ -585,45 +750,76 @@ new_sets_k_fold (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set, Tpo
     l_repetition = 0;
 
     l_rnd_point_twice = (Tpoint **) calloc (2 * l_n_points, sizeof (Tpoint *));
+    l_masked_point    = (Tpoint **) malloc (l_n_points * sizeof (Tpoint *));
+    l_n_masked_point  = 0;
 
     *lib_set = l_lib_set = init_set (emb);
     *pre_set = l_pre_set = init_set (emb);
 
-    srand(1);
+    set_rng_start ();
 
     return next_set_k_fold ();
 }
 
+/* mask_lib_tree: Unmask the held-out points of the previous fold in the kd tree of the library (when
+ *                the prediction function has made one), and mask the n_pre points of pre_point.
+ *                Points that are not in the tree yet are inserted when they are unmasked. So the tree
+ *                soon holds all points, and serves all folds and repetitions.
+ */
+static int
+mask_lib_tree (Tpoint **pre_point, long n_pre)
+{
+    if (l_lib_set->tx &&
+        (kdt_forest_mask (l_lib_set->tx, (void **) l_masked_point, l_n_masked_point, false) < 0 ||
+         kdt_forest_mask (l_lib_set->tx, (void **) pre_point, n_pre, true) < 0))
+    {
+        free_kdt_forest (l_lib_set->tx);
+        l_lib_set->tx = NULL;
+    }
+
+    memcpy (l_masked_point, pre_point, n_pre * sizeof (Tpoint *));
+    l_n_masked_point = n_pre;
+
+    return 0;
+}
+
 int
 next_set_k_fold ()
 {
     int    n_pre;
     Tpoint **pre_begin, **pre_end;
 
-    if (l_k == l_k_fold)
+    if (l_k == g_context->sets.k_fold)
     {
         l_repetition++;
         l_k = 0;
     }
 
-    if (l_repetition == l_n_repetition)
+    if (l_repetition == g_context->sets.n_repetition)
         return 1; /*end of iterations*/
 
     if (l_k == 0)
+    {
+        set_rng_set (l_set_num);
         fill_rnd_point_twice (l_rnd_point_twice, l_all_points, l_n_points);
+    }
 
-    pre_begin = l_rnd_point_twice + (int) floor (((double) l_k / l_k_fold) * l_n_points);
-    pre_end   = l_rnd_point_twice + (int) floor (((double) (l_k + 1) / l_k_fold) * l_n_points);
+    pre_begin = l_rnd_point_twice + (int) floor (((double) l_k / g_context->sets.k_fold) * l_n_points);
+    pre_end   = l_rnd_point_twice + (int) floor (((double) (l_k + 1) / g_context->sets.k_fold) * l_n_points);
 
     n_pre = pre_end - pre_begin;
 
     l_pre_set->point = pre_begin;
     l_pre_set->n_point = n_pre;
     l_pre_set->set_num = l_set_num;
-    l_lib_set->point = pre_end + 1;
+    l_lib_set->point = pre_end;
     l_lib_set->n_point = l_n_points - n_pre;
     l_lib_set->set_num = l_set_num;
 
+    mask_lib_tree (pre_begin, n_pre);
+    point_set_unpack (l_lib_set);
+    point_set_unpack (l_pre_set);
+
     log_set_par_k_fold ();
 
     log_set (LOG_LIB_SET, l_lib_set);
@@ -633,15 +829,6 @@ next_set_k_fold ()
     l_k++;
     l_set_num++;
 
-    /* If the lib set also has an attached kd-tree, free it here, because it now has other vectors.
-     * The prediction function will make  a new kd-tree if needed.
-     */
-    if (l_lib_set->tx)
-    {
-        free_kdt (l_lib_set->tx);
-        l_lib_set->tx = NULL;
-    }
-
     return 0;
 }
 
@@ -728,6 +915,7 @@ free_sets_looc (void)
 
 /* bootstrap validation *****************************************************/
 static int l_n_addit_val;
+#pragma omp threadprivate(l_n_addit_val)
 
 typedef struct
 {
@@ -760,12 +948,64 @@ compare_addit_val (const Tsort_struct *s1, const Tsort_struct *s2)
     return 0;
 }
 
-static bool l_pre_set_is_lib       = false;
-static bool l_lib_size_is_emb_size = true;
-static bool l_per_addit_group      = false;
 static Tsort_struct      *l_sort_structs     = NULL;
 static Tsort_addit_group *l_sort_addit_group = NULL;
 static int  l_n_addit_group  = 0;
+static int  l_i_part = 0, l_n_part = 1;  /*see set_sets_part*/
+#pragma omp threadprivate(l_sort_structs, l_sort_addit_group, l_n_addit_group, l_i_part, l_n_part)
+
+/* set_bootstrap_n_thread: Number of threads in which traverse_all makes and predicts the replicates of
+ *                         the bootstrap sets at once, each thread a part of them (see get_sets_n_part).
+ *                         A value smaller than 1 means: use all available processors.
+ *                         Only with set_sets_rng (RNG_COUNTER, ...), otherwise one thread is used.
+ */
+int
+set_bootstrap_n_thread (int n_thread)
+{
+    g_context->sets.boot_n_thread = n_thread;
+    return 0;
+}
+
+/* get_sets_n_part: The number of parts in which the sets of new_sets can be made at once, each part by
+ *                  its own thread (see set_sets_part). 0 when the sets are not bootstrap replicates.
+ *                  Only with the counter based random number generator the replicates do not depend
+ *                  on the order in which they are made; with other generators the answer is 1.
+ */
+int
+get_sets_n_part (Tnew_sets new_sets)
+{
+    int n_part = 1;
+
+    if (new_sets != &new_sets_bootstrap)
+        return 0;
+
+    if (g_context->sets.rng_kind != RNG_COUNTER)
+        return 1;
+
+#ifdef _OPENMP
+    n_part = g_context->sets.boot_n_thread < 1? omp_get_max_threads (): g_context->sets.boot_n_thread;
+#endif
+    if (n_part > g_context->sets.n_bootstrap)
+        n_part = g_context->sets.n_bootstrap;
+
+    return n_part < 1? 1: n_part;
+}
+
+/* set_sets_part: Let the new_sets and next_set functions of the calling thread make part i_part of
+ *                n_part of the sets: the ones with set_num i_part, i_part + n_part, ...
+ *                Back to all sets with set_sets_part (0, 1).
+ */
+int
+set_sets_part (int i_part, int n_part)
+{
+    if (n_part < 1 || i_part < 0 || i_part >= n_part)
+        return -1;
+
+    l_i_part = i_part;
+    l_n_part = n_part;
+
+    return 0;
+}
 
 int
 init_set_bootstrap (int lib_size, int n_bootstrap, bool pre_set_is_lib, bool lib_size_is_emb_size, bool per_addit_group,
@@ -775,17 +1015,17 @@ init_set_bootstrap (int lib_size, int n_bootstrap, bool pre_set_is_lib, bool lib
     *next_set = &next_set_bootstrap;
     *free_set = &free_sets;
 
-    l_pre_set_is_lib  = pre_set_is_lib;
-    l_lib_size        = lib_size;
-    l_n_bootstrap     = n_bootstrap;
-    l_per_addit_group = per_addit_group;
+    g_context->sets.pre_set_is_lib  = pre_set_is_lib;
+    g_context->sets.boot_lib_size   = lib_size;
+    g_context->sets.n_bootstrap     = n_bootstrap;
+    g_context->sets.per_addit_group = per_addit_group;
 
-    l_lib_size_is_emb_size = lib_size_is_emb_size;
+    g_context->sets.lib_size_is_emb_size = lib_size_is_emb_size;
 
-    if (l_n_bootstrap < 1)
+    if (g_context->sets.n_bootstrap < 1)
         return -1;
 
-    if (l_per_addit_group && !l_lib_size_is_emb_size)
+    if (g_context->sets.per_addit_group && !g_context->sets.lib_size_is_emb_size)
         return -2;
 
     return 0;
@@ -806,21 +1046,20 @@ new_sets_bootstrap (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set,
         return -1;
     }
 
-    srand (1);
+    set_rng_start ();
 
     l_lib_set = init_set (emb);
     l_pre_set = init_set (emb);
 
-    l_set_num = 0;
-    l_i_boot  = 0;
+    l_set_num = l_i_part;
+    l_i_boot  = l_i_part;
 
-    if (l_lib_size_is_emb_size)
-        l_lib_size = l_n_points;
+    l_lib_size = g_context->sets.lib_size_is_emb_size? l_n_points: g_context->sets.boot_lib_size;
 
     l_lib_set->point = (Tpoint **) malloc (l_lib_size * sizeof (Tpoint *));
     l_lib_set->n_point = l_lib_size;
 
-    if (l_pre_set_is_lib)
+    if (g_context->sets.pre_set_is_lib)
     {
         l_pre_set->point   = l_lib_set->point;
         l_pre_set->n_point = l_lib_size;
@@ -833,7 +1072,7 @@ new_sets_bootstrap (Tembed *emb, Tbundle_set *bundle_set, Tpoint_set **lib_set,
         l_pre_set->n_point = l_n_points;
     }
 
-    if (l_per_addit_group) /*bootstrapping is done per group of additional values, keeping the same number of points per group.*/
+    if (g_context->sets.per_addit_group) /*bootstrapping is done per group of additional values, keeping the same number of points per group.*/
     {
         bool first_group;
 
@@ -882,27 +1121,29 @@ next_set_bootstrap ()
     long i;
     int           h, j, k;
 
-    if (l_i_boot == l_n_bootstrap)
+    if (l_i_boot >= g_context->sets.n_bootstrap)
     {
         free_sets_bootstrap ();
         return 1; /*end of itterations*/
     }
 
-    if (l_per_addit_group)
+    set_rng_set (l_set_num);
+
+    if (g_context->sets.per_addit_group)
     {
         k = 0;
         for (j = 0; j < l_n_addit_group; j++)
         {
             for (h = 0; h < l_sort_addit_group[j].n; h++)
             {
-                l_lib_set->point[k] = (l_sort_addit_group[j].begin + rand () % l_sort_addit_group[j].n)->point;
+                l_lib_set->point[k] = (l_sort_addit_group[j].begin + set_rand (l_sort_addit_group[j].n))->point;
                 k++;
             }
         }
     }
     else
         for (i = 0; i < l_lib_size; i++)
-            l_lib_set->point[i] = l_all_points + rand () % l_n_points;
+            l_lib_set->point[i] = l_all_points + set_rand (l_n_points);
 
     l_pre_set->set_num = l_set_num;
     l_lib_set->set_num = l_set_num;
@@ -917,12 +1158,15 @@ next_set_bootstrap ()
      */
     if (l_lib_set->tx)
     {
-        free_kdt (l_lib_set->tx);
+        free_kdt_forest (l_lib_set->tx);
         l_lib_set->tx = NULL;
     }
+    point_set_unpack (l_lib_set);
+    if (g_context->sets.pre_set_is_lib)
+        point_set_unpack (l_pre_set);
 
-    l_set_num++; /*prepare for next round*/
-    l_i_boot++;
+    l_set_num += l_n_part; /*prepare for next round*/
+    l_i_boot  += l_n_part;
 
     return 0;
 }
@@ -930,7 +1174,7 @@ next_set_bootstrap ()
 int
 free_sets_bootstrap (void)
 {
-    if (l_pre_set && l_pre_set->point && !l_pre_set_is_lib)
+    if (l_pre_set && l_pre_set->point && !g_context->sets.pre_set_is_lib)
     {
         free (l_pre_set->point);
         l_pre_set->point = NULL;
@@ -20,6 +20,7 @@ static double *l_data1 = NULL;
 static double *l_data2 = NULL;
 static double *l_data3 = NULL;
 static long   l_n_data = 0;
+#pragma omp threadprivate(observed, size_observed, l_data1, l_data2, l_data3, l_n_data)
 
 static int
 log_stat (Tstat *stat);
@@ -289,6 +290,128 @@ free_stat (Tstat *stat)
     return 0;
 }
 
+/* init_stat_quantile: Start the estimate of percentile 100 * p.*/
+void
+init_stat_quantile (Tstat_quantile *sq, double p)
+{
+    sq->p = p < 0.0? 0.0: (p > 1.0? 1.0: p);
+    sq->n = 0;
+}
+
+/* stat_quantile_parabolic, stat_quantile_linear: New height of marker i, moved d (1 or -1) positions.*/
+static double
+stat_quantile_parabolic (const Tstat_quantile *sq, int i, double d)
+{
+    const double *q = sq->q, *n = sq->pos;
+
+    return q[i] + d / (n[i + 1] - n[i - 1]) *
+                  ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                   (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static double
+stat_quantile_linear (const Tstat_quantile *sq, int i, int d)
+{
+    return sq->q[i] + d * (sq->q[i + d] - sq->q[i]) / (sq->pos[i + d] - sq->pos[i]);
+}
+
+/* add_stat_quantile: Add value x. NaN values are skipped.*/
+void
+add_stat_quantile (Tstat_quantile *sq, double x)
+{
+    double p = sq->p, h;
+    int    i, k, d;
+
+    if (isnan (x))
+        return;
+
+    if (sq->n < 5)
+    {
+        sq->q[sq->n++] = x;
+        if (sq->n == 5)
+        {
+            qsort ((void *) sq->q, 5, sizeof (double), (int (*) (const void *, const void *)) cmpdoublep);
+            for (i = 0; i < 5; i++)
+                sq->pos[i] = i + 1;
+            sq->des[0] = 1.0;
+            sq->des[1] = 1.0 + 2.0 * p;
+            sq->des[2] = 1.0 + 4.0 * p;
+            sq->des[3] = 3.0 + 2.0 * p;
+            sq->des[4] = 5.0;
+        }
+        return;
+    }
+
+    /* The cell k of x, extending the range when needed.*/
+    if (x < sq->q[0])
+    {
+        sq->q[0] = x;
+        k = 0;
+    }
+    else if (x >= sq->q[4])
+    {
+        sq->q[4] = x;
+        k = 3;
+    }
+    else
+        for (k = 0; k < 3 && x >= sq->q[k + 1]; k++)
+            ;
+
+    for (i = k + 1; i < 5; i++)
+        sq->pos[i] += 1.0;
+    sq->des[1] += p / 2.0;
+    sq->des[2] += p;
+    sq->des[3] += (1.0 + p) / 2.0;
+    sq->des[4] += 1.0;
+    sq->n++;
+
+    /* Move the middle markers towards their desired positions.*/
+    for (i = 1; i < 4; i++)
+    {
+        h = sq->des[i] - sq->pos[i];
+        if ((h >= 1.0 && sq->pos[i + 1] - sq->pos[i] > 1.0) || (h <= -1.0 && sq->pos[i - 1] - sq->pos[i] < -1.0))
+        {
+            d = h > 0.0? 1: -1;
+            h = stat_quantile_parabolic (sq, i, d);
+            if (sq->q[i - 1] < h && h < sq->q[i + 1])
+                sq->q[i] = h;
+            else
+                sq->q[i] = stat_quantile_linear (sq, i, d);
+            sq->pos[i] += d;
+        }
+    }
+}
+
+/* get_stat_quantile: The estimate of the percentile, NaN when no values were added.*/
+double
+get_stat_quantile (const Tstat_quantile *sq)
+{
+    double data[5], r;
+    long   i;
+
+    if (sq->n == 0)
+        return NAN;
+
+    if (sq->n >= 5)
+    {
+        if (sq->p == 0.0)
+            return sq->q[0];
+        if (sq->p == 1.0)
+            return sq->q[4];
+        return sq->q[2];
+    }
+
+    /* Few values: interpolate between the sorted values.*/
+    for (i = 0; i < sq->n; i++)
+        data[i] = sq->q[i];
+    qsort ((void *) data, sq->n, sizeof (double), (int (*) (const void *, const void *)) cmpdoublep);
+    r = sq->p * (sq->n - 1);
+    i = (long) r;
+    if (i >= sq->n - 1)
+        return data[sq->n - 1];
+    return data[i] + (r - i) * (data[i + 1] - data[i]);
+}
+
 static int
 log_stat (Tstat *stat)
 {
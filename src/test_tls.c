@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2022 Roelof Bart Toonen
+ * License: MIT license (spdx.org MIT)
+ *
+ * Regression check of the tls solvers: the predictions of the LAPACK solvers (KTLS_SOLVER_SVD and
+ * KTLS_SOLVER_GRAM) should agree with those of dtls, and so should their solutions in KTLS_SOLVER_CHECK.
+ * Run with "make check". The exit status is 1 when a difference is larger than its tolerance.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "tsdat.h"
+#include "tstoembdef.h"
+#include "embed.h"
+#include "mkembed.h"
+#include "sets.h"
+#include "bundle.h"
+#include "fn_tls.h"
+
+#define TEST_TLS_TOL      1.0E-6   /*largest relative difference of the predictions with dtls*/
+#define TEST_TLS_X_TOL    1.0E-2   /*and of the solutions, which are weakly determined with xnn weights*/
+#define TEST_TLS_N_POINTS 400
+#define TEST_TLS_N_VAL    (5 * TEST_TLS_N_POINTS)  /*predictions of a case: thetas times points*/
+
+typedef struct
+{
+    const char    *name;
+    int           nnn;
+    Texcl         excl;
+    int           var_win;
+    bool          center;
+    Ttls_ref_meth ref_meth;
+    int           ref_xnn;
+} Ttest_case;
+
+static const Ttest_case l_case[] =
+{
+    { "nnn 30, mean",             30, T_EXCL_TIME_COORD, 0, true,  KTLS_REFMETH_MEAN,         1 },
+    { "nnn 20, xnn 3",            20, T_EXCL_TIME_WIN,   3, false, KTLS_REFMETH_XNN_GT_ZERO,  3 },
+    { "whole library, mean",       0, T_EXCL_TIME_COORD, 0, true,  KTLS_REFMETH_MEAN,         1 },
+    { "whole library, xnn 30",     0, T_EXCL_SELF,       0, false, KTLS_REFMETH_XNN_GT_ZERO, 30 }
+};
+
+/* test_data: Two coupled logistic maps.*/
+static Tfdat *
+test_data (long n)
+{
+    Tfdat  *fdat;
+    double x = 0.4, y = 0.2, x_new;
+    long   i;
+
+    fdat = (Tfdat *) calloc (1, sizeof (Tfdat));
+    fdat->n_col = 2;
+    fdat->n_dat = n;
+    fdat->dat   = (double *) malloc (2 * n * sizeof (double));
+    fdat->t     = (long *) malloc (n * sizeof (long));
+    fdat->lab   = (char **) malloc (2 * sizeof (char *));
+    fdat->lab[0] = "x";
+    fdat->lab[1] = "y";
+
+    for (i = 0; i < n; i++)
+    {
+        x_new = 3.8 * x * (1.0 - x - 0.02 * y);
+        y     = 3.5 * y * (1.0 - y - 0.1 * x);
+        x     = x_new;
+        fdat->dat[2 * i]     = x;
+        fdat->dat[2 * i + 1] = y;
+        fdat->t[i]           = i;
+    }
+
+    return fdat;
+}
+
+/* predict: The predictions of the leave one out sets of case tc with solver, for all thetas, in pre_val
+ *          (at most TEST_TLS_N_VAL). With KTLS_SOLVER_CHECK, check_diff gets the largest differences of
+ *          the solutions.
+ * Returns: the number of predictions, or -1 on failure.
+ */
+static long
+predict (Tfdat *fdat, const Ttest_case *tc, Ttls_solver solver, double *pre_val, double *check_diff)
+{
+    Tnew_sets       new_sets;
+    Tnext_set       next_set;
+    Tfree_set       free_set;
+    Tnew_fn_params  new_fn_params;
+    Tnext_fn_params next_fn_params;
+    Tfn             fn;
+    Temb_lag_def    *eld;
+    Tembed          *emb;
+    Tbundle_set     *bundle_set;
+    Tpoint_set      *lib_set, *pre_set;
+    void            *fn_params;
+    double          *predicted, svd_diff, gram_diff;
+    char            lag_def[] = "x,0,1,2;y,0,1:x,-1";
+    int             n_eld;
+    long            n = 0, n_val;
+
+    check_diff[0] = check_diff[1] = 0.0;
+
+    /* Thetas up to 2: with larger ones the xnn weights of far neighbours become denormal, on which
+     * dsvdc in dtls does not converge.
+     */
+    eld = str_to_lag_def (lag_def, &n_eld);
+    init_fn_tls (&new_fn_params, &next_fn_params, &fn, 0.0, 2.0, 0.5, tc->nnn, tc->excl, tc->var_win, tc->center,
+                 0.0, false, tc->ref_meth, tc->ref_xnn, true, solver, 0.0, 0);
+    init_set_looc (&new_sets, &next_set, &free_set);
+
+    emb = create_embed (fdat, eld, 0);
+    new_bundles (emb, &bundle_set);
+    if (new_fn_params (emb->e, &fn_params) != 0)
+        return -1;
+
+    do
+    {
+        if (new_sets (emb, bundle_set, &lib_set, &pre_set) != 0)
+            return -1;
+
+        do
+        {
+            if (fn (lib_set, pre_set, &predicted) < 0)
+                return -1;
+            n_val = pre_set->n_point * pre_set->n_pre_val;
+            if (n + n_val > TEST_TLS_N_VAL)
+                return -1;
+            memcpy (pre_val + n, predicted, n_val * sizeof (double));
+            n += n_val;
+
+            if (solver == KTLS_SOLVER_CHECK && get_tls_check_diff (&svd_diff, &gram_diff) == 0)
+            {
+                if (svd_diff > check_diff[0])
+                    check_diff[0] = svd_diff;
+                if (gram_diff > check_diff[1])
+                    check_diff[1] = gram_diff;
+            }
+        } while (next_set () == 0);
+
+        free_set ();
+    } while (next_fn_params (&fn_params) == 0);
+
+    free_embed (emb);
+
+    return n;
+}
+
+/* max_diff: The largest relative difference of the n values of a with those of ref, which may both be NaN.*/
+static double
+max_diff (const double *a, const double *ref, long n)
+{
+    double d, d_max = 0.0;
+    long   i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (isnan (a[i]) && isnan (ref[i]))
+            continue;
+        d = fabs (a[i] - ref[i]) / (1.0 + fabs (ref[i]));
+        if (isnan (d) || d > d_max)
+            d_max = isnan (d)? INFINITY: d;
+    }
+
+    return d_max;
+}
+
+int
+main (void)
+{
+    Tfdat  *fdat;
+    double *ref, *pre_val, check_diff[2], d_svd, d_gram;
+    long   n_ref;
+    int    i, n_fail = 0;
+    bool   ok;
+
+    fdat    = test_data (TEST_TLS_N_POINTS);
+    ref     = (double *) malloc (TEST_TLS_N_VAL * sizeof (double));
+    pre_val = (double *) malloc (TEST_TLS_N_VAL * sizeof (double));
+
+    for (i = 0; i < (int) (sizeof (l_case) / sizeof (l_case[0])); i++)
+    {
+        d_svd = d_gram = check_diff[0] = check_diff[1] = INFINITY;
+
+        if ((n_ref = predict (fdat, l_case + i, KTLS_SOLVER_DTLS, ref, check_diff)) > 0)
+        {
+            if (predict (fdat, l_case + i, KTLS_SOLVER_SVD, pre_val, check_diff) == n_ref)
+                d_svd = max_diff (pre_val, ref, n_ref);
+
+            if (predict (fdat, l_case + i, KTLS_SOLVER_GRAM, pre_val, check_diff) == n_ref)
+                d_gram = max_diff (pre_val, ref, n_ref);
+
+            /* The check mode predicts with dtls.*/
+            if (predict (fdat, l_case + i, KTLS_SOLVER_CHECK, pre_val, check_diff) != n_ref ||
+                max_diff (pre_val, ref, n_ref) != 0.0)
+                check_diff[0] = check_diff[1] = INFINITY;
+        }
+
+        ok = d_svd <= TEST_TLS_TOL && d_gram <= TEST_TLS_TOL &&
+             check_diff[0] <= TEST_TLS_X_TOL && check_diff[1] <= TEST_TLS_X_TOL;
+        if (!ok)
+            n_fail++;
+
+        fprintf (stdout, "%-24s predictions svd <%g> gram <%g>, solutions svd <%g> gram <%g>: %s\n",
+                 l_case[i].name, d_svd, d_gram, check_diff[0], check_diff[1], ok? "ok": "FAILED");
+    }
+
+    free (ref);
+    free (pre_val);
+
+    return n_fail > 0? 1: 0;
+}
@@ -10,6 +10,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "tsdat.h"
 #include "tstoembdef.h"
@@ -21,6 +25,7 @@
 #include "stat.h"
 #include "bundle.h"
 #include "traverse.h"
+#include "context.h"
 #include "log.h"
 #include "traverse_log.h"
 #include "traverse_stat.h"
@@ -43,114 +48,739 @@ log_addit_hd (int n_addit_val);
 static int
 log_addit_dt (int n_addit_val, double *addit_val);
 
+static void
+free_sorted (void);
+
+/* The statistics of the embeddings a thread traverses. traverse_all merges those of all threads.*/
+Tnlpre_stat *l_nlpre_stat = NULL;
+long        l_n_nlpre_stat = 0;
+long        l_n_nlpre_stat_alloc = 0;
+#pragma omp threadprivate(l_nlpre_stat, l_n_nlpre_stat, l_n_nlpre_stat_alloc)
+
+/* Bootstrap percentiles of the embeddings a thread traverses, see set_traverse_boot_percentile.*/
+static Tnlpre_boot_stat *l_boot_stat = NULL;
+static long             l_n_boot_stat = 0;
+#pragma omp threadprivate(l_boot_stat, l_n_boot_stat)
+
+#define BOOT_N_VAL 3  /*values per pre_val of which percentiles are made: rho, rmse and mae*/
+
+/* A replicate that is finished before the ones with lower set numbers.*/
+typedef struct
+{
+    int    set_num;
+    void   *fn_params;
+    int    n_pre_val;
+    double *val;      /*BOOT_N_VAL x n_pre_val, NULL when the replicate has no statistics*/
+} Tboot_wait;
+
+/* Percentiles of the replicates of one set of fn parameters.*/
+typedef struct
+{
+    int            next_set;     /*set number of the next replicate to add*/
+    long           n_replicate;
+    void           *fn_params;
+    int            n_pre_val;
+    Tstat_quantile *sq;          /*BOOT_N_VAL x n_pre_val x n_percentile*/
+    Tboot_wait     *wait;
+    int            n_wait;
+} Tboot_agg;
+
+/* Percentiles of the fn parameter sets of an embedding and bundle.*/
+typedef struct
+{
+    Tboot_agg *agg;
+    int       n_agg;
+} Tboot_aggs;
+
+/* The first statistic of each set of fn parameters of traverse_sets, in the statistics of the thread.*/
+typedef struct
+{
+    long *first;
+    int  n_iter;
+} Titer_stat;
+
+/* set_traverse_n_thread: Number of threads traverse_all uses to traverse the embeddings, each thread
+ *                        one embedding at a time. A value smaller than 1 means: use all available processors.
+ *                        The embeddings are traversed in one thread when logging, because the log records
+ *                        have to be written in order.
+ *                        Without OpenMP support, the embeddings are always traversed in one thread.
+ */
 int
-traverse_all (Tfdat *fdat, int n_emb_lag_def, Temb_lag_def emb_lag_def[],
-              Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
-              Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
-              bool validation, bool per_additional_val
-#ifdef NLPRESTATOUT
-              , Tnlpre_stat **_nlpre_stat, int *_n_nlpre_stat
+set_traverse_n_thread (int n_thread)
+{
+    g_context->traverse.n_thread = n_thread;
+    return 0;
+}
+
+static int
+get_traverse_n_thread (int n_emb_lag_def)
+{
+#ifdef _OPENMP
+    int n_thread;
+
+    n_thread = g_context->traverse.n_thread < 1? omp_get_max_threads (): g_context->traverse.n_thread;
+    if (n_thread > n_emb_lag_def)
+        n_thread = n_emb_lag_def;
+    if (g_log_file || n_thread < 1)
+        n_thread = 1;
+    return n_thread;
+#else
+    return 1;
 #endif
-                 )
+}
+
+/* set_traverse_boot_percentile: Percentiles (0 .. 100) of the statistics over the replicates of bootstrap
+ *                               sets. They are estimated while the replicates are predicted, without keeping
+ *                               the statistics of all replicates. No percentiles (the default): none are made.
+ *                               See get_traverse_boot_stat.
+ */
+int
+set_traverse_boot_percentile (int n_percentile, const double *percentile)
 {
-    Tpoint_set  *lib_set, *pre_set;
-    Tbundle_set *bundle_set;
-    double      *predicted;
-    Tembed      *emb;
-    int         i_emb, set_num, nb;
-    void        *fn_params;
-    Tnlpre_stat *nlpre_stat = NULL;
-    long        n_nlpre_stat = 0;
+    Ttraverse_context *ctx = &g_context->traverse;
+    int               i;
 
-    for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+    if (n_percentile < 0)
+        return -1;
+
+    for (i = 0; i < n_percentile; i++)
+        if (percentile[i] < 0.0 || percentile[i] > 100.0)
+            return -2;
+
+    if (ctx->boot_percentile)
+        free (ctx->boot_percentile);
+    ctx->boot_percentile   = NULL;
+    ctx->n_boot_percentile = 0;
+
+    if (n_percentile > 0)
+    {
+        ctx->boot_percentile = (double *) malloc (n_percentile * sizeof (double));
+        memcpy (ctx->boot_percentile, percentile, n_percentile * sizeof (double));
+        ctx->n_boot_percentile = n_percentile;
+    }
+
+    return 0;
+}
+
+/* get_traverse_boot_stat: The bootstrap percentiles of the last traverse_all in the calling thread, in the
+ *                         order of the embeddings, bundles and fn parameters. They are freed by free_traverse.
+ */
+int
+get_traverse_boot_stat (Tnlpre_boot_stat **boot_stat, int *n_boot_stat)
+{
+    *boot_stat   = l_boot_stat;
+    *n_boot_stat = l_n_boot_stat;
+    return 0;
+}
+
+/* get_traverse_boot_n_thread: Number of threads for the n_part parts of the sets (see get_sets_n_part).
+ *                             One thread when logging, or when the embeddings are already traversed in
+ *                             several threads.
+ */
+static int
+get_traverse_boot_n_thread (int n_part)
+{
+#ifdef _OPENMP
+    if (n_part < 1 || g_log_file || omp_in_parallel ())
+        return 1;
+    return n_part;
+#else
+    return 1;
+#endif
+}
+
+/* boot_agg_value: Add the values of a replicate to the percentiles. val: NULL or BOOT_N_VAL x n_pre_val values.*/
+static void
+boot_agg_value (Tboot_agg *agg, int set_num, void *fn_params, int n_pre_val, const double *val)
+{
+    const Ttraverse_context *ctx = &g_context->traverse;
+    long                    i, n;
+
+    agg->next_set = set_num + 1;
+    if (!val)
+        return;
+
+    if (!agg->sq)
     {
-        emb = create_embed (fdat, emb_lag_def + i_emb, i_emb);
-        if (!emb)
+        agg->fn_params = fn_params;
+        agg->n_pre_val = n_pre_val;
+        n = BOOT_N_VAL * n_pre_val * ctx->n_boot_percentile;
+        agg->sq = (Tstat_quantile *) malloc (n * sizeof (Tstat_quantile));
+        for (i = 0; i < n; i++)
+            init_stat_quantile (agg->sq + i, ctx->boot_percentile[i % ctx->n_boot_percentile] / 100.0);
+    }
+
+    if (n_pre_val != agg->n_pre_val)
+        return;
+
+    n = BOOT_N_VAL * n_pre_val * ctx->n_boot_percentile;
+    for (i = 0; i < n; i++)
+        add_stat_quantile (agg->sq + i, val[i / ctx->n_boot_percentile]);
+    agg->n_replicate++;
+}
+
+/* boot_agg_add: Add the statistics of replicate set_num of fn parameter set i_iter. Replicates that come
+ *               before the ones with lower set numbers wait for them, so the percentiles do not depend on
+ *               the order in which the threads finish the replicates.
+ */
+static void
+boot_agg_add (Tboot_aggs *aggs, int i_iter, int set_num, void *fn_params, Tstat *stat)
+{
+    Tboot_agg  *agg;
+    Tboot_wait *w;
+    double     *val = NULL;
+    int        i, j, n_pre_val = 0;
+
+    if (i_iter >= aggs->n_agg)
+    {
+        aggs->agg = (Tboot_agg *) realloc (aggs->agg, (i_iter + 1) * sizeof (Tboot_agg));
+        for (i = aggs->n_agg; i <= i_iter; i++)
+        {
+            memset (aggs->agg + i, 0, sizeof (Tboot_agg));
+            aggs->agg[i].next_set = 1;
+        }
+        aggs->n_agg = i_iter + 1;
+    }
+    agg = aggs->agg + i_iter;
+
+    if (stat)
+    {
+        n_pre_val = stat->n_pre_val;
+        val = (double *) malloc (BOOT_N_VAL * n_pre_val * sizeof (double));
+        for (j = 0; j < n_pre_val; j++)
+        {
+            val[j]                 = stat->cov_pre_obs[j] / sqrt (stat->var_pre[j] * stat->var_obs[j]);
+            val[n_pre_val + j]     = stat->rmse_pre_obs[j];
+            val[2 * n_pre_val + j] = stat->mae_pre_obs[j];
+        }
+    }
+
+    if (set_num != agg->next_set)
+    {
+        agg->wait = (Tboot_wait *) realloc (agg->wait, (agg->n_wait + 1) * sizeof (Tboot_wait));
+        w = agg->wait + agg->n_wait++;
+        w->set_num   = set_num;
+        w->fn_params = fn_params;
+        w->n_pre_val = n_pre_val;
+        w->val       = val;
+        return;
+    }
+
+    boot_agg_value (agg, set_num, fn_params, n_pre_val, val);
+    if (val)
+        free (val);
+
+    /* The replicates that waited for this one.*/
+    for (i = 0; i < agg->n_wait; )
+    {
+        w = agg->wait + i;
+        if (w->set_num != agg->next_set)
         {
-            fprintf(stdout, "Skipping embedding <%d>.\n", i_emb);
+            i++;
             continue;
         }
 
-        if (emb->n_row == 0)
+        boot_agg_value (agg, w->set_num, w->fn_params, w->n_pre_val, w->val);
+        if (w->val)
+            free (w->val);
+        agg->wait[i] = agg->wait[--agg->n_wait];
+        i = 0;
+    }
+}
+
+static int
+compare_boot_wait (const void *a, const void *b)
+{
+    return ((const Tboot_wait *) a)->set_num - ((const Tboot_wait *) b)->set_num;
+}
+
+/* boot_agg_finish: Add the percentiles of the fn parameter sets of the embedding and bundle to those of
+ *                  the thread, and free aggs. Replicates still waiting (after ones that failed) are
+ *                  added first, in the order of their set numbers.
+ */
+static int
+boot_agg_finish (Tboot_aggs *aggs, int emb_num, int bundle_num)
+{
+    const Ttraverse_context *ctx = &g_context->traverse;
+    Tnlpre_boot_stat        *bs;
+    Tboot_agg               *agg;
+    int                     np = ctx->n_boot_percentile;
+    int                     i, j, k;
+
+    for (k = 0; k < aggs->n_agg; k++)
+    {
+        agg = aggs->agg + k;
+
+        qsort (agg->wait, agg->n_wait, sizeof (Tboot_wait), compare_boot_wait);
+        for (i = 0; i < agg->n_wait; i++)
         {
-            free_embed (emb);
-            fprintf(stdout, "Skipping embedding <%d>, zero rows.\n", i_emb);
+            boot_agg_value (agg, agg->wait[i].set_num, agg->wait[i].fn_params, agg->wait[i].n_pre_val,
+                            agg->wait[i].val);
+            if (agg->wait[i].val)
+                free (agg->wait[i].val);
+        }
+        if (agg->wait)
+            free (agg->wait);
+
+        if (!agg->sq)
             continue;
+
+        l_boot_stat = (Tnlpre_boot_stat *) realloc (l_boot_stat, (l_n_boot_stat + 1) * sizeof (Tnlpre_boot_stat));
+        bs = l_boot_stat + l_n_boot_stat++;
+
+        bs->fn_params    = agg->fn_params;
+        bs->emb_num      = emb_num;
+        bs->bundle_num   = bundle_num;
+        bs->n_replicate  = agg->n_replicate;
+        bs->n_pre_val    = agg->n_pre_val;
+        bs->n_percentile = np;
+        bs->percentile   = (double *) malloc (np * sizeof (double));
+        memcpy (bs->percentile, ctx->boot_percentile, np * sizeof (double));
+
+        bs->rho_pre_obs  = (double *) malloc (agg->n_pre_val * np * sizeof (double));
+        bs->rmse_pre_obs = (double *) malloc (agg->n_pre_val * np * sizeof (double));
+        bs->mae_pre_obs  = (double *) malloc (agg->n_pre_val * np * sizeof (double));
+        for (j = 0; j < agg->n_pre_val * np; j++)
+        {
+            bs->rho_pre_obs[j]  = get_stat_quantile (agg->sq + j);
+            bs->rmse_pre_obs[j] = get_stat_quantile (agg->sq + agg->n_pre_val * np + j);
+            bs->mae_pre_obs[j]  = get_stat_quantile (agg->sq + 2 * agg->n_pre_val * np + j);
         }
 
-        if ((nb = new_bundles (emb, &bundle_set)) < 0)
+        free (agg->sq);
+    }
+
+    if (aggs->agg)
+        free (aggs->agg);
+    aggs->agg   = NULL;
+    aggs->n_agg = 0;
+
+    return 0;
+}
+
+/* traverse_sets: Traverse the fn parameters and sets of an embedding and bundle. The statistics are added
+ *                to those of the thread. replicates: the sets are bootstrap replicates, numbered by the set
+ *                functions. With aggs, their statistics are also added to the percentiles. With iter, the
+ *                first statistic of each set of fn parameters is kept in it.
+ */
+static int
+traverse_sets (Tembed *emb, int i_emb, Tbundle_set *bundle_set, Temb_lag_def *emb_lag_def,
+               Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
+               Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
+               bool validation, bool per_additional_val, bool replicates, Tboot_aggs *aggs, Titer_stat *iter)
+{
+    Tpoint_set  *lib_set, *pre_set;
+    double      *predicted;
+    int         set_num, i_iter = -1;
+    void        *fn_params;
+    Tnlpre_stat *nlpre_stat = NULL;
+    long        n_nlpre_stat = 0, n_before;
+
+    if ( (*new_fn_params) (emb->e, &fn_params) != 0)
+    {
+        fprintf (stdout, "Warning: unable to get next set of fn parameters\n");
+        return 0;
+    }
+
+    do
+    {
+        i_iter++;
+        if (iter)
         {
-            free_traverse ();
-            free_embed (emb);
-            return -5;
+            iter->first = (long *) realloc (iter->first, (i_iter + 1) * sizeof (long));
+            iter->first[i_iter] = l_n_nlpre_stat;
+            iter->n_iter = i_iter + 1;
         }
-        else if (nb > 0)
+
+        if ( (*new_sets) (emb, bundle_set, &lib_set, &pre_set) != 0)
         {
-            free_embed (emb);
-            fprintf(stdout, "Skipping embedding <%d>, no bundle to process.\n", i_emb);
+            fprintf (stdout, "Warning: unable to get new sets.\n");
             continue;
         }
 
+        set_num = 1;
+
         do
         {
-
-            if ( (*new_fn_params) (emb->e, &fn_params) != 0)
+            if ( (*fn) (lib_set, pre_set, &predicted) < 0)
             {
-                fprintf (stdout, "Warning: unable to get next set of fn parameters\n");
+                fprintf (stdout, "Warning: fn returned error.\n");
                 continue;
             }
 
-            do
+            if (replicates)
+                set_num = lib_set->set_num + 1;  /*the thread may make a part of the replicates*/
+
+            if (validation)
             {
-                if ( (*new_sets) (emb, bundle_set, &lib_set, &pre_set) != 0)
+                n_before = l_n_nlpre_stat;
+                if (get_stats (pre_set, predicted, per_additional_val, fn_params, i_emb, set_num,
+                               bundle_set, emb, emb_lag_def, lib_set, pre_set,
+                               &nlpre_stat, &n_nlpre_stat) < 0)
                 {
-                    fprintf (stdout, "Warning: unable to get new sets.\n");
+                    fprintf (stdout, "Warning: error when computing statistics.\n");
                     continue;
                 }
 
-                set_num = 1;
-
-                do
+                if (aggs)
                 {
-                    if ( (*fn) (lib_set, pre_set, &predicted) < 0)
-                    {
-                        fprintf (stdout, "Warning: fn returned error.\n");
-                        continue;
-                    }
+#pragma omp critical (traverse_boot)
+                    boot_agg_add (aggs, i_iter, set_num, fn_params,
+                                  l_n_nlpre_stat > n_before? l_nlpre_stat[n_before].stat: NULL);
+                }
+            }
 
-                    if (validation)
-                    {
-                        if (get_stats (pre_set, predicted, per_additional_val, fn_params, i_emb, set_num,
-                                       bundle_set, emb, emb_lag_def + i_emb, lib_set, pre_set,
-                                       &nlpre_stat, &n_nlpre_stat) < 0)
-                        {
-                            fprintf (stdout, "Warning: error when computing statistics.\n");
-                            continue;
-                        }
-                    }
+            if (g_log_file)
+                fflush (g_log_file);
 
-                    if (g_log_file)
-                        fflush (g_log_file);
+            set_num++;
+        } while ( (*next_set) () == 0); /*changes lib_set and pre_set contents*/
 
-                    set_num++;
-                } while ( (*next_set) () == 0); /*changes lib_set and pre_set contents*/
+        (*free_set) ();
 
-                (*free_set) ();
+    } while ( (*next_fn_params) (&fn_params) == 0);
 
-            } while ( (*next_fn_params) (&fn_params) == 0);
+    return 0;
+}
 
-        } while (next_bundle () == 0);
+/* traverse_sets_parallel: traverse_sets of bootstrap replicates in n_thread threads, each thread making and
+ *                         predicting a part of the replicates, with its own state in the set, fn and
+ *                         statistics functions. Then the statistics of the threads are merged, per set of
+ *                         fn parameters in the order of the replicates, so they are the same as in one thread.
+ */
+static int
+traverse_sets_parallel (Tembed *emb, int i_emb, Tbundle_set *bundle_set, Temb_lag_def *emb_lag_def,
+                        Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
+                        Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
+                        bool validation, bool per_additional_val, Tboot_aggs *aggs, int n_thread)
+{
+    Tnlpre_stat **thread_stat, *nlpre_stat, *ts;
+    Titer_stat  *iter;
+    long        *thread_n, *b, *e, n_first, n_nlpre_stat, n;
+    int         i, k, t, n_iter, res = 0;
+
+    thread_stat = (Tnlpre_stat **) calloc (n_thread, sizeof (Tnlpre_stat *));
+    thread_n    = (long *) calloc (n_thread, sizeof (long));
+    iter        = (Titer_stat *) calloc (n_thread, sizeof (Titer_stat));
+    n_first     = l_n_nlpre_stat;
+
+#pragma omp parallel num_threads(n_thread) copyin(g_context) reduction(min:res)
+    {
+        int i_thread = 0, n_part = 1, res_thread;
+#ifdef _OPENMP
+        i_thread = omp_get_thread_num ();
+        n_part   = omp_get_num_threads ();
+#endif
+        set_sets_part (i_thread, n_part);
+        res_thread = traverse_sets (emb, i_emb, bundle_set, emb_lag_def, new_sets, next_set, free_set,
+                                    new_fn_params, next_fn_params, fn, validation, per_additional_val,
+                                    true, aggs, iter + i_thread);
+        set_sets_part (0, 1);
+
+        thread_stat[i_thread] = l_nlpre_stat;
+        thread_n[i_thread]    = l_n_nlpre_stat;
+        l_nlpre_stat          = NULL;
+        l_n_nlpre_stat        = 0;
+        l_n_nlpre_stat_alloc  = 0;
+
+        if (i_thread > 0)
+            free_sorted ();
+        res = res_thread;
+    }
+
+    n_nlpre_stat = 0;
+    n_iter       = 0;
+    for (t = 0; t < n_thread; t++)
+    {
+        n_nlpre_stat += thread_n[t];
+        if (iter[t].n_iter > n_iter)
+            n_iter = iter[t].n_iter;
+    }
+
+    nlpre_stat = (Tnlpre_stat *) malloc ((n_nlpre_stat > 0? n_nlpre_stat: 1) * sizeof (Tnlpre_stat));
+    if (n_first > 0)
+        memcpy (nlpre_stat, thread_stat[0], n_first * sizeof (Tnlpre_stat));
+    n_nlpre_stat = n_first;
+
+    b = (long *) malloc (n_thread * sizeof (long));
+    e = (long *) malloc (n_thread * sizeof (long));
+    for (k = 0; k < n_iter; k++)
+    {
+        for (t = 0; t < n_thread; t++)
+        {
+            b[t] = e[t] = 0;
+            if (k < iter[t].n_iter)
+            {
+                b[t] = iter[t].first[k];
+                e[t] = k + 1 < iter[t].n_iter? iter[t].first[k + 1]: thread_n[t];
+            }
+        }
+
+        /* Take the statistics of the lowest replicate of the threads, until all are taken.*/
+        for (;;)
+        {
+            for (i = -1, t = 0; t < n_thread; t++)
+                if (b[t] < e[t] && (i < 0 || thread_stat[t][b[t]].set_num < thread_stat[i][b[i]].set_num))
+                    i = t;
+            if (i < 0)
+                break;
+
+            ts = thread_stat[i];
+            for (n = b[i]; n < e[i] && ts[n].set_num == ts[b[i]].set_num; n++)
+                ;
+            memcpy (nlpre_stat + n_nlpre_stat, ts + b[i], (n - b[i]) * sizeof (Tnlpre_stat));
+            n_nlpre_stat += n - b[i];
+            b[i] = n;
+        }
+    }
+
+    for (t = 0; t < n_thread; t++)
+    {
+        if (thread_stat[t])
+            free (thread_stat[t]);
+        if (iter[t].first)
+            free (iter[t].first);
+    }
+    free (b);
+    free (e);
+    free (iter);
+    free (thread_n);
+    free (thread_stat);
+
+    l_nlpre_stat         = nlpre_stat;
+    l_n_nlpre_stat       = n_nlpre_stat;
+    l_n_nlpre_stat_alloc = n_nlpre_stat > 0? n_nlpre_stat: 1;
+
+    return res;
+}
+
+/* traverse_emb: Traverse the bundles, fn parameters and sets of embedding i_emb. The statistics are added
+ *               to those of the thread. The replicates of bootstrap sets are traversed in several threads
+ *               when the set functions allow it (see set_bootstrap_n_thread).
+ */
+static int
+traverse_emb (Tfdat *fdat, int i_emb, Temb_lag_def emb_lag_def[],
+              Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
+              Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
+              bool validation, bool per_additional_val)
+{
+    Tbundle_set *bundle_set;
+    Tembed      *emb;
+    Tboot_aggs  aggs = { NULL, 0 };
+    int         nb, n_part, n_thread, res = 0;
+    bool        boot_stat;
 
-        free_bundle ();
+    emb = create_embed (fdat, emb_lag_def + i_emb, i_emb);
+    if (!emb)
+    {
+        fprintf(stdout, "Skipping embedding <%d>.\n", i_emb);
+        return 0;
+    }
 
+    if (emb->n_row == 0)
+    {
         free_embed (emb);
+        fprintf(stdout, "Skipping embedding <%d>, zero rows.\n", i_emb);
+        return 0;
+    }
+
+    if ((nb = new_bundles (emb, &bundle_set)) < 0)
+    {
+        free_embed (emb);
+        return -5;
+    }
+    else if (nb > 0)
+    {
+        free_embed (emb);
+        fprintf(stdout, "Skipping embedding <%d>, no bundle to process.\n", i_emb);
+        return 0;
+    }
+
+    n_part    = get_sets_n_part (new_sets);
+    n_thread  = get_traverse_boot_n_thread (n_part);
+    boot_stat = n_part > 0 && validation && g_context->traverse.n_boot_percentile > 0;
+
+    do
+    {
+        if (n_thread > 1)
+            res = traverse_sets_parallel (emb, i_emb, bundle_set, emb_lag_def + i_emb, new_sets, next_set, free_set,
+                                          new_fn_params, next_fn_params, fn, validation, per_additional_val,
+                                          boot_stat? &aggs: NULL, n_thread);
+        else
+            res = traverse_sets (emb, i_emb, bundle_set, emb_lag_def + i_emb, new_sets, next_set, free_set,
+                                 new_fn_params, next_fn_params, fn, validation, per_additional_val,
+                                 n_part > 0, boot_stat? &aggs: NULL, NULL);
+
+        if (boot_stat)
+            boot_agg_finish (&aggs, i_emb, bundle_set? bundle_set->bundle_num: 0);
+
+    } while (res == 0 && next_bundle () == 0);
+
+    free_bundle ();
+
+    free_embed (emb);
+
+    return res;
+}
+
+/* Statistics of one embedding: the range of them in the statistics of the thread that traversed it.*/
+typedef struct
+{
+    int  i_thread;
+    long first;
+    long n;
+    long boot_first;  /*and of its bootstrap percentiles*/
+    long boot_n;
+} Temb_stat_range;
+
+/* traverse_parallel: Traverse the embeddings in n_thread threads, each thread taking the next embedding
+ *                    when it is done with the previous one, with its own state in the set, fn, bundle and
+ *                    statistics functions. Then the statistics of the threads are merged in the order of the
+ *                    embeddings, after the ones that were already there, so they are the same as in one thread.
+ */
+static int
+traverse_parallel (Tfdat *fdat, int n_emb_lag_def, Temb_lag_def emb_lag_def[],
+                   Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
+                   Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
+                   bool validation, bool per_additional_val, int n_thread)
+{
+    Temb_stat_range  *range;
+    Tnlpre_stat      **thread_stat, *nlpre_stat;
+    Tnlpre_boot_stat **thread_boot_stat, *boot_stat;
+    long             n_first, n_nlpre_stat, n_boot_first, n_boot_stat;
+    int              i_emb, i, res = 0;
+
+    range            = (Temb_stat_range *) malloc (n_emb_lag_def * sizeof (Temb_stat_range));
+    thread_stat      = (Tnlpre_stat **) calloc (n_thread, sizeof (Tnlpre_stat *));
+    thread_boot_stat = (Tnlpre_boot_stat **) calloc (n_thread, sizeof (Tnlpre_boot_stat *));
+    n_first          = l_n_nlpre_stat;
+    n_boot_first     = l_n_boot_stat;
+
+#pragma omp parallel num_threads(n_thread) copyin(g_context) private(i_emb) reduction(min:res)
+    {
+        int i_thread = 0, res_thread = 0;
+#ifdef _OPENMP
+        i_thread = omp_get_thread_num ();
+#endif
+
+#pragma omp for schedule(dynamic, 1)
+        for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+        {
+            range[i_emb].i_thread   = i_thread;
+            range[i_emb].first      = l_n_nlpre_stat;
+            range[i_emb].boot_first = l_n_boot_stat;
+            if (res_thread == 0 && traverse_emb (fdat, i_emb, emb_lag_def, new_sets, next_set, free_set,
+                                                 new_fn_params, next_fn_params, fn, validation,
+                                                 per_additional_val) < 0)
+                res_thread = -5;
+            range[i_emb].n      = l_n_nlpre_stat - range[i_emb].first;
+            range[i_emb].boot_n = l_n_boot_stat - range[i_emb].boot_first;
+        }
+
+        thread_stat[i_thread]      = l_nlpre_stat;
+        l_nlpre_stat               = NULL;
+        l_n_nlpre_stat             = 0;
+        l_n_nlpre_stat_alloc       = 0;
+        thread_boot_stat[i_thread] = l_boot_stat;
+        l_boot_stat                = NULL;
+        l_n_boot_stat              = 0;
+
+        if (i_thread > 0)
+            free_sorted ();
+        res = res_thread;
+    }
+
+    n_nlpre_stat = n_first;
+    for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+        n_nlpre_stat += range[i_emb].n;
+
+    nlpre_stat = (Tnlpre_stat *) malloc ((n_nlpre_stat > 0? n_nlpre_stat: 1) * sizeof (Tnlpre_stat));
+    if (n_first > 0)
+        memcpy (nlpre_stat, thread_stat[0], n_first * sizeof (Tnlpre_stat));
+
+    n_nlpre_stat = n_first;
+    for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+    {
+        if (range[i_emb].n > 0)
+            memcpy (nlpre_stat + n_nlpre_stat, thread_stat[range[i_emb].i_thread] + range[i_emb].first,
+                    range[i_emb].n * sizeof (Tnlpre_stat));
+        n_nlpre_stat += range[i_emb].n;
+    }
+
+    n_boot_stat = n_boot_first;
+    for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+        n_boot_stat += range[i_emb].boot_n;
+
+    boot_stat = NULL;
+    if (n_boot_stat > 0)
+    {
+        boot_stat = (Tnlpre_boot_stat *) malloc (n_boot_stat * sizeof (Tnlpre_boot_stat));
+        if (n_boot_first > 0)
+            memcpy (boot_stat, thread_boot_stat[0], n_boot_first * sizeof (Tnlpre_boot_stat));
+
+        n_boot_stat = n_boot_first;
+        for (i_emb = 0; i_emb < n_emb_lag_def; i_emb++)
+        {
+            if (range[i_emb].boot_n > 0)
+                memcpy (boot_stat + n_boot_stat, thread_boot_stat[range[i_emb].i_thread] + range[i_emb].boot_first,
+                        range[i_emb].boot_n * sizeof (Tnlpre_boot_stat));
+            n_boot_stat += range[i_emb].boot_n;
+        }
+    }
+
+    for (i = 0; i < n_thread; i++)
+    {
+        if (thread_stat[i])
+            free (thread_stat[i]);
+        if (thread_boot_stat[i])
+            free (thread_boot_stat[i]);
+    }
+    free (thread_stat);
+    free (thread_boot_stat);
+    free (range);
+
+    l_nlpre_stat         = nlpre_stat;
+    l_n_nlpre_stat       = n_nlpre_stat;
+    l_n_nlpre_stat_alloc = n_nlpre_stat > 0? n_nlpre_stat: 1;
+    l_boot_stat          = boot_stat;
+    l_n_boot_stat        = n_boot_stat;
+
+    return res;
+}
+
+int
+traverse_all (Tfdat *fdat, int n_emb_lag_def, Temb_lag_def emb_lag_def[],
+              Tnew_sets new_sets, Tnext_set next_set, Tfree_set free_set,
+              Tnew_fn_params new_fn_params, Tnext_fn_params next_fn_params, Tfn fn,
+              bool validation, bool per_additional_val
+#ifdef NLPRESTATOUT
+              , Tnlpre_stat **_nlpre_stat, int *_n_nlpre_stat
+#endif
+                 )
+{
+    int i_emb, n_thread, res = 0;
+
+    n_thread = get_traverse_n_thread (n_emb_lag_def);
+
+    if (n_thread > 1)
+        res = traverse_parallel (fdat, n_emb_lag_def, emb_lag_def, new_sets, next_set, free_set,
+                                 new_fn_params, next_fn_params, fn, validation, per_additional_val, n_thread);
+    else
+        for (i_emb = 0; i_emb < n_emb_lag_def && res == 0; i_emb++)
+            res = traverse_emb (fdat, i_emb, emb_lag_def, new_sets, next_set, free_set,
+                                new_fn_params, next_fn_params, fn, validation, per_additional_val);
+
+    if (res < 0)
+    {
+        free_traverse ();
+        return res;
     }
 
 #ifdef NLPRESTATOUT
     if (validation)
     {
-        *_n_nlpre_stat = n_nlpre_stat;
-        *_nlpre_stat   = nlpre_stat;
+        *_n_nlpre_stat = l_n_nlpre_stat;
+        *_nlpre_stat   = l_nlpre_stat;
     }
     else
     {
@@ -162,9 +792,6 @@ traverse_all (Tfdat *fdat, int n_emb_lag_def, Temb_lag_def emb_lag_def[],
     return 0;
 }
 
-Tnlpre_stat *l_nlpre_stat = NULL;
-long        l_n_nlpre_stat = 0;
-long        l_n_nlpre_stat_alloc = 0;
 
 static Tnlpre_stat *
 create_nlpre_stat (Tstat *stat,
@@ -237,6 +864,7 @@ typedef struct
 } Tsort_struct;
 
 static int l_n_addit_val;
+#pragma omp threadprivate(l_n_addit_val)
 
 static int
 compare_addit_val (const Tsort_struct *s1, const Tsort_struct *s2)
@@ -261,6 +889,7 @@ static long l_n_points_sorted = 0;
 static Tpoint **l_points_sorted = NULL;
 static double *l_predicted_sorted = NULL;
 static Tsort_struct *l_sort_structs = NULL;
+#pragma omp threadprivate(l_n_points_sorted, l_points_sorted, l_predicted_sorted, l_sort_structs)
 
 static int
 get_stats (Tpoint_set *points_observed, double *predicted, bool per_additional_val,
@@ -350,26 +979,66 @@ get_stats (Tpoint_set *points_observed, double *predicted, bool per_additional_v
     return 0;
 }
 
+/* free_sorted: Free the memory get_stats uses to sort the points on their additional values.*/
+static void
+free_sorted (void)
+{
+    if (l_points_sorted)
+        free (l_points_sorted);
+    if (l_predicted_sorted)
+        free (l_predicted_sorted);
+    if (l_sort_structs)
+        free (l_sort_structs);
+    l_points_sorted    = NULL;
+    l_predicted_sorted = NULL;
+    l_sort_structs     = NULL;
+    l_n_points_sorted  = 0;
+}
+
+static int
+compare_pointer (const void *a, const void *b)
+{
+    const char *pa = *(char * const *) a, *pb = *(char * const *) b;
+
+    return pa < pb? -1: (pa > pb? 1: 0);
+}
+
 int
 free_traverse ()
 {
-    int i;
-    void *p_fn_params = NULL;
+    long i, n_fn_params;
+    void **fn_params;
     Tnlpre_stat *p_nlpre_stat;
+    Tnlpre_boot_stat *p_boot_stat;
+
+    for (i = 0; i < l_n_boot_stat; i++)
+    {
+        /* fn_params is one of the statistics*/
+        p_boot_stat = l_boot_stat + i;
+        free (p_boot_stat->percentile);
+        free (p_boot_stat->rho_pre_obs);
+        free (p_boot_stat->rmse_pre_obs);
+        free (p_boot_stat->mae_pre_obs);
+    }
+    if (l_boot_stat)
+        free (l_boot_stat);
+    l_boot_stat   = NULL;
+    l_n_boot_stat = 0;
 
     if (!l_nlpre_stat)
         return 1;
 
+    /* Statistics share their fn_params: those of the same fn parameters, also when they are not next to
+     * each other (replicates of several threads). So each is freed once.
+     */
+    fn_params   = (void **) malloc ((l_n_nlpre_stat > 0? l_n_nlpre_stat: 1) * sizeof (void *));
+    n_fn_params = 0;
+
     for (i = 0; i < l_n_nlpre_stat; i++)
     {
-        /* No deeper memory allocations in fn_params, otherwise we need a dedicated */
-        /* free function for each type of fn params                                 */
         p_nlpre_stat = l_nlpre_stat + i;
-        if (p_nlpre_stat->fn_params && p_nlpre_stat->fn_params != p_fn_params)
-        {
-            p_fn_params = p_nlpre_stat->fn_params;
-            free (p_nlpre_stat->fn_params); 
-        }
+        if (p_nlpre_stat->fn_params)
+            fn_params[n_fn_params++] = p_nlpre_stat->fn_params;
 
         if (p_nlpre_stat->stat)
             free_stat (p_nlpre_stat->stat); 
@@ -384,15 +1053,20 @@ free_traverse ()
             free (p_nlpre_stat->addit_val); 
     }
 
+    /* No deeper memory allocations in fn_params, otherwise we need a dedicated */
+    /* free function for each type of fn params                                 */
+    qsort (fn_params, n_fn_params, sizeof (void *), compare_pointer);
+    for (i = 0; i < n_fn_params; i++)
+        if (i == 0 || fn_params[i] != fn_params[i - 1])
+            free (fn_params[i]);
+    free (fn_params);
+
     free (l_nlpre_stat); 
+    l_nlpre_stat         = NULL;
+    l_n_nlpre_stat       = 0;
+    l_n_nlpre_stat_alloc = 0;
 
-    if (l_points_sorted)
-        free (l_points_sorted);
-    if (l_predicted_sorted)
-        free (l_predicted_sorted);
-    if (l_sort_structs)
-        free (l_sort_structs);
-    l_n_points_sorted = 0;
+    free_sorted ();
 
     return 0;
 }